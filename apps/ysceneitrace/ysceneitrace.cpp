@@ -145,6 +145,7 @@ void init_scene(trace_scene* scene, sceneio_scene* ioscene,
     camera->orthographic = iocamera->orthographic;
     camera->aperture     = iocamera->aperture;
     camera->focus        = iocamera->focus;
+    camera->shutter      = iocamera->shutter;
     camera_map[iocamera] = camera;
   }
 
@@ -221,13 +222,24 @@ void init_scene(trace_scene* scene, sceneio_scene* ioscene,
     shape_map[ioshape]      = shape;
   }
 
+  auto group_map     = unordered_map<sceneio_group*, trace_group*>{};
+  group_map[nullptr] = nullptr;
+  for (auto iogroup : ioscene->groups) {
+    auto group         = add_group(scene);
+    group->frames      = iogroup->frames;
+    group_map[iogroup] = group;
+  }
+
   for (auto ioinstance : ioscene->instances) {
     if (progress_cb)
       progress_cb("converting instances", progress.x++, progress.y);
-    auto instance      = add_instance(scene);
-    instance->frame    = ioinstance->frame;
-    instance->shape    = shape_map.at(ioinstance->shape);
-    instance->material = material_map.at(ioinstance->material);
+    auto instance          = add_instance(scene);
+    instance->frame        = ioinstance->frame;
+    instance->shape        = shape_map.at(ioinstance->shape);
+    instance->material     = material_map.at(ioinstance->material);
+    instance->group        = group_map.at(ioinstance->group);
+    instance->moving       = ioinstance->moving;
+    instance->motion_frame = ioinstance->motion_frame;
   }
 
   for (auto ioenvironment : ioscene->environments) {
@@ -590,6 +602,7 @@ void draw_widgets(gui_window* win, app_states* apps, const gui_input& input) {
       camera->orthographic = iocamera->orthographic;
       camera->aperture     = iocamera->aperture;
       camera->focus        = iocamera->focus;
+      camera->shutter      = iocamera->shutter;
       reset_display(app);
     }
     end_header(win);
@@ -770,6 +783,15 @@ int main(int argc, const char* argv[]) {
   add_optional(cli, "env-hidden", apps->params.envhidden,
       "Environments are hidden in renderer");
   add_optional(cli, "bvh", apps->params.bvh, "Bvh type", trace_bvh_labels);
+  add_optional(
+      cli, "bvh-width", apps->params.bvhwidth, "Bvh node width (2, 4, 8)");
+  add_optional(cli, "bvh-quantize", apps->params.bvhquantize,
+      "Bvh quantization bits (0, 8, 16)");
+  add_optional(cli, "bvh-precompute", apps->params.bvhprecompute,
+      "Precompute bvh leaf triangles");
+  add_optional(cli, "bvh-cache", apps->params.bvhcache, "Bvh cache directory");
+  add_optional(cli, "bvh-budget", apps->params.bvhbudget,
+      "Bvh spatial split extra references");
   add_optional(cli, "skyenv", add_skyenv, "Add sky envmap");
   add_positional(cli, "scenes", filenames, "Scene filenames");
   parse_cli(cli, argc, argv);
@@ -829,6 +829,11 @@ int main(int argc, const char* argv[]) {
     tesselate_shapes(scene, print_progress);
   }
 
+  // flatten instance groups if needed
+  if (path_extension(output) != ".json" && path_extension(output) != ".pbrt") {
+    flatten_instances(scene);
+  }
+
   // make a directory if needed
   if (!make_directory(path_dirname(output), ioerror)) print_fatal(ioerror);
   if (!scene->shapes.empty()) {
@@ -839,6 +844,10 @@ int main(int argc, const char* argv[]) {
     if (!make_directory(path_join(path_dirname(output), "textures"), ioerror))
       print_fatal(ioerror);
   }
+  if (!scene->groups.empty() && path_extension(output) == ".json") {
+    if (!make_directory(path_join(path_dirname(output), "instances"), ioerror))
+      print_fatal(ioerror);
+  }
 
   // save scene
   if (!save_scene(output, scene, ioerror, print_progress)) print_fatal(ioerror);
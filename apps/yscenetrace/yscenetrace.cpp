@@ -29,6 +29,7 @@
 #include <yocto/yocto_commonio.h>
 #include <yocto/yocto_image.h>
 #include <yocto/yocto_math.h>
+#include <yocto/yocto_parallel.h>
 #include <yocto/yocto_sceneio.h>
 #include <yocto/yocto_trace.h>
 using namespace yocto;
@@ -61,6 +62,7 @@ void init_scene(trace_scene* scene, sceneio_scene* ioscene,
     camera->orthographic = iocamera->orthographic;
     camera->aperture     = iocamera->aperture;
     camera->focus        = iocamera->focus;
+    camera->shutter      = iocamera->shutter;
     camera_map[iocamera] = camera;
   }
 
@@ -137,13 +139,24 @@ void init_scene(trace_scene* scene, sceneio_scene* ioscene,
     shape_map[ioshape]      = shape;
   }
 
+  auto group_map     = unordered_map<sceneio_group*, trace_group*>{};
+  group_map[nullptr] = nullptr;
+  for (auto iogroup : ioscene->groups) {
+    auto group         = add_group(scene);
+    group->frames      = iogroup->frames;
+    group_map[iogroup] = group;
+  }
+
   for (auto ioinstance : ioscene->instances) {
     if (progress_cb)
       progress_cb("converting instances", progress.x++, progress.y);
-    auto instance      = add_instance(scene);
-    instance->frame    = ioinstance->frame;
-    instance->shape    = shape_map.at(ioinstance->shape);
-    instance->material = material_map.at(ioinstance->material);
+    auto instance          = add_instance(scene);
+    instance->frame        = ioinstance->frame;
+    instance->shape        = shape_map.at(ioinstance->shape);
+    instance->material     = material_map.at(ioinstance->material);
+    instance->group        = group_map.at(ioinstance->group);
+    instance->moving       = ioinstance->moving;
+    instance->motion_frame = ioinstance->motion_frame;
   }
 
   for (auto ioenvironment : ioscene->environments) {
@@ -168,19 +181,35 @@ int main(int argc, const char* argv[]) {
   auto save_batch     = false;
   auto add_skyenv     = false;
   auto camera_name    = ""s;
+  auto shutter        = 0.0f;
   auto imfilename     = "out.hdr"s;
   auto filename       = "scene.json"s;
   auto feature_images = false;
+  auto threads        = 0;
+  auto print_stats    = false;
+  auto bvh_report     = ""s;
+  auto samples_image  = ""s;
 
   // parse command line
   auto cli = make_cli("yscenetrace", "Offline path tracing");
   add_optional(cli, "camera", camera_name, "Camera name.");
+  add_optional(cli, "shutter", shutter,
+      "Camera shutter interval for motion blur (0 to use the scene).");
   add_optional(cli, "resolution", params.resolution, "Image resolution.", "r");
   add_optional(cli, "samples", params.samples, "Number of samples.", "s");
+  add_optional(cli, "batch", params.batch, "Samples per tile in each pass.");
+  add_optional(cli, "adaptive", params.adaptive,
+      "Adaptive sampling relative error (0 to disable).");
+  add_optional(cli, "adaptive-max", params.adaptivemax,
+      "Adaptive sampling maximum samples (0 for 4 times samples).");
+  add_optional(
+      cli, "samples-image", samples_image, "Sample count heatmap filename.");
   add_optional(
       cli, "tracer", params.sampler, "Trace type.", trace_sampler_labels, "t");
   add_optional(cli, "falsecolor", params.falsecolor, "Tracer false color type.",
       trace_falsecolor_labels, "F");
+  add_optional(cli, "sequence", params.sequence, "Sampling sequence.",
+      trace_sequence_labels);
   add_optional(
       cli, "bounces", params.bounces, "Maximum number of bounces.", "b");
   add_optional(cli, "clamp", params.clamp, "Final pixel clamping.");
@@ -188,13 +217,28 @@ int main(int argc, const char* argv[]) {
   add_optional(cli, "env-hidden", params.envhidden, "Environments are hidden.");
   add_optional(cli, "save-batch", save_batch, "Save images progressively");
   add_optional(cli, "bvh", params.bvh, "Bvh type", trace_bvh_labels);
+  add_optional(cli, "bvh-width", params.bvhwidth, "Bvh node width (2, 4, 8)");
+  add_optional(cli, "bvh-quantize", params.bvhquantize,
+      "Bvh quantization bits (0, 8, 16)");
+  add_optional(cli, "bvh-precompute", params.bvhprecompute,
+      "Precompute bvh leaf triangles");
+  add_optional(cli, "bvh-cache", params.bvhcache, "Bvh cache directory");
+  add_optional(cli, "bvh-budget", params.bvhbudget,
+      "Bvh spatial split extra references");
   add_optional(cli, "skyenv", add_skyenv, "Add sky envmap");
   add_optional(cli, "output", imfilename, "Image filename", "o");
   add_optional(cli, "denoise-features", feature_images,
       "Generate denoise feature images", "d");
+  add_optional(cli, "threads", threads, "Number of threads (0 for all).");
+  add_optional(cli, "bvh-stats", print_stats, "Print bvh build statistics.");
+  add_optional(cli, "bvh-report", bvh_report,
+      "Save bvh statistics and traversal counters as json.");
   add_positional(cli, "scene", filename, "Scene filename");
   parse_cli(cli, argc, argv);
 
+  // threads
+  if (threads != 0) set_parallel_threads(threads);
+
   // scene loading
   auto ioscene_guard = std::make_unique<sceneio_scene>();
   auto ioscene       = ioscene_guard.get();
@@ -207,6 +251,7 @@ int main(int argc, const char* argv[]) {
 
   // get camera
   auto iocamera = get_camera(ioscene, camera_name);
+  if (shutter > 0 && iocamera) iocamera->shutter = {0, shutter};
 
   // scene conversion
   auto scene_guard = std::make_unique<trace_scene>();
@@ -223,7 +268,56 @@ int main(int argc, const char* argv[]) {
   // build bvh
   auto bvh_guard = std::make_unique<trace_bvh>();
   auto bvh       = bvh_guard.get();
+  auto bvh_timer = simple_timer{};
   init_bvh(bvh, scene, params, print_progress);
+  auto bvh_time = elapsed_nanoseconds(bvh_timer);
+  // shapes cost weighted by their number of elements
+  auto shapes_cost = [](const trace_bvh* bvh) {
+    auto cost = 0.0, num_elements = 0.0;
+    for (auto shape : bvh->shapes) {
+      auto num = (double)(shape->points.size() + shape->lines.size() +
+                          shape->triangles.size() + shape->quads.size());
+      cost += compute_sah_cost(shape->bvh) * num;
+      num_elements += num;
+    }
+    return num_elements ? cost / num_elements : 0;
+  };
+  if (params.bvhquantize != 0) {
+    print_info("bvh quantized: packets and streams trace single rays");
+  }
+  if (print_stats) {
+    print_info("bvh build time: " + format_duration(bvh_time));
+    if (params.bvhquantize == 0) {
+      print_info("bvh scene sah cost: " +
+                 std::to_string(compute_sah_cost(bvh->bvh)));
+      print_info("bvh shapes sah cost: " + std::to_string(shapes_cost(bvh)));
+    }
+    auto memory = compute_memory(bvh->bvh);
+    for (auto shape : bvh->shapes) {
+      auto shape_memory = compute_memory(shape->bvh);
+      memory.bytes += shape_memory.bytes;
+      memory.uncompressed += shape_memory.uncompressed;
+    }
+    print_info("bvh memory: " + std::to_string(memory.bytes) +
+               " bytes, uncompressed " + std::to_string(memory.uncompressed) +
+               " bytes");
+    if (params.bvhprecompute) {
+      auto leaf_bytes = (size_t)0;
+      for (auto shape : bvh->shapes)
+        leaf_bytes += shape->leaf_triangles.size() * sizeof(bvh_triangle);
+      print_info(
+          "bvh leaf triangles: " + std::to_string(leaf_bytes) + " bytes");
+    }
+    // compare spatial splits with a high quality bvh
+    if (params.bvh == trace_bvh_type::spatial) {
+      auto hq_params = params;
+      hq_params.bvh  = trace_bvh_type::highquality;
+      auto hq_guard  = std::make_unique<trace_bvh>();
+      init_bvh(hq_guard.get(), scene, hq_params);
+      print_info("bvh highquality shapes sah cost: " +
+                 std::to_string(shapes_cost(hq_guard.get())));
+    }
+  }
 
   // init renderer
   auto lights_guard = std::make_unique<trace_lights>();
@@ -237,7 +331,12 @@ int main(int argc, const char* argv[]) {
   }
 
   // render
-  auto render = trace_image(scene, camera, bvh, lights, params, print_progress,
+  reset_bvh_counters();
+  auto render_timer = simple_timer{};
+  auto state_guard  = std::make_unique<trace_state>();
+  auto state        = state_guard.get();
+  auto render       = trace_image(state, scene, camera, bvh, lights, params,
+      print_progress,
       [save_batch, imfilename](
           const image<vec4f>& render, int sample, int samples) {
         if (!save_batch) return;
@@ -249,11 +348,82 @@ int main(int argc, const char* argv[]) {
         if (!save_image(outfilename, render, ioerror)) print_fatal(ioerror);
       });
 
+  auto render_time = elapsed_nanoseconds(render_timer);
+
   // save image
   print_progress("save image", 0, 1);
   if (!save_image(imfilename, render, ioerror)) print_fatal(ioerror);
   print_progress("save image", 1, 1);
 
+  // save sample counts
+  if (params.adaptive > 0) {
+    auto total_samples = (size_t)0;
+    for (auto samples : state->samples) total_samples += samples;
+    print_info("average samples: " +
+               std::to_string((double)total_samples / state->samples.count()));
+  }
+  if (!samples_image.empty()) {
+    if (!save_image(samples_image, get_samples_heatmap(state), ioerror))
+      print_fatal(ioerror);
+  }
+
+  // save bvh report, with shapes statistics merged in a single histogram
+  if (!bvh_report.empty()) {
+    auto stats_json = [](const bvh_stats& stats) {
+      auto json            = json_value::object();
+      json["sah_cost"]     = stats.sah_cost;
+      json["nodes"]        = stats.nodes;
+      json["leaves"]       = stats.leaves;
+      json["depths"]       = stats.depths;
+      json["leaf_sizes"]   = stats.leaf_sizes;
+      json["overlap"]      = stats.overlap;
+      json["bytes"]        = stats.memory.bytes;
+      json["uncompressed"] = stats.memory.uncompressed;
+      return json;
+    };
+    auto merge_histogram = [](vector<int>&       histogram,
+                               const vector<int>& other) {
+      if (histogram.size() < other.size()) histogram.resize(other.size());
+      for (auto idx = 0; idx < (int)other.size(); idx++)
+        histogram[idx] += other[idx];
+    };
+    auto shapes_stats = bvh_stats{};
+    auto overlap      = 0.0;
+    for (auto shape : bvh->shapes) {
+      auto stats = compute_stats(shape->bvh);
+      shapes_stats.nodes += stats.nodes;
+      shapes_stats.leaves += stats.leaves;
+      merge_histogram(shapes_stats.depths, stats.depths);
+      merge_histogram(shapes_stats.leaf_sizes, stats.leaf_sizes);
+      overlap += (double)stats.overlap * (stats.nodes - stats.leaves);
+      shapes_stats.memory.bytes += stats.memory.bytes;
+      shapes_stats.memory.uncompressed += stats.memory.uncompressed;
+    }
+    shapes_stats.sah_cost = (float)shapes_cost(bvh);
+    if (shapes_stats.nodes > shapes_stats.leaves)
+      shapes_stats.overlap = (float)(
+          overlap / (shapes_stats.nodes - shapes_stats.leaves));
+    auto counters = bvh_counters{};
+    auto rays     = vector<uint64_t>{};
+    for (auto& thread_counters : get_bvh_thread_counters()) {
+      counters.rays += thread_counters.rays;
+      counters.nodes += thread_counters.nodes;
+      counters.elements += thread_counters.elements;
+      rays.push_back(thread_counters.rays);
+    }
+    auto report                       = json_value::object();
+    report["build_time"]              = bvh_time;
+    report["render_time"]             = render_time;
+    report["scene"]                   = stats_json(compute_stats(bvh->bvh));
+    report["shapes"]                  = stats_json(shapes_stats);
+    report["counters"]                = json_value::object();
+    report["counters"]["rays"]        = counters.rays;
+    report["counters"]["nodes"]       = counters.nodes;
+    report["counters"]["elements"]    = counters.elements;
+    report["counters"]["thread_rays"] = rays;
+    if (!save_json(bvh_report, report, ioerror)) print_fatal(ioerror);
+  }
+
   if (feature_images) {
     const int   feature_bounces = 5;
     const int   feature_samples = 8;
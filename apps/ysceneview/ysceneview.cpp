@@ -124,6 +124,7 @@ void load_scene_async(
       return;
     app->iocamera = get_camera(app->ioscene, camera_name);
     tesselate_shapes(app->ioscene, progress_cb);
+    flatten_instances(app->ioscene);
   });
   apps->loading.push_back(app);
   if (!apps->selected) apps->selected = app;
@@ -216,6 +216,7 @@ int main(int argc, const char* argv[]) {
 
   // tesselation
   tesselate_shapes(app->ioscene, print_progress);
+  flatten_instances(app->ioscene);
 
   // callbacks
   auto callbacks    = gui_callbacks{};
@@ -60,6 +60,7 @@ void init_scene(trace_scene* scene, sceneio_scene* ioscene,
     camera->orthographic = iocamera->orthographic;
     camera->aperture     = iocamera->aperture;
     camera->focus        = iocamera->focus;
+    camera->shutter      = iocamera->shutter;
     camera_map[iocamera] = camera;
   }
 
@@ -136,13 +137,24 @@ void init_scene(trace_scene* scene, sceneio_scene* ioscene,
     shape_map[ioshape]      = shape;
   }
 
+  auto group_map     = unordered_map<sceneio_group*, trace_group*>{};
+  group_map[nullptr] = nullptr;
+  for (auto iogroup : ioscene->groups) {
+    auto group         = add_group(scene);
+    group->frames      = iogroup->frames;
+    group_map[iogroup] = group;
+  }
+
   for (auto ioinstance : ioscene->instances) {
     if (progress_cb)
       progress_cb("converting instances", progress.x++, progress.y);
-    auto instance      = add_instance(scene);
-    instance->frame    = ioinstance->frame;
-    instance->shape    = shape_map.at(ioinstance->shape);
-    instance->material = material_map.at(ioinstance->material);
+    auto instance          = add_instance(scene);
+    instance->frame        = ioinstance->frame;
+    instance->shape        = shape_map.at(ioinstance->shape);
+    instance->material     = material_map.at(ioinstance->material);
+    instance->group        = group_map.at(ioinstance->group);
+    instance->moving       = ioinstance->moving;
+    instance->motion_frame = ioinstance->motion_frame;
   }
 
   for (auto ioenvironment : ioscene->environments) {
@@ -35,13 +35,23 @@
 #include <algorithm>
 #include <array>
 #include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
 #include <cstring>
 #include <deque>
+#include <future>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <random>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <utility>
 
+#include "yocto_commonio.h"
 #include "yocto_geometry.h"
 #include "yocto_parallel.h"
 
@@ -49,6 +59,10 @@
 #include <embree3/rtcore.h>
 #endif
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
 // -----------------------------------------------------------------------------
 // USING DIRECTIVES
 // -----------------------------------------------------------------------------
@@ -187,6 +201,10 @@ static void init_embree_bvh(bvh_shape* shape, const bvh_params& params) {
 }
 
 static void init_embree_bvh(bvh_scene* scene, const bvh_params& params) {
+  // check groups
+  if (!scene->groups.empty())
+    throw std::runtime_error("embree groups not supported");
+
   // scene bvh
   auto edevice      = bvh_embree_device();
   scene->embree_bvh = rtcNewScene(edevice);
@@ -290,6 +308,7 @@ bvh_shape::~bvh_shape() {
 
 bvh_scene::~bvh_scene() {
   for (auto shape : shapes) delete shape;
+  for (auto group : groups) delete group;
 #ifdef YOCTO_EMBREE
   if (embree_bvh) rtcReleaseScene(embree_bvh);
 #endif
@@ -344,6 +363,16 @@ void set_instances(bvh_scene* bvh, int num_instances,
   }
 }
 
+// Add instance groups
+int add_group(bvh_scene* bvh, int shape, const vector<frame3f>& frames,
+    bool as_view) {
+  auto group         = bvh->groups.emplace_back(new bvh_group{});
+  group->shape       = shape;
+  group->frames_data = as_view ? vector<frame3f>{} : frames;
+  group->frames = as_view ? bvh_span{frames} : bvh_span{group->frames_data};
+  return (int)bvh->groups.size() - 1;
+}
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -351,7 +380,99 @@ void set_instances(bvh_scene* bvh, int num_instances,
 // -----------------------------------------------------------------------------
 namespace yocto {
 
+// Surface area of a bounding box, used by the SAH heuristic.
+static float bbox_area(const bbox3f& bbox) {
+  auto size = bbox.max - bbox.min;
+  return 1e-12f + 2 * size.x * size.y + 2 * size.x * size.z +
+         2 * size.y * size.z;
+}
+
+// Number of bins used by the SAH heuristic.
+const int bvh_sah_bins = 32;
+
+// Bin of a primitive center along an axis for the SAH heuristic.
+static int sah_bin(const vec3f& center, const bbox3f& cbbox, int axis) {
+  auto bin = (int)(bvh_sah_bins * (center[axis] - cbbox.min[axis]) /
+                   (cbbox.max[axis] - cbbox.min[axis]));
+  return clamp(bin, 0, bvh_sah_bins - 1);
+}
+
+// Bins used by the SAH heuristic, for all axes.
+struct sah_bin_data {
+  bbox3f bbox  = invalidb3f;
+  int    count = 0;
+};
+using sah_bins = array<array<sah_bin_data, bvh_sah_bins>, 3>;
+
+// Bin primitives along all axes for the SAH heuristic.
+static void bin_primitives(sah_bins& bins, const vector<int>& primitives,
+    const vector<bbox3f>& bboxes, const vector<vec3f>& centers, int start,
+    int end, const bbox3f& cbbox) {
+  auto csize = cbbox.max - cbbox.min;
+  for (auto i = start; i < end; i++) {
+    auto primitive = primitives[i];
+    for (auto axis = 0; axis < 3; axis++) {
+      if (csize[axis] == 0) continue;
+      auto& bin = bins[axis][sah_bin(centers[primitive], cbbox, axis)];
+      bin.bbox  = merge(bin.bbox, bboxes[primitive]);
+      bin.count += 1;
+    }
+  }
+}
+
+// Merge bins computed over different primitives.
+static sah_bins merge_bins(const sah_bins& a, const sah_bins& b) {
+  auto bins = a;
+  for (auto axis = 0; axis < 3; axis++) {
+    for (auto bin = 0; bin < bvh_sah_bins; bin++) {
+      bins[axis][bin].bbox = merge(bins[axis][bin].bbox, b[axis][bin].bbox);
+      bins[axis][bin].count += b[axis][bin].count;
+    }
+  }
+  return bins;
+}
+
+// Find the split with minimum SAH cost by sweeping the bins from both sides.
+// Returns the split axis and bin, with bin 0 if no split was found.
+static pair<int, int> sweep_bins(
+    const sah_bins& bins, const bbox3f& bbox, const bbox3f& cbbox) {
+  auto csize      = cbbox.max - cbbox.min;
+  auto split_axis = 0, split_bin = 0;
+  auto min_cost   = flt_max;
+  for (auto axis = 0; axis < 3; axis++) {
+    if (csize[axis] == 0) continue;
+    auto right_areas  = array<float, bvh_sah_bins>{};
+    auto right_counts = array<int, bvh_sah_bins>{};
+    auto right_bbox   = invalidb3f;
+    auto right_count  = 0;
+    for (auto b = bvh_sah_bins - 1; b > 0; b--) {
+      right_bbox      = merge(right_bbox, bins[axis][b].bbox);
+      right_count     = right_count + bins[axis][b].count;
+      right_areas[b]  = bbox_area(right_bbox);
+      right_counts[b] = right_count;
+    }
+    auto left_bbox  = invalidb3f;
+    auto left_count = 0;
+    for (auto b = 1; b < bvh_sah_bins; b++) {
+      left_bbox  = merge(left_bbox, bins[axis][b - 1].bbox);
+      left_count = left_count + bins[axis][b - 1].count;
+      if (left_count == 0 || right_counts[b] == 0) continue;
+      auto cost = 1 + (left_count * bbox_area(left_bbox) +
+                          right_counts[b] * right_areas[b]) /
+                          bbox_area(bbox);
+      if (cost < min_cost) {
+        min_cost   = cost;
+        split_bin  = b;
+        split_axis = axis;
+      }
+    }
+  }
+  return {split_axis, split_bin};
+}
+
 // Splits a BVH node using the SAH heuristic. Returns split position and axis.
+// Primitives are binned along each axis in a single pass, and the split
+// costs are evaluated by sweeping the bins from both sides.
 static pair<int, int> split_sah(vector<int>& primitives,
     const vector<bbox3f>& bboxes, const vector<vec3f>& centers, int start,
     int end) {
@@ -360,48 +481,25 @@ static pair<int, int> split_sah(vector<int>& primitives,
   auto mid        = (start + end) / 2;
 
   // compute primintive bounds and size
-  auto cbbox = invalidb3f;
-  for (auto i = start; i < end; i++)
+  auto bbox = invalidb3f, cbbox = invalidb3f;
+  for (auto i = start; i < end; i++) {
+    bbox  = merge(bbox, bboxes[primitives[i]]);
     cbbox = merge(cbbox, centers[primitives[i]]);
+  }
   auto csize = cbbox.max - cbbox.min;
   if (csize == zero3f) return {mid, split_axis};
 
-  // consider N bins, compute their cost and keep the minimum
-  const int nbins    = 16;
-  auto      middle   = 0.0f;
-  auto      min_cost = flt_max;
-  auto      area     = [](auto& b) {
-    auto size = b.max - b.min;
-    return 1e-12f + 2 * size.x * size.y + 2 * size.x * size.z +
-           2 * size.y * size.z;
-  };
-  for (auto saxis = 0; saxis < 3; saxis++) {
-    for (auto b = 1; b < nbins; b++) {
-      auto split     = cbbox.min[saxis] + b * csize[saxis] / nbins;
-      auto left_bbox = invalidb3f, right_bbox = invalidb3f;
-      auto left_nprims = 0, right_nprims = 0;
-      for (auto i = start; i < end; i++) {
-        if (centers[primitives[i]][saxis] < split) {
-          left_bbox = merge(left_bbox, bboxes[primitives[i]]);
-          left_nprims += 1;
-        } else {
-          right_bbox = merge(right_bbox, bboxes[primitives[i]]);
-          right_nprims += 1;
-        }
-      }
-      auto cost = 1 + left_nprims * area(left_bbox) / area(cbbox) +
-                  right_nprims * area(right_bbox) / area(cbbox);
-      if (cost < min_cost) {
-        min_cost   = cost;
-        middle     = split;
-        split_axis = saxis;
-      }
-    }
-  }
+  // bin primitives and find the best split
+  auto bins = sah_bins{};
+  bin_primitives(bins, primitives, bboxes, centers, start, end, cbbox);
+  auto split_bin                  = 0;
+  std::tie(split_axis, split_bin) = sweep_bins(bins, bbox, cbbox);
+
   // split
   mid = (int)(std::partition(primitives.data() + start, primitives.data() + end,
-                  [split_axis, middle, &centers](
-                      auto a) { return centers[a][split_axis] < middle; }) -
+                  [split_axis, split_bin, &cbbox, &centers](auto a) {
+                    return sah_bin(centers[a], cbbox, split_axis) < split_bin;
+                  }) -
               primitives.data());
 
   // if we were not able to split, just break the primitives in half
@@ -492,10 +590,60 @@ static pair<int, int> split_middle(vector<int>& primitives,
   return {mid, axis};
 }
 
+// Spread the lowest 21 bits of a value so that they occupy every third bit.
+static uint64_t morton_spread(uint64_t x) {
+  x &= 0x1fffff;
+  x = (x | x << 32) & 0x1f00000000ffff;
+  x = (x | x << 16) & 0x1f0000ff0000ff;
+  x = (x | x << 8) & 0x100f00f00f00f00f;
+  x = (x | x << 4) & 0x10c30c30c30c30c3;
+  x = (x | x << 2) & 0x1249249249249249;
+  return x;
+}
+
+// Morton code of a point quantized in a grid of 2^bits cells per axis
+// covering the bounding box. Bits are interleaved as xyz from the top.
+static uint64_t morton_code(const vec3f& point, const bbox3f& bbox, int bits) {
+  auto cells = (float)(1 << bits);
+  auto size  = bbox.max - bbox.min;
+  auto scale = vec3f{size.x != 0 ? cells / size.x : 0,
+      size.y != 0 ? cells / size.y : 0, size.z != 0 ? cells / size.z : 0};
+  auto cell = clamp((point - bbox.min) * scale, 0.0f, cells - 1);
+  return morton_spread((uint64_t)cell.x) << 2 |
+         morton_spread((uint64_t)cell.y) << 1 | morton_spread((uint64_t)cell.z);
+}
+
+// Splits a BVH node whose primitives are sorted by Morton code at the highest
+// bit where the codes differ, found by binary search. Returns split position
+// and axis.
+static pair<int, int> split_morton(vector<int>& primitives,
+    const vector<uint64_t>& codes, int start, int end) {
+  // initialize split axis and position
+  auto axis = 0;
+  auto mid  = (start + end) / 2;
+
+  // if codes are equal, just break the primitives in half
+  auto first = codes[primitives[start]], last = codes[primitives[end - 1]];
+  if (first == last) return {mid, axis};
+
+  // find the highest differing bit, which alternates axes as zyx from bit 0
+  auto bit = 63;
+  while (((first ^ last) >> bit) == 0) bit--;
+  axis = 2 - bit % 3;
+
+  // split at the first primitive with the bit set
+  mid = (int)(std::partition_point(primitives.data() + start,
+                  primitives.data() + end,
+                  [bit, &codes](auto a) { return !((codes[a] >> bit) & 1); }) -
+              primitives.data());
+
+  return {mid, axis};
+}
+
 // Split bvh nodes according to a type
 static pair<int, int> split_nodes(vector<int>& primitives,
-    const vector<bbox3f>& bboxes, const vector<vec3f>& centers, int start,
-    int end, bvh_build_type type) {
+    const vector<bbox3f>& bboxes, const vector<vec3f>& centers,
+    const vector<uint64_t>& codes, int start, int end, bvh_build_type type) {
   switch (type) {
     case bvh_build_type::default_:
       return split_middle(primitives, bboxes, centers, start, end);
@@ -505,39 +653,163 @@ static pair<int, int> split_nodes(vector<int>& primitives,
       return split_middle(primitives, bboxes, centers, start, end);
     case bvh_build_type::balanced:
       return split_balanced(primitives, bboxes, centers, start, end);
+    case bvh_build_type::lbvh:
+      return split_morton(primitives, codes, start, end);
     default: throw std::runtime_error("should not have gotten here");
   }
 }
 
+// Loop over ranges of indices in parallel, unless `noparallel` is set.
+template <typename Func>
+static void bvh_for_range(size_t num, bool noparallel, Func&& func) {
+  if (noparallel) {
+    func((size_t)0, num);
+  } else {
+    parallel_for_range(num, (size_t)0, func);
+  }
+}
+
+// Compute the bounds of shape elements
+static vector<bbox3f> compute_bboxes(const bvh_shape* shape, bool noparallel) {
+  auto bboxes = vector<bbox3f>{};
+  if (!shape->points.empty()) {
+    bboxes = vector<bbox3f>(shape->points.size());
+    bvh_for_range(bboxes.size(), noparallel, [&](size_t start, size_t end) {
+      for (auto idx = start; idx < end; idx++) {
+        auto& p     = shape->points[idx];
+        bboxes[idx] = point_bounds(shape->positions[p], shape->radius[p]);
+      }
+    });
+  } else if (!shape->lines.empty()) {
+    bboxes = vector<bbox3f>(shape->lines.size());
+    bvh_for_range(bboxes.size(), noparallel, [&](size_t start, size_t end) {
+      for (auto idx = start; idx < end; idx++) {
+        auto& l     = shape->lines[idx];
+        bboxes[idx] = line_bounds(shape->positions[l.x],
+            shape->positions[l.y], shape->radius[l.x], shape->radius[l.y]);
+      }
+    });
+  } else if (!shape->triangles.empty()) {
+    bboxes = vector<bbox3f>(shape->triangles.size());
+    bvh_for_range(bboxes.size(), noparallel, [&](size_t start, size_t end) {
+      for (auto idx = start; idx < end; idx++) {
+        auto& t     = shape->triangles[idx];
+        bboxes[idx] = triangle_bounds(shape->positions[t.x],
+            shape->positions[t.y], shape->positions[t.z]);
+      }
+    });
+  } else if (!shape->quads.empty()) {
+    bboxes = vector<bbox3f>(shape->quads.size());
+    bvh_for_range(bboxes.size(), noparallel, [&](size_t start, size_t end) {
+      for (auto idx = start; idx < end; idx++) {
+        auto& q     = shape->quads[idx];
+        bboxes[idx] = quad_bounds(shape->positions[q.x],
+            shape->positions[q.y], shape->positions[q.z],
+            shape->positions[q.w]);
+      }
+    });
+  }
+  return bboxes;
+}
+
+// Number of Morton code bits per axis. Codes have 30 bits, or 63 bits for
+// more than four million primitives.
+static int morton_bits(int num_primitives) {
+  return num_primitives <= (1 << 22) ? 10 : 21;
+}
+
+// Compute the Morton codes of primitive centers quantized in their bounds,
+// and sort primitives by code. Returns the codes indexed by primitive.
+static vector<uint64_t> sort_morton(
+    vector<int>& primitives, const vector<vec3f>& centers, bool noparallel) {
+  // compute bounds
+  auto num   = (int)centers.size();
+  auto cbbox = invalidb3f;
+  if (noparallel) {
+    for (auto& center : centers) cbbox = merge(cbbox, center);
+  } else {
+    cbbox = parallel_reduce(
+        num, invalidb3f,
+        [&centers](int start, int end) {
+          auto cbbox = invalidb3f;
+          for (auto idx = start; idx < end; idx++)
+            cbbox = merge(cbbox, centers[idx]);
+          return cbbox;
+        },
+        [](const bbox3f& a, const bbox3f& b) { return merge(a, b); });
+  }
+
+  // compute codes
+  auto codes = vector<uint64_t>(num);
+  bvh_for_range(codes.size(), noparallel, [&](size_t start, size_t end) {
+    for (auto idx = start; idx < end; idx++)
+      codes[idx] = morton_code(centers[idx], cbbox, morton_bits(num));
+  });
+
+  // sort primitives, keeping codes next to them to avoid scattered reads
+  auto sorted = vector<pair<uint64_t, int>>(num);
+  bvh_for_range(sorted.size(), noparallel, [&](size_t start, size_t end) {
+    for (auto idx = start; idx < end; idx++)
+      sorted[idx] = {codes[primitives[idx]], primitives[idx]};
+  });
+  if (noparallel) {
+    std::stable_sort(sorted.begin(), sorted.end(),
+        [](auto& a, auto& b) { return a.first < b.first; });
+  } else {
+    parallel_radix_sort(sorted, [](auto& a) { return a.first; });
+  }
+  bvh_for_range(sorted.size(), noparallel, [&](size_t start, size_t end) {
+    for (auto idx = start; idx < end; idx++)
+      primitives[idx] = sorted[idx].second;
+  });
+  return codes;
+}
+
 // Maximum number of primitives per BVH node.
 const int bvh_max_prims = 4;
 
-// Build BVH nodes
-static void build_bvh_serial(
-    bvh_tree& bvh, const vector<bbox3f>& bboxes, const bvh_params& params) {
-  // get values
-  auto& nodes      = bvh.nodes;
-  auto& primitives = bvh.primitives;
+// Compute the bounds of the nodes in [first, last) from their children or
+// primitives. Nodes are visited in reverse order, since children are stored
+// after their parents.
+static void refit_nodes(vector<bvh_node>& nodes, const vector<int>& primitives,
+    const vector<bbox3f>& bboxes, int first, int last) {
+  for (auto nodeid = last - 1; nodeid >= first; nodeid--) {
+    auto& node = nodes[nodeid];
+    node.bbox  = invalidb3f;
+    if (node.internal) {
+      for (auto idx = 0; idx < 2; idx++) {
+        node.bbox = merge(node.bbox, nodes[node.start + idx].bbox);
+      }
+    } else {
+      for (auto idx = 0; idx < node.num; idx++) {
+        node.bbox = merge(node.bbox, bboxes[primitives[node.start + idx]]);
+      }
+    }
+  }
+}
 
+// Build BVH nodes for the primitives in [first, last), with the subtree root
+// as the first node and at most `max_prims` primitives per leaf. Morton builds
+// skip node bounds while splitting and refit them at the end.
+static void build_nodes(vector<bvh_node>& nodes, vector<int>& primitives,
+    const vector<bbox3f>& bboxes, const vector<vec3f>& centers,
+    const vector<uint64_t>& codes, int first, int last, bvh_build_type type,
+    int max_prims, const cancel_token* cancel) {
   // prepare to build nodes
   nodes.clear();
-  nodes.reserve(bboxes.size() * 2);
-
-  // prepare primitives
-  bvh.primitives.resize(bboxes.size());
-  for (auto idx = 0; idx < bboxes.size(); idx++) bvh.primitives[idx] = idx;
-
-  // prepare centers
-  auto centers = vector<vec3f>(bboxes.size());
-  for (auto idx = 0; idx < bboxes.size(); idx++)
-    centers[idx] = center(bboxes[idx]);
 
   // queue up first node
-  auto queue = deque<vec3i>{{0, 0, (int)bboxes.size()}};
+  auto queue = deque<vec3i>{{0, first, last}};
   nodes.emplace_back();
 
   // create nodes until the queue is empty
   while (!queue.empty()) {
+    // check for cancellation
+    if (is_canceled(cancel)) {
+      nodes.clear();
+      return;
+    }
+
     // grab node to work on
     auto next = queue.front();
     queue.pop_front();
@@ -547,25 +819,27 @@ static void build_bvh_serial(
     auto& node = nodes[nodeid];
 
     // compute bounds
-    node.bbox = invalidb3f;
-    for (auto i = start; i < end; i++)
-      node.bbox = merge(node.bbox, bboxes[primitives[i]]);
+    if (type != bvh_build_type::lbvh) {
+      node.bbox = invalidb3f;
+      for (auto i = start; i < end; i++)
+        node.bbox = merge(node.bbox, bboxes[primitives[i]]);
+    }
 
     // split into two children
-    if (end - start > bvh_max_prims) {
+    if (end - start > max_prims) {
       // get split
       auto [mid, axis] = split_nodes(
-          primitives, bboxes, centers, start, end, params.bvh);
+          primitives, bboxes, centers, codes, start, end, type);
 
       // make an internal node
       node.internal = true;
       node.axis     = (uint8_t)axis;
       node.num      = 2;
       node.start    = (int)nodes.size();
-      nodes.emplace_back();
-      nodes.emplace_back();
       queue.push_back({node.start + 0, start, mid});
       queue.push_back({node.start + 1, mid, end});
+      nodes.emplace_back();
+      nodes.emplace_back();
     } else {
       // Make a leaf node
       node.internal = false;
@@ -574,23 +848,18 @@ static void build_bvh_serial(
     }
   }
 
+  // refit bounds for Morton splits
+  if (type == bvh_build_type::lbvh) {
+    refit_nodes(nodes, primitives, bboxes, 0, (int)nodes.size());
+  }
+
   // cleanup
   nodes.shrink_to_fit();
 }
 
-#if 0
-
 // Build BVH nodes
-static void build_bvh_parallel(
-    bvh_tree_& bvh, const vector<bbox3f>& bboxes, bvh_build_type type) {
-  // get values
-  auto& nodes      = bvh.nodes;
-  auto& primitives = bvh.primitives;
-
-  // prepare to build nodes
-  nodes.clear();
-  nodes.reserve(bboxes.size() * 2);
-
+static void build_bvh_serial(bvh_tree& bvh, const vector<bbox3f>& bboxes,
+    const bvh_params& params, const cancel_token* cancel) {
   // prepare primitives
   bvh.primitives.resize(bboxes.size());
   for (auto idx = 0; idx < bboxes.size(); idx++) bvh.primitives[idx] = idx;
@@ -600,301 +869,2878 @@ static void build_bvh_parallel(
   for (auto idx = 0; idx < bboxes.size(); idx++)
     centers[idx] = center(bboxes[idx]);
 
-  // queue up first node
-  auto queue = deque<vec3i>{{0, 0, (int)primitives.size()}};
-  nodes.emplace_back();
+  // sort primitives by Morton code
+  auto codes = vector<uint64_t>{};
+  if (params.bvh == bvh_build_type::lbvh)
+    codes = sort_morton(bvh.primitives, centers, true);
 
-  // synchronization
-  atomic<int>          num_processed_prims(0);
-  std::mutex           queue_mutex;
-  vector<future<void>> futures;
-  auto                 nthreads = std::thread::hardware_concurrency();
+  // build nodes
+  build_nodes(bvh.nodes, bvh.primitives, bboxes, centers, codes, 0,
+      (int)bboxes.size(), params.bvh, bvh_max_prims, cancel);
+  if (bvh.nodes.empty()) bvh.primitives.clear();
+}
 
-  // create nodes until the queue is empty
-  for (auto thread_id = 0; thread_id < nthreads; thread_id++) {
-    futures.emplace_back(std::async(
-        std::launch::async, [&nodes, &primitives, &bboxes, &centers, &type,
-                                &num_processed_prims, &queue_mutex, &queue] {
-          while (true) {
-            // exit if needed
-            if (num_processed_prims >= primitives.size()) return;
-
-            // grab node to work on
-            auto next = zero3i;
-            {
-              std::lock_guard<std::mutex> lock{queue_mutex};
-              if (!queue.empty()) {
-                next = queue.front();
-                queue.pop_front();
-              }
-            }
-
-            // wait a bit if needed
-            if (next == zero3i) {
-              std::this_thread::sleep_for(std::chrono::microseconds(10));
-              continue;
-            }
-
-            // grab node
-            auto  nodeid = next.x, start = next.y, end = next.z;
-            auto& node = nodes[nodeid];
-
-            // compute bounds
-            node.bbox = invalidb3f;
-            for (auto i = start; i < end; i++)
-              node.bbox = merge(node.bbox, bboxes[primitives[i]]);
-
-            // split into two children
-            if (end - start > bvh_max_prims) {
-              // get split
-              auto [mid, axis] = split_nodes(
-                  primitives, bboxes, centers, start, end, type);
-
-              // make an internal node
-              {
-                std::lock_guard<std::mutex> lock{queue_mutex};
-                node.internal = true;
-                node.axis     = (int8_t)axis;
-                node.num      = 2;
-                node.start    = (int)nodes.size();
-                nodes.emplace_back();
-                nodes.emplace_back();
-                queue.push_back({node.start + 0, start, mid});
-                queue.push_back({node.start + 1, mid, end});
-              }
-            } else {
-              // Make a leaf node
-              node.internal = false;
-              node.num      = (int16_t)(end - start);
-              node.start    = start;
-              num_processed_prims += node.num;
-            }
-          }
-        }));
+// Minimum number of primitives for a node to be split with parallel binning
+// and partitioning. Smaller nodes are built as independent subtrees.
+const int bvh_parallel_prims = 16384;
+
+// Partition primitives in parallel, preserving their order.
+template <typename Pred>
+static int partition_parallel(
+    vector<int>& primitives, int start, int end, Pred&& pred) {
+  const auto block_size = 4096;
+  auto       num        = end - start;
+  auto       num_blocks = (num + block_size - 1) / block_size;
+  auto block_start = [start, end](int block) {
+    return std::min(start + block * block_size, end);
+  };
+
+  // count left primitives in each block
+  auto offsets = vector<int>(num_blocks);
+  parallel_for(num_blocks, [&](int block) {
+    auto count = 0;
+    for (auto i = block_start(block); i < block_start(block + 1); i++)
+      count += pred(primitives[i]) ? 1 : 0;
+    offsets[block] = count;
+  });
+  auto num_left = 0;
+  for (auto& offset : offsets) {
+    auto count = offset;
+    offset     = num_left;
+    num_left += count;
   }
-  for (auto& f : futures) f.get();
 
-  // cleanup
-  nodes.shrink_to_fit();
+  // scatter primitives and copy them back
+  auto buffer = vector<int>(num);
+  parallel_for(num_blocks, [&](int block) {
+    auto left  = offsets[block];
+    auto right = num_left + block * block_size - offsets[block];
+    for (auto i = block_start(block); i < block_start(block + 1); i++) {
+      buffer[pred(primitives[i]) ? left++ : right++] = primitives[i];
+    }
+  });
+  parallel_for(num_blocks, [&](int block) {
+    std::copy(buffer.begin() + (block_start(block) - start),
+        buffer.begin() + (block_start(block + 1) - start),
+        primitives.begin() + block_start(block));
+  });
+  return start + num_left;
 }
 
-#endif
+// Splits a large BVH node using parallel binning and partitioning. Returns
+// split position and axis, and sets the node bounds. The balanced heuristic
+// is computed serially since it relies on a selection algorithm.
+static pair<int, int> split_nodes_parallel(vector<int>& primitives,
+    const vector<bbox3f>& bboxes, const vector<vec3f>& centers, int start,
+    int end, bvh_build_type type, bbox3f& bbox) {
+  // compute bounds
+  auto [bbox_, cbbox] = parallel_reduce(
+      end - start, pair<bbox3f, bbox3f>{invalidb3f, invalidb3f},
+      [&](int range_start, int range_end) {
+        auto bbox = invalidb3f, cbbox = invalidb3f;
+        for (auto i = start + range_start; i < start + range_end; i++) {
+          bbox  = merge(bbox, bboxes[primitives[i]]);
+          cbbox = merge(cbbox, centers[primitives[i]]);
+        }
+        return pair<bbox3f, bbox3f>{bbox, cbbox};
+      },
+      [](const pair<bbox3f, bbox3f>& a, const pair<bbox3f, bbox3f>& b) {
+        return pair<bbox3f, bbox3f>{
+            merge(a.first, b.first), merge(a.second, b.second)};
+      });
+  bbox = bbox_;
 
-// Update bvh
-static void update_bvh(bvh_tree& bvh, const vector<bbox3f>& bboxes) {
-  for (auto nodeid = (int)bvh.nodes.size() - 1; nodeid >= 0; nodeid--) {
-    auto& node = bvh.nodes[nodeid];
-    node.bbox  = invalidb3f;
-    if (node.internal) {
-      for (auto idx = 0; idx < 2; idx++) {
-        node.bbox = merge(node.bbox, bvh.nodes[node.start + idx].bbox);
-      }
-    } else {
-      for (auto idx = 0; idx < node.num; idx++) {
-        node.bbox = merge(node.bbox, bboxes[bvh.primitives[node.start + idx]]);
-      }
-    }
+  // balanced split
+  if (type == bvh_build_type::balanced) {
+    return split_balanced(primitives, bboxes, centers, start, end);
+  }
+
+  // initialize split axis and position
+  auto axis  = 0;
+  auto mid   = (start + end) / 2;
+  auto csize = cbbox.max - cbbox.min;
+  if (csize == zero3f) return {mid, axis};
+
+  if (type == bvh_build_type::highquality) {
+    // bin primitives in parallel and find the best split
+    auto bins = parallel_reduce(
+        end - start, sah_bins{},
+        [&, cbbox = cbbox](int range_start, int range_end) {
+          auto bins = sah_bins{};
+          bin_primitives(bins, primitives, bboxes, centers,
+              start + range_start, start + range_end, cbbox);
+          return bins;
+        },
+        merge_bins);
+    auto split_bin            = 0;
+    std::tie(axis, split_bin) = sweep_bins(bins, bbox, cbbox);
+    mid = partition_parallel(primitives, start, end,
+        [axis = axis, split_bin, cbbox = cbbox, &centers](int a) {
+          return sah_bin(centers[a], cbbox, axis) < split_bin;
+        });
+  } else {
+    // split the space in the middle along the largest axis
+    if (csize.x >= csize.y && csize.x >= csize.z) axis = 0;
+    if (csize.y >= csize.x && csize.y >= csize.z) axis = 1;
+    if (csize.z >= csize.x && csize.z >= csize.y) axis = 2;
+    auto middle = ((cbbox.max + cbbox.min) / 2)[axis];
+    mid         = partition_parallel(primitives, start, end,
+        [axis = axis, middle, &centers](int a) {
+          return centers[a][axis] < middle;
+        });
+  }
+
+  // if we were not able to split, just break the primitives in half
+  if (mid == start || mid == end) {
+    axis = 0;
+    mid  = (start + end) / 2;
   }
+
+  return {mid, axis};
 }
 
-static void build_bvh(bvh_shape* shape, const bvh_params& params) {
-#ifdef YOCTO_EMBREE
-  if (params.bvh == bvh_build_type::embree_default ||
-      params.bvh == bvh_build_type::embree_highquality ||
-      params.bvh == bvh_build_type::embree_compact) {
-    return init_embree_bvh(shape, params);
+// Build the subtrees given as node and primitive range as independent tasks,
+// each with its own nodes, and compact them at the end of the nodes keeping
+// siblings next to each other. Subtree roots replace the given nodes.
+// Returns false if canceled.
+static bool build_subtrees(vector<bvh_node>& nodes, vector<int>& primitives,
+    const vector<bbox3f>& bboxes, const vector<vec3f>& centers,
+    const vector<uint64_t>& codes, const vector<vec3i>& subtrees,
+    bvh_build_type type, bool noparallel, const cancel_token* cancel) {
+  // build subtrees
+  auto subtree_nodes = vector<vector<bvh_node>>(subtrees.size());
+  auto build_subtree = [&](int idx) {
+    auto [nodeid, start, end] = subtrees[idx];
+    build_nodes(subtree_nodes[idx], primitives, bboxes, centers, codes, start,
+        end, type, bvh_max_prims, cancel);
+  };
+  if (noparallel) {
+    for (auto idx = 0; idx < (int)subtrees.size(); idx++) build_subtree(idx);
+  } else {
+    parallel_for((int)subtrees.size(), build_subtree, cancel);
   }
-#endif
+  if (is_canceled(cancel)) return false;
+
+  // compact nodes, placing subtree roots in place of their nodes and the
+  // other subtree nodes after them
+  auto offsets = vector<int>(subtrees.size());
+  auto offset  = (int)nodes.size();
+  for (auto idx = 0; idx < (int)subtrees.size(); idx++) {
+    offsets[idx] = offset;
+    offset += (int)subtree_nodes[idx].size() - 1;
+  }
+  nodes.reserve(offset);
+  nodes.resize(offset);
+  auto compact_subtree = [&](int idx) {
+    auto& snodes = subtree_nodes[idx];
+    auto  remap  = [offset = offsets[idx]](bvh_node node) {
+      if (node.internal) node.start = offset + node.start - 1;
+      return node;
+    };
+    nodes[subtrees[idx].x] = remap(snodes[0]);
+    for (auto node = 1; node < (int)snodes.size(); node++)
+      nodes[offsets[idx] + node - 1] = remap(snodes[node]);
+    snodes = {};
+  };
+  if (noparallel) {
+    for (auto idx = 0; idx < (int)subtrees.size(); idx++) compact_subtree(idx);
+  } else {
+    parallel_for((int)subtrees.size(), compact_subtree);
+  }
+  return true;
+}
 
-  // build primitives
-  auto bboxes = vector<bbox3f>{};
-  if (!shape->points.empty()) {
-    bboxes = vector<bbox3f>(shape->points.size());
-    for (auto idx = 0; idx < bboxes.size(); idx++) {
-      auto& p     = shape->points[idx];
-      bboxes[idx] = point_bounds(shape->positions[p], shape->radius[p]);
-    }
-  } else if (!shape->lines.empty()) {
-    bboxes = vector<bbox3f>(shape->lines.size());
-    for (auto idx = 0; idx < bboxes.size(); idx++) {
-      auto& l     = shape->lines[idx];
-      bboxes[idx] = line_bounds(shape->positions[l.x], shape->positions[l.y],
-          shape->radius[l.x], shape->radius[l.y]);
+// Build BVH nodes in parallel. Large nodes at the top of the tree are split
+// with parallel binning and partitioning. The remaining subtrees are built
+// as independent tasks.
+static void build_bvh_parallel(bvh_tree& bvh, const vector<bbox3f>& bboxes,
+    const bvh_params& params, const cancel_token* cancel) {
+  // get values
+  auto& nodes      = bvh.nodes;
+  auto& primitives = bvh.primitives;
+
+  // prepare primitives and centers
+  auto num_primitives = (int)bboxes.size();
+  auto centers        = vector<vec3f>(num_primitives);
+  primitives.resize(num_primitives);
+  parallel_for_range(num_primitives, 0, [&](int start, int end) {
+    for (auto idx = start; idx < end; idx++) {
+      primitives[idx] = idx;
+      centers[idx]    = center(bboxes[idx]);
     }
-  } else if (!shape->triangles.empty()) {
-    bboxes = vector<bbox3f>(shape->triangles.size());
-    for (auto idx = 0; idx < bboxes.size(); idx++) {
-      auto& t     = shape->triangles[idx];
-      bboxes[idx] = triangle_bounds(
-          shape->positions[t.x], shape->positions[t.y], shape->positions[t.z]);
+  });
+
+  // sort primitives by Morton code
+  auto codes = vector<uint64_t>{};
+  if (params.bvh == bvh_build_type::lbvh)
+    codes = sort_morton(primitives, centers, false);
+
+  // build the top of the tree and collect the subtrees
+  nodes.clear();
+  nodes.emplace_back();
+  auto subtrees = vector<vec3i>{};
+  auto queue    = deque<vec3i>{{0, 0, num_primitives}};
+  while (!queue.empty()) {
+    // grab node to work on
+    auto next = queue.front();
+    queue.pop_front();
+    auto nodeid = next.x, start = next.y, end = next.z;
+
+    // small nodes are built later as subtrees
+    if (end - start <= bvh_parallel_prims) {
+      subtrees.push_back(next);
+      continue;
     }
-  } else if (!shape->quads.empty()) {
-    bboxes = vector<bbox3f>(shape->quads.size());
-    for (auto idx = 0; idx < bboxes.size(); idx++) {
-      auto& q     = shape->quads[idx];
-      bboxes[idx] = quad_bounds(shape->positions[q.x], shape->positions[q.y],
-          shape->positions[q.z], shape->positions[q.w]);
+
+    // check for cancellation
+    if (is_canceled(cancel)) break;
+
+    // get split, with bounds computed later for Morton splits
+    auto bbox = invalidb3f;
+    auto mid  = 0, axis = 0;
+    if (params.bvh == bvh_build_type::lbvh) {
+      std::tie(mid, axis) = split_morton(primitives, codes, start, end);
+    } else {
+      std::tie(mid, axis) = split_nodes_parallel(
+          primitives, bboxes, centers, start, end, params.bvh, bbox);
     }
+
+    // make an internal node
+    auto children          = (int)nodes.size();
+    nodes[nodeid].bbox     = bbox;
+    nodes[nodeid].internal = true;
+    nodes[nodeid].axis     = (uint8_t)axis;
+    nodes[nodeid].num      = 2;
+    nodes[nodeid].start    = children;
+    nodes.emplace_back();
+    nodes.emplace_back();
+    queue.push_back({children + 0, start, mid});
+    queue.push_back({children + 1, mid, end});
   }
 
-  // build nodes
-  build_bvh_serial(shape->bvh, bboxes, params);
+  // build subtrees, leaving an empty bvh if canceled
+  auto top_nodes = (int)nodes.size();
+  if (!build_subtrees(nodes, primitives, bboxes, centers, codes, subtrees,
+          params.bvh, false, cancel)) {
+    nodes.clear();
+    primitives.clear();
+    return;
+  }
+
+  // compute the bounds of the top of the tree for Morton splits
+  if (params.bvh == bvh_build_type::lbvh) {
+    refit_nodes(nodes, primitives, bboxes, 0, top_nodes);
+  }
 }
 
-void build_bvh(bvh_scene* scene, const bvh_params& params) {
-  // embree
-#ifdef YOCTO_EMBREE
-  if (params.bvh == bvh_build_type::embree_default ||
-      params.bvh == bvh_build_type::embree_highquality ||
-      params.bvh == bvh_build_type::embree_compact) {
-    return init_embree_bvh(scene, params);
+// Number of Morton code bits used to group primitives in clusters in
+// hierarchical linear bvhs.
+const int bvh_cluster_bits = 15;
+
+// Build BVH nodes as a hierarchical linear bvh. Primitives are sorted by
+// Morton code and grouped in clusters that share the highest code bits.
+// The top of the tree is built over the clusters with SAH splits, and each
+// cluster is built as a subtree with Morton splits.
+static void build_bvh_hlbvh(bvh_tree& bvh, const vector<bbox3f>& bboxes,
+    const bvh_params& params, const cancel_token* cancel) {
+  // get values
+  auto& nodes      = bvh.nodes;
+  auto& primitives = bvh.primitives;
+
+  // prepare primitives and centers
+  auto num_primitives = (int)bboxes.size();
+  auto centers        = vector<vec3f>(num_primitives);
+  primitives.resize(num_primitives);
+  bvh_for_range(
+      num_primitives, params.noparallel, [&](size_t start, size_t end) {
+        for (auto idx = start; idx < end; idx++) {
+          primitives[idx] = (int)idx;
+          centers[idx]    = center(bboxes[idx]);
+        }
+      });
+
+  // sort primitives by Morton code
+  auto codes = sort_morton(primitives, centers, params.noparallel);
+
+  // group primitives in clusters
+  auto shift    = morton_bits(num_primitives) * 3 - bvh_cluster_bits;
+  auto clusters = vector<vec2i>{};
+  for (auto idx = 0; idx < num_primitives; idx++) {
+    if (idx == 0 || (codes[primitives[idx]] >> shift) !=
+                        (codes[primitives[idx - 1]] >> shift))
+      clusters.push_back({idx, idx});
+    clusters.back().y = idx + 1;
   }
-#endif
 
-  // instance bboxes
-  auto bboxes = vector<bbox3f>(scene->num_instances);
-  for (auto idx = 0; idx < bboxes.size(); idx++) {
-    auto  instance = scene->instance_cb(idx);
-    auto& shape    = scene->shapes[instance.shape];
-    bboxes[idx]    = shape->bvh.nodes.empty() ? invalidb3f
-                                              : transform_bbox(instance.frame,
-                                                 shape->bvh.nodes[0].bbox);
+  // compute cluster bounds
+  auto cluster_bboxes  = vector<bbox3f>(clusters.size());
+  auto cluster_centers = vector<vec3f>(clusters.size());
+  bvh_for_range(clusters.size(), params.noparallel,
+      [&](size_t start, size_t end) {
+        for (auto idx = start; idx < end; idx++) {
+          auto bbox = invalidb3f;
+          for (auto i = clusters[idx].x; i < clusters[idx].y; i++)
+            bbox = merge(bbox, bboxes[primitives[i]]);
+          cluster_bboxes[idx]  = bbox;
+          cluster_centers[idx] = center(bbox);
+        }
+      });
+
+  // build the top of the tree over clusters, with one cluster per leaf
+  auto cluster_ids = vector<int>(clusters.size());
+  for (auto idx = 0; idx < (int)clusters.size(); idx++) cluster_ids[idx] = idx;
+  build_nodes(nodes, cluster_ids, cluster_bboxes, cluster_centers, {}, 0,
+      (int)clusters.size(), bvh_build_type::highquality, 1, cancel);
+
+  // collect the subtrees from the leaves
+  auto subtrees = vector<vec3i>{};
+  for (auto nodeid = 0; nodeid < (int)nodes.size(); nodeid++) {
+    if (nodes[nodeid].internal || clusters.empty()) continue;
+    auto& cluster = clusters[cluster_ids[nodes[nodeid].start]];
+    subtrees.push_back({nodeid, cluster.x, cluster.y});
   }
 
-  // build nodes
-  build_bvh_serial(scene->bvh, bboxes, params);
+  // build subtrees, leaving an empty bvh if canceled
+  if (nodes.empty() ||
+      !build_subtrees(nodes, primitives, bboxes, centers, codes, subtrees,
+          bvh_build_type::lbvh, params.noparallel, cancel)) {
+    nodes.clear();
+    primitives.clear();
+    return;
+  }
 }
 
-void init_bvh(bvh_scene* scene, const bvh_params& params,
-    const progress_callback& progress_cb) {
-  // handle progress
-  auto progress = vec2i{0, 1 + (int)scene->shapes.size()};
+// Minimum overlap of the children of an object split, relative to the root
+// area, for spatial splits to be considered.
+const float bvh_spatial_overlap = 1e-5f;
 
-  // build shape bvh
-  for (auto shape : scene->shapes) {
-    if (progress_cb) progress_cb("build shape bvh", progress.x++, progress.y);
-    build_bvh(shape, params);
-  }
+// Primitive reference used by spatial bvhs, with bounds clipped to its node.
+struct bvh_reference {
+  int    primitive = -1;
+  bbox3f bbox      = invalidb3f;
+};
 
-  // build scene bvh
-  if (progress_cb) progress_cb("build scene bvh", progress.x++, progress.y);
-  build_bvh(scene, params);
+// Intersection of two bounding boxes.
+static bbox3f clip_bbox(const bbox3f& a, const bbox3f& b) {
+  return {max(a.min, b.min), min(a.max, b.max)};
+}
 
-  // handle progress
-  if (progress_cb) progress_cb("build bvh", progress.x++, progress.y);
+// Split bounds by a plane along an axis, returning the bounds of both sides.
+static pair<bbox3f, bbox3f> split_bbox(
+    const bbox3f& bbox, int axis, float pos) {
+  auto left = bbox, right = bbox;
+  left.max[axis]  = min(left.max[axis], pos);
+  right.min[axis] = max(right.min[axis], pos);
+  return {left, right};
 }
 
-static void update_bvh(bvh_shape* shape) {
-#ifdef YOCTO_EMBREE
-  if (shape->embree_bvh) {
-    throw std::runtime_error("embree shape refit not supported");
+// Split a polygon by a plane along an axis, returning the bounds of both
+// sides clipped to the reference bounds.
+static pair<bbox3f, bbox3f> split_polygon(const vec3f* vertices, int num,
+    const bbox3f& bbox, int axis, float pos) {
+  auto left = invalidb3f, right = invalidb3f;
+  for (auto idx = 0; idx < num; idx++) {
+    auto& v0 = vertices[idx];
+    auto& v1 = vertices[(idx + 1) % num];
+    if (v0[axis] <= pos) left = merge(left, v0);
+    if (v0[axis] >= pos) right = merge(right, v0);
+    if ((v0[axis] < pos && pos < v1[axis]) ||
+        (v1[axis] < pos && pos < v0[axis])) {
+      auto p  = v0 + (v1 - v0) * ((pos - v0[axis]) / (v1[axis] - v0[axis]));
+      p[axis] = pos;
+      left    = merge(left, p);
+      right   = merge(right, p);
+    }
   }
-#endif
+  return {clip_bbox(left, bbox), clip_bbox(right, bbox)};
+}
 
-  // build primitives
-  auto bboxes = vector<bbox3f>{};
-  if (!shape->points.empty()) {
-    bboxes = vector<bbox3f>(shape->points.size());
-    for (auto idx = 0; idx < bboxes.size(); idx++) {
-      auto& p     = shape->points[idx];
-      bboxes[idx] = point_bounds(shape->positions[p], shape->radius[p]);
+// Split a shape element reference by a plane along an axis. Triangles and
+// quads are clipped exactly, while other elements are split by their bounds.
+static pair<bbox3f, bbox3f> split_reference(const bvh_shape* shape,
+    int primitive, const bbox3f& bbox, int axis, float pos) {
+  if (!shape->triangles.empty()) {
+    auto& t        = shape->triangles[primitive];
+    auto  vertices = array<vec3f, 3>{
+        shape->positions[t.x], shape->positions[t.y], shape->positions[t.z]};
+    return split_polygon(vertices.data(), 3, bbox, axis, pos);
+  } else if (!shape->quads.empty()) {
+    auto& q        = shape->quads[primitive];
+    auto  vertices = array<vec3f, 4>{shape->positions[q.x],
+        shape->positions[q.y], shape->positions[q.z], shape->positions[q.w]};
+    return split_polygon(vertices.data(), 4, bbox, axis, pos);
+  } else {
+    return split_bbox(bbox, axis, pos);
+  }
+}
+
+// Splits a node of a spatial bvh. Finds the best object split with the SAH
+// heuristic. If its children overlap, it also finds the best spatial split,
+// clipping references at bin boundaries and duplicating the ones that
+// straddle the split. Returns the split axis.
+template <typename Split>
+static int split_spatial(vector<bvh_reference>& references,
+    vector<bvh_reference>& left, vector<bvh_reference>& right,
+    const bbox3f& bbox, float root_area, bool spatial,
+    Split&& split_reference) {
+  // compute centers bounds
+  auto cbbox = invalidb3f;
+  for (auto& reference : references)
+    cbbox = merge(cbbox, center(reference.bbox));
+  auto csize = cbbox.max - cbbox.min;
+
+  // find the best object split
+  auto bins = sah_bins{};
+  for (auto& reference : references) {
+    for (auto axis = 0; axis < 3; axis++) {
+      if (csize[axis] == 0) continue;
+      auto& bin = bins[axis][sah_bin(center(reference.bbox), cbbox, axis)];
+      bin.bbox  = merge(bin.bbox, reference.bbox);
+      bin.count += 1;
+    }
+  }
+  auto [object_axis, object_bin] = sweep_bins(bins, bbox, cbbox);
+
+  // compute object split cost and children overlap
+  auto object_cost = flt_max, overlap = 0.0f;
+  if (object_bin != 0) {
+    auto left_bbox = invalidb3f, right_bbox = invalidb3f;
+    auto left_count = 0, right_count = 0;
+    for (auto bin = 0; bin < bvh_sah_bins; bin++) {
+      auto& data = bins[object_axis][bin];
+      if (bin < object_bin) {
+        left_bbox = merge(left_bbox, data.bbox);
+        left_count += data.count;
+      } else {
+        right_bbox = merge(right_bbox, data.bbox);
+        right_count += data.count;
+      }
+    }
+    object_cost = 1 + (left_count * bbox_area(left_bbox) +
+                          right_count * bbox_area(right_bbox)) /
+                          bbox_area(bbox);
+    auto overlap_bbox = clip_bbox(left_bbox, right_bbox);
+    auto overlap_size = overlap_bbox.max - overlap_bbox.min;
+    if (overlap_size.x >= 0 && overlap_size.y >= 0 && overlap_size.z >= 0)
+      overlap = bbox_area(overlap_bbox);
+  }
+
+  // find the best spatial split, if the object split children overlap
+  auto spatial_cost = flt_max, spatial_pos = 0.0f;
+  auto spatial_axis = 0;
+  auto size         = bbox.max - bbox.min;
+  if (spatial &&
+      (object_bin == 0 || overlap > bvh_spatial_overlap * root_area)) {
+    for (auto axis = 0; axis < 3; axis++) {
+      if (size[axis] == 0) continue;
+      auto bin_of = [&](float value) {
+        auto bin = (int)(bvh_sah_bins * (value - bbox.min[axis]) / size[axis]);
+        return clamp(bin, 0, bvh_sah_bins - 1);
+      };
+      auto bin_pos = [&](int bin) {
+        return bbox.min[axis] + size[axis] * bin / bvh_sah_bins;
+      };
+
+      // bin references by clipping them at bin boundaries, counting where
+      // they enter and exit
+      auto bboxes  = array<bbox3f, bvh_sah_bins>{};
+      auto entries = array<int, bvh_sah_bins>{};
+      auto exits   = array<int, bvh_sah_bins>{};
+      bboxes.fill(invalidb3f);
+      for (auto& reference : references) {
+        auto first = bin_of(reference.bbox.min[axis]);
+        auto last  = bin_of(reference.bbox.max[axis]);
+        entries[first] += 1;
+        exits[last] += 1;
+        auto rbbox = reference.bbox;
+        for (auto bin = first; bin < last; bin++) {
+          auto [left_bbox, right_bbox] = split_reference(
+              reference.primitive, rbbox, axis, bin_pos(bin + 1));
+          bboxes[bin] = merge(bboxes[bin], left_bbox);
+          rbbox       = right_bbox;
+        }
+        bboxes[last] = merge(bboxes[last], rbbox);
+      }
+
+      // sweep bins from both sides
+      auto right_areas  = array<float, bvh_sah_bins>{};
+      auto right_counts = array<int, bvh_sah_bins>{};
+      auto right_bbox   = invalidb3f;
+      auto right_count  = 0;
+      for (auto bin = bvh_sah_bins - 1; bin > 0; bin--) {
+        right_bbox        = merge(right_bbox, bboxes[bin]);
+        right_count       = right_count + exits[bin];
+        right_areas[bin]  = bbox_area(right_bbox);
+        right_counts[bin] = right_count;
+      }
+      auto left_bbox  = invalidb3f;
+      auto left_count = 0;
+      for (auto bin = 1; bin < bvh_sah_bins; bin++) {
+        left_bbox  = merge(left_bbox, bboxes[bin - 1]);
+        left_count = left_count + entries[bin - 1];
+        if (left_count == 0 || right_counts[bin] == 0) continue;
+        auto cost = 1 + (left_count * bbox_area(left_bbox) +
+                            right_counts[bin] * right_areas[bin]) /
+                            bbox_area(bbox);
+        if (cost < spatial_cost) {
+          spatial_cost = cost;
+          spatial_axis = axis;
+          spatial_pos  = bin_pos(bin);
+        }
+      }
+    }
+  }
+
+  // split references spatially, duplicating the ones that straddle the split
+  left.clear();
+  right.clear();
+  if (spatial_cost < object_cost) {
+    auto axis = spatial_axis;
+    auto pos  = spatial_pos;
+    for (auto& reference : references) {
+      if (reference.bbox.max[axis] <= pos) {
+        left.push_back(reference);
+      } else if (reference.bbox.min[axis] >= pos) {
+        right.push_back(reference);
+      } else {
+        auto [left_bbox, right_bbox] = split_reference(
+            reference.primitive, reference.bbox, axis, pos);
+        if (left_bbox.min[axis] <= left_bbox.max[axis])
+          left.push_back({reference.primitive, left_bbox});
+        if (right_bbox.min[axis] <= right_bbox.max[axis])
+          right.push_back({reference.primitive, right_bbox});
+      }
+    }
+    if (!left.empty() && !right.empty()) return axis;
+    left.clear();
+    right.clear();
+  }
+
+  // split references by objects, or in the middle if no split was found
+  if (object_bin != 0) {
+    for (auto& reference : references) {
+      if (sah_bin(center(reference.bbox), cbbox, object_axis) < object_bin) {
+        left.push_back(reference);
+      } else {
+        right.push_back(reference);
+      }
+    }
+  } else {
+    auto mid = references.size() / 2;
+    left.assign(references.begin(), references.begin() + mid);
+    right.assign(references.begin() + mid, references.end());
+  }
+  return object_axis;
+}
+
+// Build BVH nodes with spatial splits. Nodes are built depth first, each with
+// its own references, so that references are duplicated as needed. The
+// number of duplicated references is bounded by a budget relative to the
+// number of primitives, after which only object splits are used. The build
+// is serial, regardless of `noparallel`.
+template <typename Split>
+static void build_bvh_spatial(bvh_tree& bvh, const vector<bbox3f>& bboxes,
+    const bvh_params& params, const cancel_token* cancel,
+    Split&& split_reference) {
+  // get values
+  auto& nodes      = bvh.nodes;
+  auto& primitives = bvh.primitives;
+  nodes.clear();
+  primitives.clear();
+
+  // prepare references
+  auto references = vector<bvh_reference>(bboxes.size());
+  for (auto idx = 0; idx < (int)bboxes.size(); idx++) {
+    references[idx] = {idx, bboxes[idx]};
+  }
+
+  // references budget
+  auto budget     = (int64_t)(max(params.budget, 0.0f) * bboxes.size());
+  auto duplicates = (int64_t)0;
+  auto root_area  = 0.0f;
+
+  // queue up first node, given as node and references
+  auto stack = vector<pair<int, vector<bvh_reference>>>{};
+  stack.push_back({0, std::move(references)});
+  nodes.emplace_back();
+
+  // create nodes until the stack is empty
+  auto left = vector<bvh_reference>{}, right = vector<bvh_reference>{};
+  while (!stack.empty()) {
+    // check for cancellation
+    if (is_canceled(cancel)) {
+      nodes.clear();
+      primitives.clear();
+      return;
+    }
+
+    // grab node to work on
+    auto [nodeid, node_references] = std::move(stack.back());
+    stack.pop_back();
+
+    // compute bounds
+    auto bbox = invalidb3f;
+    for (auto& reference : node_references)
+      bbox = merge(bbox, reference.bbox);
+    if (nodeid == 0) root_area = bbox_area(bbox);
+    nodes[nodeid].bbox = bbox;
+
+    // make a leaf node
+    if ((int)node_references.size() <= bvh_max_prims) {
+      auto& node    = nodes[nodeid];
+      node.internal = false;
+      node.num      = (int16_t)node_references.size();
+      node.start    = (int)primitives.size();
+      for (auto& reference : node_references)
+        primitives.push_back(reference.primitive);
+      continue;
+    }
+
+    // split into two children
+    auto axis = split_spatial(node_references, left, right, bbox, root_area,
+        duplicates < budget, split_reference);
+    duplicates += (int64_t)left.size() + (int64_t)right.size() -
+                  (int64_t)node_references.size();
+    node_references = {};
+
+    // make an internal node
+    auto& node    = nodes[nodeid];
+    node.internal = true;
+    node.axis     = (uint8_t)axis;
+    node.num      = 2;
+    node.start    = (int)nodes.size();
+    stack.push_back({node.start + 1, std::move(right)});
+    stack.push_back({node.start + 0, std::move(left)});
+    nodes.emplace_back();
+    nodes.emplace_back();
+  }
+
+  // cleanup
+  nodes.shrink_to_fit();
+  primitives.shrink_to_fit();
+}
+
+// Reorder nodes in depth-first order, placing the children of each node
+// right after the ones of its parent, to improve memory locality during
+// traversal. Parallel builds emit the top of the tree in breadth-first order,
+// far from the subtrees below it. Children stay after their parents.
+static void reorder_nodes(vector<bvh_node>& nodes) {
+  if (nodes.empty()) return;
+  auto reordered = vector<bvh_node>(nodes.size());
+  reordered[0]   = nodes[0];
+  auto next      = 1;
+  auto stack     = vector<int>{0};
+  while (!stack.empty()) {
+    auto& node = reordered[stack.back()];
+    stack.pop_back();
+    if (!node.internal) continue;
+    reordered[next + 0] = nodes[node.start + 0];
+    reordered[next + 1] = nodes[node.start + 1];
+    node.start          = next;
+    stack.push_back(next + 1);
+    stack.push_back(next + 0);
+    next += 2;
+  }
+  nodes = std::move(reordered);
+}
+
+// Update bvh
+static void update_bvh(bvh_tree& bvh, const vector<bbox3f>& bboxes) {
+  refit_nodes(bvh.nodes, bvh.primitives, bboxes, 0, (int)bvh.nodes.size());
+}
+
+// Size of the stacks used to traverse wide bvhs. Traversals pop one entry and
+// push at most N at each wide node, so they need at most (N - 1) * depth + 1
+// entries for trees of the given depth.
+const auto bvh_wide_stack = 256;
+
+// Collapse binary nodes in wide nodes. Each wide node takes the children of a
+// binary node, and repeatedly replaces the internal child with the largest
+// area with its children until it has N children. Returns false, leaving no
+// wide nodes, if the tree is too deep to be traversed with the wide stacks.
+template <int N>
+static bool collapse_nodes(
+    vector<bvh_wide_node<N>>& wide_nodes, const vector<bvh_node>& nodes) {
+  // prepare to build nodes
+  wide_nodes.clear();
+  if (nodes.empty()) return true;
+
+  // queue up first node, given as wide node, binary node and depth
+  auto queue     = deque<vec3i>{{0, 0, 1}};
+  auto max_depth = 0;
+  wide_nodes.emplace_back();
+
+  // create nodes until the queue is empty
+  while (!queue.empty()) {
+    // grab node to work on
+    auto [wide_nodeid, nodeid, depth] = queue.front();
+    queue.pop_front();
+    max_depth = max(max_depth, depth);
+
+    // collect children
+    auto children = array<int, N>{};
+    auto count    = 0;
+    if (nodes[nodeid].internal) {
+      children[count++] = nodes[nodeid].start + 0;
+      children[count++] = nodes[nodeid].start + 1;
+    } else {
+      children[count++] = nodeid;
+    }
+    while (count < N) {
+      auto largest = -1;
+      for (auto idx = 0; idx < count; idx++) {
+        if (!nodes[children[idx]].internal) continue;
+        if (largest < 0 || bbox_area(nodes[children[idx]].bbox) >
+                               bbox_area(nodes[children[largest]].bbox))
+          largest = idx;
+      }
+      if (largest < 0) break;
+      auto& node        = nodes[children[largest]];
+      children[largest] = node.start + 0;
+      children[count++] = node.start + 1;
+    }
+
+    // set children, skipping empty leaves
+    auto wide_node = bvh_wide_node<N>{};
+    auto lane      = 0;
+    for (auto idx = 0; idx < count; idx++) {
+      auto& node = nodes[children[idx]];
+      if (!node.internal && node.num == 0) continue;
+      for (auto axis = 0; axis < 3; axis++) {
+        wide_node.bmin[axis][lane] = node.bbox.min[axis];
+        wide_node.bmax[axis][lane] = node.bbox.max[axis];
+      }
+      if (node.internal) {
+        wide_node.start[lane] = (int)wide_nodes.size();
+        wide_node.num[lane]   = 0;
+        wide_nodes.emplace_back();
+        queue.push_back({wide_node.start[lane], children[idx], depth + 1});
+      } else {
+        wide_node.start[lane] = node.start;
+        wide_node.num[lane]   = node.num;
+      }
+      lane++;
+    }
+    for (; lane < N; lane++) {
+      for (auto axis = 0; axis < 3; axis++) {
+        wide_node.bmin[axis][lane] = invalidb3f.min[axis];
+        wide_node.bmax[axis][lane] = invalidb3f.max[axis];
+      }
+      wide_node.start[lane] = -1;
+      wide_node.num[lane]   = -1;
+    }
+    wide_nodes[wide_nodeid] = wide_node;
+  }
+
+  // check that traversals fit in the stacks
+  if ((N - 1) * max_depth + 1 > bvh_wide_stack) {
+    wide_nodes = {};
+    return false;
+  }
+
+  // cleanup
+  wide_nodes.shrink_to_fit();
+  return true;
+}
+
+// Power of two scale of quantized bounds, built directly from its bits.
+static float quantized_scale(int8_t exponent) {
+  auto bits  = (uint32_t)(exponent + 127) << 23;
+  auto scale = 0.0f;
+  memcpy(&scale, &bits, sizeof(scale));
+  return scale;
+}
+
+// Quantize the children bounds of a wide node. Since scales are powers of two,
+// dequantized bounds are computed with a single rounding, and quantized values
+// are adjusted so that they contain the original bounds.
+template <int N, typename T>
+static bvh_quantized_node<N, T> quantize_node(const bvh_wide_node<N>& node) {
+  auto qnode  = bvh_quantized_node<N, T>{};
+  auto qrange = (int)std::numeric_limits<T>::max();
+  for (auto axis = 0; axis < 3; axis++) {
+    // node bounds along the axis
+    auto bmin = flt_max, bmax = -flt_max;
+    for (auto lane = 0; lane < N; lane++) {
+      if (node.num[lane] < 0) continue;
+      bmin = min(bmin, node.bmin[axis][lane]);
+      bmax = max(bmax, node.bmax[axis][lane]);
+    }
+    if (bmin > bmax) bmin = bmax = 0;
+
+    // smallest power of two scale that covers the node extent
+    auto exponent = 0;
+    std::frexp(((double)bmax - (double)bmin) / qrange, &exponent);
+    exponent             = clamp(exponent, -126, 127);
+    qnode.origin[axis]   = bmin;
+    qnode.exponent[axis] = (int8_t)exponent;
+
+    // quantize children bounds rounding outwards
+    auto scale       = quantized_scale(qnode.exponent[axis]);
+    auto dequantize  = [&](int q) { return bmin + (float)q * scale; };
+    auto quantize_up = [&](float value) {
+      auto q = (int)std::ceil(((double)value - (double)bmin) / scale);
+      q      = clamp(q, 0, qrange);
+      while (q < qrange && dequantize(q) < value) q++;
+      return q;
+    };
+    auto quantize_down = [&](float value) {
+      auto q = (int)std::floor(((double)value - (double)bmin) / scale);
+      q      = clamp(q, 0, qrange);
+      while (q > 0 && dequantize(q) > value) q--;
+      return q;
+    };
+    for (auto lane = 0; lane < N; lane++) {
+      if (node.num[lane] < 0) continue;
+      qnode.qmin[axis][lane] = (T)quantize_down(node.bmin[axis][lane]);
+      qnode.qmax[axis][lane] = (T)quantize_up(node.bmax[axis][lane]);
+    }
+  }
+  for (auto lane = 0; lane < N; lane++) {
+    qnode.start[lane] = node.start[lane];
+    qnode.num[lane]   = node.num[lane];
+  }
+  return qnode;
+}
+
+// Dequantize the children bounds of a quantized wide node.
+template <int N, typename T>
+static void dequantize_node(
+    bvh_wide_node<N>& node, const bvh_quantized_node<N, T>& qnode) {
+  for (auto axis = 0; axis < 3; axis++) {
+    auto origin = qnode.origin[axis];
+    auto scale  = quantized_scale(qnode.exponent[axis]);
+    for (auto lane = 0; lane < N; lane++) {
+      node.bmin[axis][lane] = origin + (float)qnode.qmin[axis][lane] * scale;
+      node.bmax[axis][lane] = origin + (float)qnode.qmax[axis][lane] * scale;
+    }
+  }
+  for (auto lane = 0; lane < N; lane++) {
+    node.start[lane] = qnode.start[lane];
+    node.num[lane]   = qnode.num[lane];
+  }
+}
+
+// Collapse binary nodes in wide nodes and quantize them. Returns false,
+// leaving no quantized nodes, if the nodes could not be collapsed.
+template <int N, typename T>
+static bool quantize_nodes(vector<bvh_quantized_node<N, T>>& qnodes,
+    const vector<bvh_node>& nodes) {
+  auto wide_nodes = vector<bvh_wide_node<N>>{};
+  if (!collapse_nodes(wide_nodes, nodes)) return false;
+  qnodes.resize(wide_nodes.size());
+  for (auto idx = 0; idx < (int)wide_nodes.size(); idx++) {
+    qnodes[idx] = quantize_node<N, T>(wide_nodes[idx]);
+  }
+  return true;
+}
+
+// Refit quantized nodes, visiting them in reverse so that children are
+// refit before their parents.
+template <int N, typename T>
+static void refit_quantized_nodes(vector<bvh_quantized_node<N, T>>& qnodes,
+    const vector<int>& primitives, const vector<bbox3f>& bboxes) {
+  auto node_bboxes = vector<bbox3f>(qnodes.size(), invalidb3f);
+  for (auto nodeid = (int)qnodes.size() - 1; nodeid >= 0; nodeid--) {
+    auto& qnode = qnodes[nodeid];
+    auto  node  = bvh_wide_node<N>{};
+    for (auto lane = 0; lane < N; lane++) {
+      node.start[lane] = qnode.start[lane];
+      node.num[lane]   = qnode.num[lane];
+      if (node.num[lane] < 0) continue;
+      auto bbox = invalidb3f;
+      if (node.num[lane] == 0) {
+        bbox = node_bboxes[node.start[lane]];
+      } else {
+        for (auto idx = 0; idx < node.num[lane]; idx++)
+          bbox = merge(bbox, bboxes[primitives[node.start[lane] + idx]]);
+      }
+      for (auto axis = 0; axis < 3; axis++) {
+        node.bmin[axis][lane] = bbox.min[axis];
+        node.bmax[axis][lane] = bbox.max[axis];
+      }
+      node_bboxes[nodeid] = merge(node_bboxes[nodeid], bbox);
+    }
+    qnode = quantize_node<N, T>(node);
+  }
+}
+
+// Build the wide nodes of a bvh for a given node width, clearing the others.
+// Quantized nodes are at least 4-wide and replace the binary nodes. Trees too
+// deep for wide traversals keep only their binary nodes.
+static void build_wide_nodes(bvh_tree& bvh, int width, int quantize) {
+  bvh.nodes4.clear();
+  bvh.nodes8.clear();
+  bvh.nodes4q8.clear();
+  bvh.nodes8q8.clear();
+  bvh.nodes4q16.clear();
+  bvh.nodes8q16.clear();
+  if (quantize == 8 || quantize == 16) {
+    auto quantized = false;
+    if (width == 8) {
+      if (quantize == 8) quantized = quantize_nodes(bvh.nodes8q8, bvh.nodes);
+      if (quantize == 16) quantized = quantize_nodes(bvh.nodes8q16, bvh.nodes);
+    } else {
+      if (quantize == 8) quantized = quantize_nodes(bvh.nodes4q8, bvh.nodes);
+      if (quantize == 16) quantized = quantize_nodes(bvh.nodes4q16, bvh.nodes);
+    }
+    if (quantized) bvh.nodes = {};
+  } else {
+    if (width == 4) collapse_nodes(bvh.nodes4, bvh.nodes);
+    if (width == 8) collapse_nodes(bvh.nodes8, bvh.nodes);
+  }
+}
+
+// Update the wide nodes of a bvh after refitting its binary nodes.
+static void update_wide_nodes(bvh_tree& bvh, const vector<bbox3f>& bboxes) {
+  if (!bvh.nodes4.empty()) collapse_nodes(bvh.nodes4, bvh.nodes);
+  if (!bvh.nodes8.empty()) collapse_nodes(bvh.nodes8, bvh.nodes);
+  refit_quantized_nodes(bvh.nodes4q8, bvh.primitives, bboxes);
+  refit_quantized_nodes(bvh.nodes8q8, bvh.primitives, bboxes);
+  refit_quantized_nodes(bvh.nodes4q16, bvh.primitives, bboxes);
+  refit_quantized_nodes(bvh.nodes8q16, bvh.primitives, bboxes);
+}
+
+// Bounds of the children of a quantized wide node.
+template <int N, typename T>
+static bbox3f get_bounds(const bvh_quantized_node<N, T>& qnode) {
+  auto node = bvh_wide_node<N>{};
+  dequantize_node(node, qnode);
+  auto bbox = invalidb3f;
+  for (auto lane = 0; lane < N; lane++) {
+    if (node.num[lane] < 0) continue;
+    for (auto axis = 0; axis < 3; axis++) {
+      bbox.min[axis] = min(bbox.min[axis], node.bmin[axis][lane]);
+      bbox.max[axis] = max(bbox.max[axis], node.bmax[axis][lane]);
+    }
+  }
+  return bbox;
+}
+
+// Check whether a bvh has no nodes.
+static bool is_empty(const bvh_tree& bvh) {
+  return bvh.nodes.empty() && bvh.nodes4q8.empty() && bvh.nodes8q8.empty() &&
+         bvh.nodes4q16.empty() && bvh.nodes8q16.empty();
+}
+
+// Bounds of a bvh, taken from its root.
+static bbox3f get_bounds(const bvh_tree& bvh) {
+  if (!bvh.nodes.empty()) return bvh.nodes[0].bbox;
+  if (!bvh.nodes4q8.empty()) return get_bounds(bvh.nodes4q8[0]);
+  if (!bvh.nodes8q8.empty()) return get_bounds(bvh.nodes8q8[0]);
+  if (!bvh.nodes4q16.empty()) return get_bounds(bvh.nodes4q16[0]);
+  if (!bvh.nodes8q16.empty()) return get_bounds(bvh.nodes8q16[0]);
+  return invalidb3f;
+}
+
+// Version of the bvh cache files, to be increased when their content changes.
+const auto bvh_cache_version = (uint32_t)3;
+
+// Hash bytes with FNV-1a, continuing from a previous hash.
+static uint64_t hash_bytes(const void* data, size_t size,
+    uint64_t hash = 14695981039346656037ull) {
+  auto bytes = (const unsigned char*)data;
+  for (auto idx = (size_t)0; idx < size; idx++) {
+    hash = (hash ^ bytes[idx]) * 1099511628211ull;
+  }
+  return hash;
+}
+template <typename T>
+static uint64_t hash_bytes(const bvh_span<T>& values, uint64_t hash) {
+  return hash_bytes(values.data(), values.size() * sizeof(T), hash);
+}
+
+// Hash the shape geometry together with the parameters used to build its bvh,
+// so that cached bvhs are found only for identical builds.
+static uint64_t hash_shape(const bvh_shape* shape, const bvh_params& params) {
+  auto sizes = array<uint64_t, 6>{shape->points.size(), shape->lines.size(),
+      shape->triangles.size(), shape->quads.size(), shape->positions.size(),
+      shape->radius.size()};
+  auto settings = array<float, 5>{(float)params.bvh, (float)params.noparallel,
+      (float)params.width, (float)params.quantize, params.budget};
+  auto hash = hash_bytes(&bvh_cache_version, sizeof(bvh_cache_version));
+  hash      = hash_bytes(settings.data(), sizeof(settings), hash);
+  hash      = hash_bytes(sizes.data(), sizeof(sizes), hash);
+  hash      = hash_bytes(shape->points, hash);
+  hash      = hash_bytes(shape->lines, hash);
+  hash      = hash_bytes(shape->triangles, hash);
+  hash      = hash_bytes(shape->quads, hash);
+  hash      = hash_bytes(shape->positions, hash);
+  hash      = hash_bytes(shape->radius, hash);
+  return hash;
+}
+
+// Cache filename for a shape hash.
+static string make_cache_filename(const string& dirname, uint64_t hash) {
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%016llx.ybvh", (unsigned long long)hash);
+  return path_join(dirname, buffer);
+}
+
+// Save bvh nodes to a cache file, as a header with the format version and the
+// shape hash, followed by the node arrays and a checksum. The data is written
+// to a temporary file first, so that concurrent runs never read partial files.
+// Temporary names use a random token of the process and a counter, so that
+// processes sharing a cache directory, even on different machines, never
+// write the same temporary file.
+static string bvh_cache_tempname(const string& filename) {
+  static const auto token = ((uint64_t)std::random_device{}() << 32) ^
+                            (uint64_t)std::random_device{}() ^
+                            (uint64_t)std::chrono::steady_clock::now()
+                                .time_since_epoch()
+                                .count();
+  static auto counter = atomic<uint64_t>{0};
+  return filename + "." + std::to_string(token) + "." +
+         std::to_string(counter++) + ".tmp";
+}
+static bool save_bvh_cache(const string& filename, uint64_t hash,
+    const bvh_tree& bvh, string& error) {
+  auto data  = vector<byte>{};
+  auto write = [&data](const void* values, size_t size) {
+    data.insert(data.end(), (const byte*)values, (const byte*)values + size);
+  };
+  auto write_values = [&write](const auto& values) {
+    auto size = (uint64_t)values.size();
+    write(&size, sizeof(size));
+    write(values.data(), values.size() * sizeof(values[0]));
+  };
+  write("YBVH", 4);
+  write(&bvh_cache_version, sizeof(bvh_cache_version));
+  write(&hash, sizeof(hash));
+  write_values(bvh.nodes);
+  write_values(bvh.primitives);
+  write_values(bvh.nodes4);
+  write_values(bvh.nodes8);
+  write_values(bvh.nodes4q8);
+  write_values(bvh.nodes8q8);
+  write_values(bvh.nodes4q16);
+  write_values(bvh.nodes8q16);
+  auto checksum = hash_bytes(data.data(), data.size());
+  write(&checksum, sizeof(checksum));
+
+  auto tempname = bvh_cache_tempname(filename);
+  if (!save_binary(tempname, data, error)) return false;
+  if (std::rename(tempname.c_str(), filename.c_str()) != 0) {
+    std::remove(tempname.c_str());
+    error = filename + ": cannot write file";
+    return false;
+  }
+  return true;
+}
+
+// Load bvh nodes from a cache file, checking its format version, the shape
+// hash and the checksum. Leaves the bvh untouched on errors.
+static bool load_bvh_cache(const string& filename, uint64_t hash,
+    bvh_tree& bvh, string& error) {
+  auto data = vector<byte>{};
+  if (!load_binary(filename, data, error)) return false;
+
+  // check header and checksum
+  auto format_error = [&filename, &error](const string& message) {
+    error = filename + ": " + message;
+    return false;
+  };
+  auto header = array<byte, 16>{}, expected = array<byte, 16>{};
+  memcpy(expected.data(), "YBVH", 4);
+  memcpy(expected.data() + 4, &bvh_cache_version, sizeof(bvh_cache_version));
+  memcpy(expected.data() + 8, &hash, sizeof(hash));
+  if (data.size() < header.size() + sizeof(uint64_t))
+    return format_error("truncated file");
+  memcpy(header.data(), data.data(), header.size());
+  if (memcmp(header.data(), expected.data(), 8) != 0)
+    return format_error("unsupported format");
+  if (header != expected) return format_error("shape mismatch");
+  auto checksum = (uint64_t)0;
+  memcpy(&checksum, data.data() + data.size() - sizeof(checksum),
+      sizeof(checksum));
+  if (checksum != hash_bytes(data.data(), data.size() - sizeof(checksum)))
+    return format_error("corrupted file");
+
+  // read nodes
+  auto offset = header.size(), end = data.size() - sizeof(checksum);
+  auto read   = [&](void* values, size_t size) {
+    if (size > end - offset) return false;
+    memcpy(values, data.data() + offset, size);
+    offset += size;
+    return true;
+  };
+  auto read_values = [&](auto& values) {
+    auto size = (uint64_t)0;
+    if (!read(&size, sizeof(size))) return false;
+    if (size > (end - offset) / sizeof(values[0])) return false;
+    values.resize(size);
+    return read(values.data(), values.size() * sizeof(values[0]));
+  };
+  auto cached = bvh_tree{};
+  if (!read_values(cached.nodes) || !read_values(cached.primitives) ||
+      !read_values(cached.nodes4) || !read_values(cached.nodes8) ||
+      !read_values(cached.nodes4q8) || !read_values(cached.nodes8q8) ||
+      !read_values(cached.nodes4q16) || !read_values(cached.nodes8q16) ||
+      offset != end)
+    return format_error("corrupted file");
+  bvh = std::move(cached);
+  return true;
+}
+
+// Precompute the triangles of the bvh leaves, in primitive order.
+static void build_leaf_triangles(bvh_shape* shape) {
+  if (shape->triangles.empty()) return;
+  shape->leaf_triangles.resize(shape->bvh.primitives.size());
+  for (auto idx = 0; idx < (int)shape->bvh.primitives.size(); idx++) {
+    auto& t = shape->triangles[shape->bvh.primitives[idx]];
+    shape->leaf_triangles[idx] = {
+        shape->positions[t.x], shape->positions[t.y], shape->positions[t.z]};
+  }
+}
+
+static void build_bvh(bvh_shape* shape, const bvh_params& params,
+    const cancel_token* cancel) {
+#ifdef YOCTO_EMBREE
+  if (params.bvh == bvh_build_type::embree_default ||
+      params.bvh == bvh_build_type::embree_highquality ||
+      params.bvh == bvh_build_type::embree_compact) {
+    return init_embree_bvh(shape, params);
+  }
+#endif
+
+  // use cached nodes if valid, otherwise build nodes and cache them
+  if (!params.cache.empty()) {
+    auto hash     = hash_shape(shape, params);
+    auto filename = make_cache_filename(params.cache, hash);
+    auto error    = string{};
+    if (load_bvh_cache(filename, hash, shape->bvh, error)) {
+      shape->leaf_triangles.clear();
+      if (params.precompute) build_leaf_triangles(shape);
+      return;
+    }
+    auto uncached  = params;
+    uncached.cache = "";
+    build_bvh(shape, uncached, cancel);
+    // errors are ignored, since the cache is only an optimization
+    if (!is_canceled(cancel) && make_directory(params.cache, error))
+      save_bvh_cache(filename, hash, shape->bvh, error);
+    return;
+  }
+
+  // build primitives
+  auto bboxes = compute_bboxes(shape, params.noparallel);
+
+  // build nodes
+  if (params.bvh == bvh_build_type::hlbvh) {
+    build_bvh_hlbvh(shape->bvh, bboxes, params, cancel);
+  } else if (params.bvh == bvh_build_type::spatial) {
+    build_bvh_spatial(shape->bvh, bboxes, params, cancel,
+        [shape](int primitive, const bbox3f& bbox, int axis, float pos) {
+          return split_reference(shape, primitive, bbox, axis, pos);
+        });
+  } else if (params.noparallel) {
+    build_bvh_serial(shape->bvh, bboxes, params, cancel);
+  } else {
+    build_bvh_parallel(shape->bvh, bboxes, params, cancel);
+  }
+
+  // reorder nodes for locality
+  reorder_nodes(shape->bvh.nodes);
+
+  // build wide nodes
+  build_wide_nodes(shape->bvh, params.width, params.quantize);
+
+  // precompute leaf triangles
+  shape->leaf_triangles.clear();
+  if (params.precompute) build_leaf_triangles(shape);
+}
+
+// Get the bvh of the shape or group referenced by an instance.
+static const bvh_tree& get_instance_bvh(
+    const bvh_scene* scene, const bvh_instance& instance) {
+  return instance.group >= 0 ? scene->groups[instance.group]->bvh
+                             : scene->shapes[instance.shape]->bvh;
+}
+
+// Compute the bounds of the instances at the start and end of the shutter
+// interval. The latter are empty if no instance moves, even if moving
+// instances have the same bounds at both times, since their frames change.
+static pair<vector<bbox3f>, vector<bbox3f>> compute_bboxes(
+    const bvh_scene* scene, bool noparallel) {
+  auto bboxes        = vector<bbox3f>(scene->num_instances);
+  auto motion_bboxes = vector<bbox3f>(scene->num_instances);
+  auto moving        = atomic<bool>{false};
+  bvh_for_range(bboxes.size(), noparallel, [&](size_t start, size_t end) {
+    for (auto idx = start; idx < end; idx++) {
+      auto  instance = scene->instance_cb((int)idx);
+      auto& sbvh     = get_instance_bvh(scene, instance);
+      if (instance.moving) moving = true;
+      if (is_empty(sbvh)) {
+        bboxes[idx]        = invalidb3f;
+        motion_bboxes[idx] = invalidb3f;
+      } else {
+        bboxes[idx]        = transform_bbox(instance.frame, get_bounds(sbvh));
+        motion_bboxes[idx] = instance.moving ? transform_bbox(
+                                                   instance.motion_frame,
+                                                   get_bounds(sbvh))
+                                             : bboxes[idx];
+      }
+    }
+  });
+  if (!moving) motion_bboxes.clear();
+  return {bboxes, motion_bboxes};
+}
+
+// Refit the bounds of a bvh of moving instances at the start and end of the
+// shutter interval. Linear interpolation of these bounds contains the
+// instances at any time, since their frames are interpolated linearly.
+static void refit_motion_nodes(bvh_tree& bvh, const vector<bbox3f>& bboxes,
+    const vector<bbox3f>& motion_bboxes) {
+  auto num_nodes = (int)bvh.nodes.size();
+  refit_nodes(bvh.nodes, bvh.primitives, motion_bboxes, 0, num_nodes);
+  bvh.motion_bboxes.resize(num_nodes);
+  for (auto idx = 0; idx < num_nodes; idx++)
+    bvh.motion_bboxes[idx] = bvh.nodes[idx].bbox;
+  refit_nodes(bvh.nodes, bvh.primitives, bboxes, 0, num_nodes);
+}
+
+// Build the binary nodes of an instance bvh.
+static void build_instance_nodes(bvh_tree& bvh, const vector<bbox3f>& bboxes,
+    const bvh_params& params, const cancel_token* cancel) {
+  if (params.bvh == bvh_build_type::hlbvh) {
+    build_bvh_hlbvh(bvh, bboxes, params, cancel);
+  } else if (params.bvh == bvh_build_type::spatial) {
+    build_bvh_spatial(bvh, bboxes, params, cancel,
+        [](int, const bbox3f& bbox, int axis, float pos) {
+          return split_bbox(bbox, axis, pos);
+        });
+  } else if (params.noparallel) {
+    build_bvh_serial(bvh, bboxes, params, cancel);
+  } else {
+    build_bvh_parallel(bvh, bboxes, params, cancel);
+  }
+  reorder_nodes(bvh.nodes);
+}
+
+// Compute the bounds of the shape of a group placed at each group frame.
+static vector<bbox3f> compute_bboxes(
+    const bvh_scene* scene, const bvh_group* group, bool noparallel) {
+  auto& sbvh   = scene->shapes[group->shape]->bvh;
+  auto  bboxes = vector<bbox3f>(group->frames.size());
+  bvh_for_range(bboxes.size(), noparallel, [&](size_t start, size_t end) {
+    for (auto idx = start; idx < end; idx++) {
+      bboxes[idx] = is_empty(sbvh) ? invalidb3f
+                                   : transform_bbox(group->frames[idx],
+                                         get_bounds(sbvh));
+    }
+  });
+  return bboxes;
+}
+
+// Build the bvh of an instance group over the bounds of the shape placed at
+// each group frame.
+static void build_bvh(const bvh_scene* scene, bvh_group* group,
+    const bvh_params& params, const cancel_token* cancel) {
+  auto bboxes = compute_bboxes(scene, group, params.noparallel);
+  build_instance_nodes(group->bvh, bboxes, params, cancel);
+  build_wide_nodes(group->bvh, params.width, params.quantize);
+}
+
+// Unnormalized sah cost of a node, skipping empty bounds.
+static double node_cost(const bvh_node& node) {
+  if (node.bbox.min.x > node.bbox.max.x) return 0;
+  return (double)bbox_area(node.bbox) * (node.internal ? 1 : node.num);
+}
+
+// Initialize the data used to incrementally update the instance bvh. Updates
+// are incremental only for binary trees that reference each instance once.
+static void init_instance_updates(bvh_scene* scene,
+    const vector<bbox3f>& bboxes, const bvh_params& params) {
+  auto& bvh         = scene->bvh;
+  scene->params     = params;
+  scene->bboxes     = bboxes;
+  scene->cost       = 0;
+  scene->build_cost = 0;
+  scene->parents.clear();
+  scene->leaves.clear();
+  if (bvh.nodes.empty() || !bvh.nodes4.empty() || !bvh.nodes8.empty() ||
+      !bvh.motion_bboxes.empty() || bvh.primitives.size() != bboxes.size())
+    return;
+  scene->parents.assign(bvh.nodes.size(), -1);
+  scene->leaves.assign(bboxes.size(), -1);
+  for (auto nodeid = 0; nodeid < (int)bvh.nodes.size(); nodeid++) {
+    auto& node = bvh.nodes[nodeid];
+    if (node.internal) {
+      scene->parents[node.start + 0] = nodeid;
+      scene->parents[node.start + 1] = nodeid;
+    } else {
+      for (auto idx = node.start; idx < node.start + node.num; idx++)
+        scene->leaves[bvh.primitives[idx]] = nodeid;
+    }
+    scene->cost += node_cost(node);
+  }
+  scene->build_cost = scene->cost / bbox_area(bvh.nodes[0].bbox);
+}
+
+// Refit a node of the instance bvh from its children or instances, updating
+// the tree cost. Returns whether its bounds changed.
+static bool refit_instance_node(bvh_scene* scene, int nodeid) {
+  auto& node = scene->bvh.nodes[nodeid];
+  auto  bbox = invalidb3f;
+  if (node.internal) {
+    for (auto idx = 0; idx < 2; idx++) {
+      bbox = merge(bbox, scene->bvh.nodes[node.start + idx].bbox);
+    }
+  } else {
+    for (auto idx = node.start; idx < node.start + node.num; idx++) {
+      bbox = merge(bbox, scene->bboxes[scene->bvh.primitives[idx]]);
+    }
+  }
+  if (bbox.min == node.bbox.min && bbox.max == node.bbox.max) return false;
+  scene->cost -= node_cost(node);
+  node.bbox = bbox;
+  scene->cost += node_cost(node);
+  return true;
+}
+
+// Swap the nodes in two slots of the instance bvh, moving their subtrees
+// with them, and update the links to their children or instances.
+static void swap_instance_nodes(bvh_scene* scene, int slot1, int slot2) {
+  auto& nodes = scene->bvh.nodes;
+  std::swap(nodes[slot1], nodes[slot2]);
+  for (auto nodeid : {slot1, slot2}) {
+    auto& node = nodes[nodeid];
+    if (node.internal) {
+      scene->parents[node.start + 0] = nodeid;
+      scene->parents[node.start + 1] = nodeid;
+    } else {
+      for (auto idx = node.start; idx < node.start + node.num; idx++)
+        scene->leaves[scene->bvh.primitives[idx]] = nodeid;
+    }
+  }
+}
+
+// Rotate the subtree of a node of the instance bvh, as in Kensler, "Tree
+// Rotations for Improving Bounding Volume Hierarchies", 2008. A child is
+// swapped with a child of its sibling if this reduces the sibling area.
+// Swaps keep children after their parents, as required by refits.
+static void rotate_instance_node(bvh_scene* scene, int nodeid) {
+  auto& nodes = scene->bvh.nodes;
+  if (!nodes[nodeid].internal) return;
+  auto best_gain  = 0.0f;
+  auto best_child = -1, best_grandchild = -1;
+  for (auto side = 0; side < 2; side++) {
+    auto  child   = nodes[nodeid].start + side;
+    auto& sibling = nodes[nodes[nodeid].start + 1 - side];
+    if (!sibling.internal) continue;
+    if (nodes[child].internal && nodes[child].start <= sibling.start + 1)
+      continue;
+    for (auto idx = 0; idx < 2; idx++) {
+      auto grandchild = sibling.start + idx, other = sibling.start + 1 - idx;
+      auto gain       = bbox_area(sibling.bbox) -
+                  bbox_area(merge(nodes[child].bbox, nodes[other].bbox));
+      if (!(gain > best_gain)) continue;
+      best_gain       = gain;
+      best_child      = child;
+      best_grandchild = grandchild;
+    }
+  }
+  if (best_child < 0) return;
+  swap_instance_nodes(scene, best_child, best_grandchild);
+  refit_instance_node(scene, scene->parents[best_grandchild]);
+}
+
+// Incrementally update the instance bvh, refitting only the ancestors of the
+// updated instances and rotating them to limit the loss of quality. When
+// the sah cost grows past the build cost by the rebuild ratio, a new tree is
+// built in the background and used in later updates.
+static void update_instances(
+    bvh_scene* scene, const vector<int>& updated_instances) {
+  // use the rebuilt tree if ready, refitting it to the current bounds
+  if (scene->rebuild.valid() &&
+      scene->rebuild.wait_for(std::chrono::seconds(0)) ==
+          std::future_status::ready) {
+    scene->bvh = scene->rebuild.get();
+    update_bvh(scene->bvh, scene->bboxes);
+    init_instance_updates(scene, scene->bboxes, scene->params);
+  }
+
+  // update instance bounds
+  for (auto instance_id : updated_instances) {
+    auto  instance = scene->instance_cb(instance_id);
+    auto& sbvh     = get_instance_bvh(scene, instance);
+    scene->bboxes[instance_id] = is_empty(sbvh)
+                                     ? invalidb3f
+                                     : transform_bbox(
+                                           instance.frame, get_bounds(sbvh));
+  }
+
+  // refit ancestors of updated instances, or all nodes if many were updated
+  if (updated_instances.size() * 8 > scene->leaves.size()) {
+    for (auto nodeid = (int)scene->bvh.nodes.size() - 1; nodeid >= 0;
+         nodeid--) {
+      refit_instance_node(scene, nodeid);
+      rotate_instance_node(scene, nodeid);
+    }
+  } else {
+    for (auto instance_id : updated_instances) {
+      for (auto nodeid = scene->leaves[instance_id]; nodeid >= 0;
+           nodeid      = scene->parents[nodeid]) {
+        if (!refit_instance_node(scene, nodeid)) break;
+        rotate_instance_node(scene, nodeid);
+      }
+    }
+  }
+
+  // rebuild in the background if the tree quality degraded
+  auto cost = scene->cost / bbox_area(scene->bvh.nodes[0].bbox);
+  if (!scene->rebuild.valid() &&
+      cost > scene->build_cost * scene->params.rebuild) {
+    scene->rebuild = std::async(std::launch::async,
+        [bboxes = scene->bboxes, params = scene->params]() {
+          auto bvh = bvh_tree{};
+          build_instance_nodes(bvh, bboxes, params, nullptr);
+          return bvh;
+        });
+  }
+}
+
+static void build_bvh(bvh_scene* scene, const bvh_params& params,
+    const cancel_token* cancel) {
+  // embree
+#ifdef YOCTO_EMBREE
+  if (params.bvh == bvh_build_type::embree_default ||
+      params.bvh == bvh_build_type::embree_highquality ||
+      params.bvh == bvh_build_type::embree_compact) {
+    return init_embree_bvh(scene, params);
+  }
+#endif
+
+  // instance bboxes
+  auto [bboxes, motion_bboxes] = compute_bboxes(scene, params.noparallel);
+
+  // build nodes, for moving instances over their bounds during the shutter
+  // interval and refitting the bounds at its start and end
+  if (motion_bboxes.empty()) {
+    build_instance_nodes(scene->bvh, bboxes, params, cancel);
+    scene->bvh.motion_bboxes.clear();
+  } else {
+    auto merged = vector<bbox3f>(bboxes.size());
+    for (auto idx = 0; idx < (int)bboxes.size(); idx++)
+      merged[idx] = merge(bboxes[idx], motion_bboxes[idx]);
+    build_instance_nodes(scene->bvh, merged, params, cancel);
+    refit_motion_nodes(scene->bvh, bboxes, motion_bboxes);
+  }
+
+  // build wide nodes, that do not support motion
+  if (motion_bboxes.empty()) {
+    build_wide_nodes(scene->bvh, params.width, params.quantize);
+  } else {
+    build_wide_nodes(scene->bvh, 2, 0);
+  }
+
+  // init incremental updates
+  init_instance_updates(scene, bboxes, params);
+}
+
+void init_bvh(bvh_scene* scene, const bvh_params& params,
+    const progress_callback& progress_cb, cancel_token* cancel) {
+  // handle progress
+  auto progress = vec2i{
+      0, 1 + (int)scene->shapes.size() + (int)scene->groups.size()};
+
+  // build shape bvh
+  if (params.noparallel) {
+    for (auto shape : scene->shapes) {
+      if (is_canceled(cancel)) break;
+      set_progress(cancel, progress.x, progress.y);
+      if (progress_cb)
+        progress_cb("build shape bvh", progress.x, progress.y);
+      progress.x++;
+      build_bvh(shape, params, cancel);
+    }
+  } else {
+    std::mutex progress_mutex;
+    parallel_foreach(
+        scene->shapes,
+        [&](bvh_shape* shape) {
+          build_bvh(shape, params, cancel);
+          std::lock_guard<std::mutex> lock(progress_mutex);
+          set_progress(cancel, progress.x, progress.y);
+          if (progress_cb)
+            progress_cb("build shape bvh", progress.x, progress.y);
+          progress.x++;
+        },
+        cancel);
+  }
+
+  // build group bvhs, that parallelize internally
+  for (auto group : scene->groups) {
+    if (is_canceled(cancel)) break;
+    set_progress(cancel, progress.x, progress.y);
+    if (progress_cb) progress_cb("build group bvh", progress.x, progress.y);
+    progress.x++;
+    build_bvh(scene, group, params, cancel);
+  }
+
+  // stop if canceled, leaving an empty scene bvh
+  if (is_canceled(cancel)) {
+    scene->bvh = {};
+    return;
+  }
+
+  // build scene bvh
+  set_progress(cancel, progress.x, progress.y);
+  if (progress_cb) progress_cb("build scene bvh", progress.x, progress.y);
+  progress.x++;
+  build_bvh(scene, params, cancel);
+
+  // handle progress
+  set_progress(cancel, progress.x, progress.y);
+  if (progress_cb) progress_cb("build bvh", progress.x++, progress.y);
+}
+
+// Compute the SAH cost of a bvh
+float compute_sah_cost(const bvh_tree& bvh) {
+  if (bvh.nodes.empty()) return 0;
+  auto cost = 0.0f;
+  for (auto& node : bvh.nodes) {
+    cost += bbox_area(node.bbox) * (node.internal ? 1 : node.num);
+  }
+  return cost / bbox_area(bvh.nodes[0].bbox);
+}
+
+// Memory used by a quantized bvh without quantization, computed from the
+// number of wide nodes and of the binary nodes they were collapsed from.
+template <int N, typename T>
+static size_t compute_uncompressed_memory(
+    const vector<bvh_quantized_node<N, T>>& qnodes) {
+  auto num_nodes = (size_t)0;
+  for (auto& qnode : qnodes) {
+    auto num_children = 0;
+    for (auto lane = 0; lane < N; lane++) {
+      if (qnode.num[lane] < 0) continue;
+      num_children += 1;
+      if (qnode.num[lane] > 0) num_nodes += 1;
+    }
+    num_nodes += num_children - 1;
+  }
+  return num_nodes * sizeof(bvh_node) +
+         qnodes.size() * sizeof(bvh_wide_node<N>);
+}
+
+// Compute the memory used by a bvh
+bvh_memory compute_memory(const bvh_tree& bvh) {
+  auto memory  = bvh_memory{};
+  memory.bytes = bvh.nodes.size() * sizeof(bvh_node) +
+                 bvh.primitives.size() * sizeof(int) +
+                 bvh.nodes4.size() * sizeof(bvh_node4) +
+                 bvh.nodes8.size() * sizeof(bvh_node8) +
+                 bvh.nodes4q8.size() * sizeof(bvh_node4q8) +
+                 bvh.nodes8q8.size() * sizeof(bvh_node8q8) +
+                 bvh.nodes4q16.size() * sizeof(bvh_node4q16) +
+                 bvh.nodes8q16.size() * sizeof(bvh_node8q16) +
+                 bvh.motion_bboxes.size() * sizeof(bbox3f);
+  memory.uncompressed = bvh.nodes.size() * sizeof(bvh_node) +
+                        bvh.primitives.size() * sizeof(int) +
+                        bvh.motion_bboxes.size() * sizeof(bbox3f) +
+                        bvh.nodes4.size() * sizeof(bvh_node4) +
+                        bvh.nodes8.size() * sizeof(bvh_node8) +
+                        compute_uncompressed_memory(bvh.nodes4q8) +
+                        compute_uncompressed_memory(bvh.nodes8q8) +
+                        compute_uncompressed_memory(bvh.nodes4q16) +
+                        compute_uncompressed_memory(bvh.nodes8q16);
+  return memory;
+}
+
+// Compute the statistics of a bvh
+bvh_stats compute_stats(const bvh_tree& bvh) {
+  auto stats   = bvh_stats{};
+  stats.memory = compute_memory(bvh);
+  if (bvh.nodes.empty()) return stats;
+  stats.sah_cost = compute_sah_cost(bvh);
+
+  // walk the tree keeping track of depths
+  auto overlap = 0.0;
+  auto stack   = vector<pair<int, int>>{{0, 0}};
+  while (!stack.empty()) {
+    auto [nodeid, depth] = stack.back();
+    stack.pop_back();
+    auto& node = bvh.nodes[nodeid];
+    stats.nodes += 1;
+    if (node.internal) {
+      // overlap of the children relative to their parent
+      auto& bbox1 = bvh.nodes[node.start + 0].bbox;
+      auto& bbox2 = bvh.nodes[node.start + 1].bbox;
+      auto  inter = bbox3f{
+          max(bbox1.min, bbox2.min), min(bbox1.max, bbox2.max)};
+      if (inter.min.x <= inter.max.x && inter.min.y <= inter.max.y &&
+          inter.min.z <= inter.max.z && bbox_area(node.bbox) > 0)
+        overlap += bbox_area(inter) / bbox_area(node.bbox);
+      stack.push_back({node.start + 0, depth + 1});
+      stack.push_back({node.start + 1, depth + 1});
+    } else {
+      stats.leaves += 1;
+      if (depth >= (int)stats.depths.size()) stats.depths.resize(depth + 1);
+      if (node.num >= (int)stats.leaf_sizes.size())
+        stats.leaf_sizes.resize(node.num + 1);
+      stats.depths[depth] += 1;
+      stats.leaf_sizes[node.num] += 1;
+    }
+  }
+  if (stats.nodes > stats.leaves)
+    stats.overlap = (float)(overlap / (stats.nodes - stats.leaves));
+  return stats;
+}
+
+static void update_bvh(bvh_shape* shape) {
+#ifdef YOCTO_EMBREE
+  if (shape->embree_bvh) {
+    throw std::runtime_error("embree shape refit not supported");
+  }
+#endif
+
+  // build primitives
+  auto bboxes = compute_bboxes(shape, false);
+
+  // update nodes
+  update_bvh(shape->bvh, bboxes);
+  update_wide_nodes(shape->bvh, bboxes);
+
+  // update leaf triangles
+  if (!shape->leaf_triangles.empty()) build_leaf_triangles(shape);
+}
+
+// Refit the bvh of an instance group after its shape changed.
+static void update_bvh(const bvh_scene* scene, bvh_group* group) {
+  auto bboxes = compute_bboxes(scene, group, false);
+  update_bvh(group->bvh, bboxes);
+  update_wide_nodes(group->bvh, bboxes);
+}
+
+void update_bvh(bvh_scene* scene, const vector<int>& updated_instances) {
+#ifdef YOCTO_EMBREE
+  if (scene->embree_bvh) {
+    return update_embree_bvh(scene, updated_instances);
+  }
+#endif
+
+  // build primitives
+  auto [bboxes, motion_bboxes] = compute_bboxes(scene, false);
+
+  // update nodes, dropping wide nodes if instances start moving
+  if (motion_bboxes.empty()) {
+    scene->bvh.motion_bboxes.clear();
+    update_bvh(scene->bvh, bboxes);
+    update_wide_nodes(scene->bvh, bboxes);
+  } else {
+    if (scene->bvh.nodes.empty())
+      throw std::runtime_error("moving instances need binary bvh nodes");
+    refit_motion_nodes(scene->bvh, bboxes, motion_bboxes);
+    build_wide_nodes(scene->bvh, 2, 0);
+  }
+
+  // reset incremental updates
+  init_instance_updates(scene, bboxes, scene->params);
+}
+
+void update_bvh(bvh_scene* scene, const vector<int>& updated_instances,
+    const vector<int>& updated_shapes, const progress_callback& progress_cb) {
+  // handle progress
+  auto progress = vec2i{0, 1 + (int)updated_shapes.size()};
+
+  // update shapes
+  for (auto shape : updated_shapes) {
+    if (progress_cb) progress_cb("update shape bvh", progress.x++, progress.y);
+    update_bvh(scene->shapes[shape]);
+  }
+
+  // update the groups of the updated shapes, before the scene bvh that uses
+  // their bounds
+  for (auto group : scene->groups) {
+    if (std::find(updated_shapes.begin(), updated_shapes.end(),
+            group->shape) == updated_shapes.end())
+      continue;
+    update_bvh(scene, group);
+  }
+
+  // handle instances, incrementally if only instances changed
+  if (progress_cb) progress_cb("update scene bvh", progress.x++, progress.y);
+  if (updated_shapes.empty() && !scene->leaves.empty()) {
+    update_instances(scene, updated_instances);
+  } else {
+    update_bvh(scene, updated_instances);
+  }
+
+  // handle progress
+  if (progress_cb) progress_cb("update bvh", progress.x++, progress.y);
+}
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR BVH COUNTERS
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+#ifdef YOCTO_BVH_STATS
+// Counters of the threads that traversed a bvh, with stable addresses so that
+// each thread can keep a reference to its own.
+static std::mutex                                 bvh_counters_mutex;
+static deque<pair<std::thread::id, bvh_counters>> bvh_counters_threads;
+
+// Counters of the calling thread.
+static bvh_counters& get_thread_counters() {
+  thread_local auto counters = (bvh_counters*)nullptr;
+  if (counters) return *counters;
+  auto lock = std::lock_guard{bvh_counters_mutex};
+  auto id   = std::this_thread::get_id();
+  for (auto& [thread_id, thread_counters] : bvh_counters_threads) {
+    if (thread_id == id) counters = &thread_counters;
+  }
+  if (!counters)
+    counters = &bvh_counters_threads.emplace_back(id, bvh_counters{}).second;
+  return *counters;
+}
+
+// Count rays, nodes visited and elements tested.
+static void count_bvh(uint64_t rays, uint64_t nodes, uint64_t elements) {
+  auto& counters = get_thread_counters();
+  counters.rays += rays;
+  counters.nodes += nodes;
+  counters.elements += elements;
+}
+#else
+// Counting is disabled.
+static inline void count_bvh(uint64_t, uint64_t, uint64_t) {}
+#endif
+
+// Get the counters of the calling thread.
+bvh_counters get_bvh_counters() {
+#ifdef YOCTO_BVH_STATS
+  return get_thread_counters();
+#else
+  return {};
+#endif
+}
+
+// Get the counters of all threads.
+vector<bvh_counters> get_bvh_thread_counters() {
+  auto counters = vector<bvh_counters>{};
+#ifdef YOCTO_BVH_STATS
+  auto lock = std::lock_guard{bvh_counters_mutex};
+  for (auto& [thread_id, thread_counters] : bvh_counters_threads) {
+    counters.push_back(thread_counters);
+  }
+#endif
+  return counters;
+}
+
+// Reset the counters of all threads.
+void reset_bvh_counters() {
+#ifdef YOCTO_BVH_STATS
+  auto lock = std::lock_guard{bvh_counters_mutex};
+  for (auto& [thread_id, thread_counters] : bvh_counters_threads) {
+    thread_counters = {};
+  }
+#endif
+}
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR BVH INTERSECTION
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Frame of an instance at the ray time.
+static frame3f eval_frame(const bvh_instance& instance, float time) {
+  if (!instance.moving) return instance.frame;
+  return lerp(instance.frame, instance.motion_frame, time);
+}
+
+// Bounds of a binary node at the ray time, for bvhs of moving instances.
+static bbox3f eval_bbox(const bvh_tree& bvh, int nodeid, float time) {
+  auto& bbox = bvh.nodes[nodeid].bbox;
+  if (bvh.motion_bboxes.empty()) return bbox;
+  auto& motion_bbox = bvh.motion_bboxes[nodeid];
+  return {lerp(bbox.min, motion_bbox.min, time),
+      lerp(bbox.max, motion_bbox.max, time)};
+}
+
+#if defined(__SSE2__) || defined(_M_X64)
+// Intersect a ray with four children bounds of a wide node, starting at
+// `lane`. Returns the mask of the children hit and sets their distances.
+template <int N>
+static int intersect_bbox4(const bvh_wide_node<N>& node, int lane,
+    const ray3f& ray, const vec3f& ray_dinv, float* dists) {
+  auto tmin = _mm_set1_ps(ray.tmin), tmax = _mm_set1_ps(ray.tmax);
+  for (auto axis = 0; axis < 3; axis++) {
+    auto origin = _mm_set1_ps(ray.o[axis]), dinv = _mm_set1_ps(ray_dinv[axis]);
+    auto it_min = _mm_mul_ps(
+        _mm_sub_ps(_mm_loadu_ps(node.bmin[axis] + lane), origin), dinv);
+    auto it_max = _mm_mul_ps(
+        _mm_sub_ps(_mm_loadu_ps(node.bmax[axis] + lane), origin), dinv);
+    tmin = _mm_max_ps(_mm_min_ps(it_min, it_max), tmin);
+    tmax = _mm_min_ps(_mm_max_ps(it_min, it_max), tmax);
+  }
+  tmax = _mm_mul_ps(tmax, _mm_set1_ps(1.00000024f));
+  _mm_storeu_ps(dists + lane, tmin);
+  return _mm_movemask_ps(_mm_cmple_ps(tmin, tmax)) << lane;
+}
+#endif
+
+#if defined(__AVX__)
+// Intersect a ray with eight children bounds of a wide node. Returns the mask
+// of the children hit and sets their distances.
+static int intersect_bbox8(const bvh_node8& node, const ray3f& ray,
+    const vec3f& ray_dinv, float* dists) {
+  auto tmin = _mm256_set1_ps(ray.tmin), tmax = _mm256_set1_ps(ray.tmax);
+  for (auto axis = 0; axis < 3; axis++) {
+    auto origin = _mm256_set1_ps(ray.o[axis]);
+    auto dinv   = _mm256_set1_ps(ray_dinv[axis]);
+    auto it_min = _mm256_mul_ps(
+        _mm256_sub_ps(_mm256_loadu_ps(node.bmin[axis]), origin), dinv);
+    auto it_max = _mm256_mul_ps(
+        _mm256_sub_ps(_mm256_loadu_ps(node.bmax[axis]), origin), dinv);
+    tmin = _mm256_max_ps(_mm256_min_ps(it_min, it_max), tmin);
+    tmax = _mm256_min_ps(_mm256_max_ps(it_min, it_max), tmax);
+  }
+  tmax = _mm256_mul_ps(tmax, _mm256_set1_ps(1.00000024f));
+  _mm256_storeu_ps(dists, tmin);
+  return _mm256_movemask_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ));
+}
+#endif
+
+// Intersect a ray with the children bounds of a wide node, as done by
+// intersect_bbox. Returns the mask of the children hit and sets their
+// distances. Uses SSE or AVX when available.
+template <int N>
+static int intersect_bbox(const bvh_wide_node<N>& node, const ray3f& ray,
+    const vec3f& ray_dinv, float* dists) {
+#if defined(__AVX__)
+  if constexpr (N == 8) return intersect_bbox8(node, ray, ray_dinv, dists);
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+  auto mask = 0;
+  for (auto lane = 0; lane < N; lane += 4)
+    mask |= intersect_bbox4(node, lane, ray, ray_dinv, dists);
+  return mask;
+#else
+  auto mask = 0;
+  for (auto lane = 0; lane < N; lane++) {
+    auto tmin = ray.tmin, tmax = ray.tmax;
+    for (auto axis = 0; axis < 3; axis++) {
+      auto it_min = (node.bmin[axis][lane] - ray.o[axis]) * ray_dinv[axis];
+      auto it_max = (node.bmax[axis][lane] - ray.o[axis]) * ray_dinv[axis];
+      tmin        = max(min(it_min, it_max), tmin);
+      tmax        = min(max(it_min, it_max), tmax);
+    }
+    tmax *= 1.00000024f;
+    dists[lane] = tmin;
+    if (tmin <= tmax) mask |= 1 << lane;
+  }
+  return mask;
+#endif
+}
+
+// Get a wide node, dequantizing it in a buffer if needed.
+template <int N>
+static const bvh_wide_node<N>& get_wide_node(
+    const bvh_wide_node<N>& node, bvh_wide_node<N>&) {
+  return node;
+}
+template <int N, typename T>
+static const bvh_wide_node<N>& get_wide_node(
+    const bvh_quantized_node<N, T>& qnode, bvh_wide_node<N>& buffer) {
+  dequantize_node(buffer, qnode);
+  return buffer;
+}
+
+// Intersect ray with a wide bvh, visiting children nearest first. Leaves are
+// intersected with `intersect_leaf(start, num, ray)` that returns whether
+// it hit and shortens the ray.
+template <typename Node, typename Func>
+static bool intersect_wide_bvh(const vector<Node>& nodes, const ray3f& ray_,
+    bool find_any, Func&& intersect_leaf) {
+  // node width and buffer for dequantized nodes
+  constexpr auto   N = (int)std::extent_v<decltype(Node::num)>;
+  bvh_wide_node<N> buffer;
+
+  // node stack, holding nodes or leaves as start and num with their distance,
+  // left uninitialized since it is large
+  array<int, bvh_wide_stack>   start_stack;
+  array<int, bvh_wide_stack>   num_stack;
+  array<float, bvh_wide_stack> dist_stack;
+  auto              node_cur = 0;
+  start_stack[node_cur]      = 0;
+  num_stack[node_cur]        = 0;
+  dist_stack[node_cur++]     = ray_.tmin;
+
+  // shared variables
+  auto hit = false;
+
+  // copy ray to modify it
+  auto ray = ray_;
+
+  // prepare ray for fast queries
+  auto ray_dinv = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+
+  // walking stack
+  while (node_cur != 0) {
+    // grab node, skipping it if farther than the closest hit
+    auto start = start_stack[--node_cur], num = num_stack[node_cur];
+    if (dist_stack[node_cur] > ray.tmax * 1.00000024f) continue;
+
+    if (num == 0) {
+      // intersect children bounds
+      count_bvh(0, 1, 0);
+      auto& node  = get_wide_node(nodes[start], buffer);
+      auto  dists = array<float, N>{};
+      auto  mask  = intersect_bbox(node, ray, ray_dinv, dists.data());
+
+      // sort hit children from farthest to nearest
+      auto children = array<int, N>{};
+      auto count    = 0;
+      for (auto lane = 0; lane < N; lane++) {
+        if (!(mask & (1 << lane)) || node.num[lane] < 0) continue;
+        auto idx = count++;
+        for (; idx > 0 && dists[children[idx - 1]] < dists[lane]; idx--)
+          children[idx] = children[idx - 1];
+        children[idx] = lane;
+      }
+
+      // push children so that the nearest is visited first
+      for (auto idx = 0; idx < count; idx++) {
+        start_stack[node_cur]  = node.start[children[idx]];
+        num_stack[node_cur]    = node.num[children[idx]];
+        dist_stack[node_cur++] = dists[children[idx]];
+      }
+    } else {
+      if (intersect_leaf(start, num, ray)) hit = true;
+    }
+
+    // check for early exit
+    if (find_any && hit) return hit;
+  }
+
+  return hit;
+}
+
+// Check whether a bvh has wide nodes.
+static bool has_wide_nodes(const bvh_tree& bvh) {
+  return !bvh.nodes4.empty() || !bvh.nodes8.empty() ||
+         !bvh.nodes4q8.empty() || !bvh.nodes8q8.empty() ||
+         !bvh.nodes4q16.empty() || !bvh.nodes8q16.empty();
+}
+
+// Intersect ray with the wide nodes of a bvh.
+template <typename Func>
+static bool intersect_wide_bvh(const bvh_tree& bvh, const ray3f& ray,
+    bool find_any, Func&& intersect_leaf) {
+  if (!bvh.nodes4.empty())
+    return intersect_wide_bvh(bvh.nodes4, ray, find_any, intersect_leaf);
+  if (!bvh.nodes8.empty())
+    return intersect_wide_bvh(bvh.nodes8, ray, find_any, intersect_leaf);
+  if (!bvh.nodes4q8.empty())
+    return intersect_wide_bvh(bvh.nodes4q8, ray, find_any, intersect_leaf);
+  if (!bvh.nodes8q8.empty())
+    return intersect_wide_bvh(bvh.nodes8q8, ray, find_any, intersect_leaf);
+  if (!bvh.nodes4q16.empty())
+    return intersect_wide_bvh(bvh.nodes4q16, ray, find_any, intersect_leaf);
+  if (!bvh.nodes8q16.empty())
+    return intersect_wide_bvh(bvh.nodes8q16, ray, find_any, intersect_leaf);
+  return false;
+}
+
+// Intersect ray with the binary nodes of a bvh, with bounds interpolated at
+// the ray time for moving instances. Leaves are intersected as in
+// `intersect_wide_bvh`.
+template <typename Func>
+static bool intersect_binary_bvh(const bvh_tree& bvh, const ray3f& ray_,
+    bool find_any, Func&& intersect_leaf) {
+  // check empty
+  if (bvh.nodes.empty()) return false;
+
+  // node stack
+  auto node_stack        = array<int, 128>{};
+  auto node_cur          = 0;
+  node_stack[node_cur++] = 0;
+
+  // shared variables
+  auto hit = false;
+
+  // copy ray to modify it
+  auto ray = ray_;
+
+  // prepare ray for fast queries
+  auto ray_dinv  = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+  auto ray_dsign = vec3i{(ray_dinv.x < 0) ? 1 : 0, (ray_dinv.y < 0) ? 1 : 0,
+      (ray_dinv.z < 0) ? 1 : 0};
+
+  // walking stack
+  while (node_cur != 0) {
+    // grab node
+    auto  nodeid = node_stack[--node_cur];
+    auto& node   = bvh.nodes[nodeid];
+    count_bvh(0, 1, 0);
+
+    // intersect bbox, at the ray time for moving instances
+    auto bbox = eval_bbox(bvh, nodeid, ray.time);
+    if (!intersect_bbox(ray, ray_dinv, bbox)) continue;
+
+    // intersect node, switching based on node type
+    // for each type, iterate over the the primitive list
+    if (node.internal) {
+      // for internal nodes, attempts to proceed along the
+      // split axis from smallest to largest nodes
+      if (ray_dsign[node.axis] != 0) {
+        node_stack[node_cur++] = node.start + 0;
+        node_stack[node_cur++] = node.start + 1;
+      } else {
+        node_stack[node_cur++] = node.start + 1;
+        node_stack[node_cur++] = node.start + 0;
+      }
+    } else {
+      if (intersect_leaf(node.start, node.num, ray)) hit = true;
+    }
+
+    // check for early exit
+    if (find_any && hit) return hit;
+  }
+
+  return hit;
+}
+
+// Ray prepared for watertight ray-triangle intersection, following Woop et
+// al., "Watertight Ray/Triangle Intersection", JCGT 2013. Axes are permuted
+// so that z is the largest direction axis, and the shear maps the ray
+// direction to the z axis.
+struct bvh_watertight_ray {
+  int   kx = 0, ky = 1, kz = 2;
+  float sx = 0, sy = 0, sz = 1;
+};
+
+// Prepare a ray for watertight intersection.
+static bvh_watertight_ray make_watertight_ray(const ray3f& ray) {
+  auto wray = bvh_watertight_ray{};
+  auto dabs = abs(ray.d);
+  wray.kz   = (dabs.x > dabs.y) ? (dabs.x > dabs.z ? 0 : 2)
+                                : (dabs.y > dabs.z ? 1 : 2);
+  wray.kx   = (wray.kz + 1) % 3;
+  wray.ky   = (wray.kx + 1) % 3;
+  if (ray.d[wray.kz] < 0) std::swap(wray.kx, wray.ky);
+  wray.sx = ray.d[wray.kx] / ray.d[wray.kz];
+  wray.sy = ray.d[wray.ky] / ray.d[wray.kz];
+  wray.sz = 1 / ray.d[wray.kz];
+  return wray;
+}
+
+// Intersect a ray with a precomputed triangle, without missing hits on shared
+// edges and vertices. Returns the same uv parametrization as
+// intersect_triangle.
+static bool intersect_watertight(const ray3f& ray,
+    const bvh_watertight_ray& wray, const bvh_triangle& triangle, vec2f& uv,
+    float& dist) {
+  // vertices relative to the ray origin
+  auto a = triangle.p0 - ray.o, b = triangle.p1 - ray.o,
+       c = triangle.p2 - ray.o;
+
+  // shear and scale the vertices
+  auto ax = a[wray.kx] - wray.sx * a[wray.kz];
+  auto ay = a[wray.ky] - wray.sy * a[wray.kz];
+  auto bx = b[wray.kx] - wray.sx * b[wray.kz];
+  auto by = b[wray.ky] - wray.sy * b[wray.kz];
+  auto cx = c[wray.kx] - wray.sx * c[wray.kz];
+  auto cy = c[wray.ky] - wray.sy * c[wray.kz];
+
+  // compute scaled barycentric coordinates, in double precision on edges
+  auto u = cx * by - cy * bx;
+  auto v = ax * cy - ay * cx;
+  auto w = bx * ay - by * ax;
+  if (u == 0 || v == 0 || w == 0) {
+    u = (float)((double)cx * (double)by - (double)cy * (double)bx);
+    v = (float)((double)ax * (double)cy - (double)ay * (double)cx);
+    w = (float)((double)bx * (double)ay - (double)by * (double)ax);
+  }
+
+  // check edges, for both triangle orientations
+  if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0)) return false;
+  auto det = u + v + w;
+  if (det == 0) return false;
+
+  // compute and check ray parameter
+  auto t = wray.sz * (u * a[wray.kz] + v * b[wray.kz] + w * c[wray.kz]) / det;
+  if (t < ray.tmin || t > ray.tmax) return false;
+
+  // intersection occurred: set params and exit
+  uv   = {v / det, w / det};
+  dist = t;
+  return true;
+}
+
+// Intersect ray with the elements of a shape leaf, shortening the ray.
+static bool intersect_elements(const bvh_shape* shape, int start, int num,
+    ray3f& ray, int& element, vec2f& uv, float& distance) {
+  count_bvh(0, 0, num);
+  auto hit = false;
+  if (!shape->leaf_triangles.empty()) {
+    auto wray = make_watertight_ray(ray);
+    for (auto idx = start; idx < start + num; idx++) {
+      if (intersect_watertight(
+              ray, wray, shape->leaf_triangles[idx], uv, distance)) {
+        hit      = true;
+        element  = shape->bvh.primitives[idx];
+        ray.tmax = distance;
+      }
+    }
+  } else if (!shape->points.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& p = shape->points[shape->bvh.primitives[idx]];
+      if (intersect_point(
+              ray, shape->positions[p], shape->radius[p], uv, distance)) {
+        hit      = true;
+        element  = shape->bvh.primitives[idx];
+        ray.tmax = distance;
+      }
     }
   } else if (!shape->lines.empty()) {
-    bboxes = vector<bbox3f>(shape->lines.size());
-    for (auto idx = 0; idx < bboxes.size(); idx++) {
-      auto& l     = shape->lines[idx];
-      bboxes[idx] = line_bounds(shape->positions[l.x], shape->positions[l.y],
-          shape->radius[l.x], shape->radius[l.y]);
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& l = shape->lines[shape->bvh.primitives[idx]];
+      if (intersect_line(ray, shape->positions[l.x], shape->positions[l.y],
+              shape->radius[l.x], shape->radius[l.y], uv, distance)) {
+        hit      = true;
+        element  = shape->bvh.primitives[idx];
+        ray.tmax = distance;
+      }
     }
   } else if (!shape->triangles.empty()) {
-    bboxes = vector<bbox3f>(shape->triangles.size());
-    for (auto idx = 0; idx < bboxes.size(); idx++) {
-      auto& t     = shape->triangles[idx];
-      bboxes[idx] = triangle_bounds(
-          shape->positions[t.x], shape->positions[t.y], shape->positions[t.z]);
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& t = shape->triangles[shape->bvh.primitives[idx]];
+      if (intersect_triangle(ray, shape->positions[t.x],
+              shape->positions[t.y], shape->positions[t.z], uv, distance)) {
+        hit      = true;
+        element  = shape->bvh.primitives[idx];
+        ray.tmax = distance;
+      }
     }
   } else if (!shape->quads.empty()) {
-    bboxes = vector<bbox3f>(shape->quads.size());
-    for (auto idx = 0; idx < bboxes.size(); idx++) {
-      auto& q     = shape->quads[idx];
-      bboxes[idx] = quad_bounds(shape->positions[q.x], shape->positions[q.y],
-          shape->positions[q.z], shape->positions[q.w]);
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& q = shape->quads[shape->bvh.primitives[idx]];
+      if (intersect_quad(ray, shape->positions[q.x], shape->positions[q.y],
+              shape->positions[q.z], shape->positions[q.w], uv, distance)) {
+        hit      = true;
+        element  = shape->bvh.primitives[idx];
+        ray.tmax = distance;
+      }
     }
   }
-
-  // update nodes
-  update_bvh(shape->bvh, bboxes);
+  return hit;
 }
 
-void update_bvh(bvh_scene* scene, const vector<int>& updated_instances) {
+// Intersect ray with a bvh.
+static bool intersect_bvh(const bvh_shape* shape, const ray3f& ray_,
+    int& element, vec2f& uv, float& distance, bool find_any) {
 #ifdef YOCTO_EMBREE
-  if (scene->embree_bvh) {
-    return update_embree_bvh(scene, updated_instances);
+  // call Embree if needed
+  if (shape->embree_bvh) {
+    return intersect_embree_bvh(shape, ray_, element, uv, distance, find_any);
   }
 #endif
 
-  // build primitives
-  auto bboxes = vector<bbox3f>(scene->num_instances);
-  for (auto idx = 0; idx < bboxes.size(); idx++) {
-    auto  instance = scene->instance_cb(idx);
-    auto& sbvh     = scene->shapes[instance.shape]->bvh;
-    bboxes[idx]    = transform_bbox(instance.frame, sbvh.nodes[0].bbox);
+  // intersect the elements of a leaf, shortening the ray
+  auto intersect_leaf = [&](int start, int num, ray3f& ray) {
+    return intersect_elements(shape, start, num, ray, element, uv, distance);
+  };
+
+  // use wide nodes if present
+  if (has_wide_nodes(shape->bvh))
+    return intersect_wide_bvh(shape->bvh, ray_, find_any, intersect_leaf);
+
+  // check empty
+  if (shape->bvh.nodes.empty()) return false;
+
+  // node stack
+  auto node_stack        = array<int, 128>{};
+  auto node_cur          = 0;
+  node_stack[node_cur++] = 0;
+
+  // shared variables
+  auto hit = false;
+
+  // copy ray to modify it
+  auto ray = ray_;
+
+  // prepare ray for fast queries
+  auto ray_dinv  = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+  auto ray_dsign = vec3i{(ray_dinv.x < 0) ? 1 : 0, (ray_dinv.y < 0) ? 1 : 0,
+      (ray_dinv.z < 0) ? 1 : 0};
+
+  // walking stack
+  while (node_cur != 0) {
+    // grab node
+    auto& node = shape->bvh.nodes[node_stack[--node_cur]];
+    count_bvh(0, 1, 0);
+
+    // intersect bbox
+    // if (!intersect_bbox(ray, ray_dinv, ray_dsign, node.bbox)) continue;
+    if (!intersect_bbox(ray, ray_dinv, node.bbox)) continue;
+
+    // intersect node, switching based on node type
+    // for each type, iterate over the the primitive list
+    if (node.internal) {
+      // for internal nodes, attempts to proceed along the
+      // split axis from smallest to largest nodes
+      if (ray_dsign[node.axis] != 0) {
+        node_stack[node_cur++] = node.start + 0;
+        node_stack[node_cur++] = node.start + 1;
+      } else {
+        node_stack[node_cur++] = node.start + 1;
+        node_stack[node_cur++] = node.start + 0;
+      }
+    } else {
+      if (intersect_leaf(node.start, node.num, ray)) hit = true;
+    }
+
+    // check for early exit
+    if (find_any && hit) return hit;
   }
 
-  // update nodes
-  update_bvh(scene->bvh, bboxes);
+  return hit;
 }
 
-void update_bvh(bvh_scene* scene, const vector<int>& updated_instances,
-    const vector<int>& updated_shapes, const progress_callback& progress_cb) {
-  // handle progress
-  auto progress = vec2i{0, 1 + (int)updated_shapes.size()};
+// Intersect ray with an instance group, returning the group frame hit.
+static bool intersect_bvh(const bvh_scene* scene, const bvh_group* group,
+    const ray3f& ray_, int& subinstance, int& element, vec2f& uv,
+    float& distance, bool find_any, bool non_rigid_frames) {
+  // intersect the shape at the frames of a leaf, shortening the ray
+  auto shape          = scene->shapes[group->shape];
+  auto intersect_leaf = [&](int start, int num, ray3f& ray) {
+    auto hit = false;
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& frame   = group->frames[group->bvh.primitives[idx]];
+      auto  inv_ray = transform_ray(inverse(frame, non_rigid_frames), ray);
+      if (intersect_bvh(shape, inv_ray, element, uv, distance, find_any)) {
+        hit         = true;
+        subinstance = group->bvh.primitives[idx];
+        ray.tmax    = distance;
+      }
+    }
+    return hit;
+  };
 
-  // update shapes
-  for (auto shape : updated_shapes) {
-    if (progress_cb) progress_cb("update shape bvh", progress.x++, progress.y);
-    update_bvh(scene->shapes[shape]);
+  // use wide nodes if present
+  if (has_wide_nodes(group->bvh))
+    return intersect_wide_bvh(group->bvh, ray_, find_any, intersect_leaf);
+  return intersect_binary_bvh(group->bvh, ray_, find_any, intersect_leaf);
+}
+
+// Intersect ray with the shape or group of an instance.
+static bool intersect_instance(const bvh_scene* scene,
+    const bvh_instance& instance, const ray3f& ray, int& subinstance,
+    int& element, vec2f& uv, float& distance, bool find_any,
+    bool non_rigid_frames) {
+  auto frame   = eval_frame(instance, ray.time);
+  auto inv_ray = transform_ray(inverse(frame, non_rigid_frames), ray);
+  if (instance.group >= 0)
+    return intersect_bvh(scene, scene->groups[instance.group], inv_ray,
+        subinstance, element, uv, distance, find_any, non_rigid_frames);
+  if (!intersect_bvh(scene->shapes[instance.shape], inv_ray, element, uv,
+          distance, find_any))
+    return false;
+  subinstance = -1;
+  return true;
+}
+
+// Intersect ray with a bvh.
+static bool intersect_bvh(const bvh_scene* scene, const ray3f& ray_,
+    int& instance, int& subinstance, int& element, vec2f& uv, float& distance,
+    bool find_any, bool non_rigid_frames) {
+#ifdef YOCTO_EMBREE
+  // call Embree if needed
+  if (scene->embree_bvh) {
+    return intersect_embree_bvh(
+        scene, ray_, instance, element, uv, distance, find_any);
   }
+#endif
 
-  // handle instances
-  if (progress_cb) progress_cb("update scene bvh", progress.x++, progress.y);
-  update_bvh(scene, updated_instances);
+  // intersect the instances of a leaf, shortening the ray
+  auto intersect_leaf = [&](int start, int num, ray3f& ray) {
+    auto hit = false;
+    for (auto idx = start; idx < start + num; idx++) {
+      auto instance_data = scene->instance_cb(scene->bvh.primitives[idx]);
+      if (intersect_instance(scene, instance_data, ray, subinstance, element,
+              uv, distance, find_any, non_rigid_frames)) {
+        hit      = true;
+        instance = scene->bvh.primitives[idx];
+        ray.tmax = distance;
+      }
+    }
+    return hit;
+  };
 
-  // handle progress
-  if (progress_cb) progress_cb("update bvh", progress.x++, progress.y);
+  // use wide nodes if present
+  if (has_wide_nodes(scene->bvh))
+    return intersect_wide_bvh(scene->bvh, ray_, find_any, intersect_leaf);
+  return intersect_binary_bvh(scene->bvh, ray_, find_any, intersect_leaf);
 }
 
+// Intersect ray with a bvh.
+static bool intersect_bvh(const bvh_scene* scene, int instance,
+    const ray3f& ray, int& subinstance, int& element, vec2f& uv,
+    float& distance, bool find_any, bool non_rigid_frames) {
+  return intersect_instance(scene, scene->instance_cb(instance), ray,
+      subinstance, element, uv, distance, find_any, non_rigid_frames);
+}
+
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
-// IMPLEMENTATION FOR BVH INTERSECTION
+// IMPLEMENTATION FOR BVH PACKET AND STREAM INTERSECTION
 // -----------------------------------------------------------------------------
 namespace yocto {
 
-// Intersect ray with a bvh.
-static bool intersect_bvh(const bvh_shape* shape, const ray3f& ray_,
-    int& element, vec2f& uv, float& distance, bool find_any) {
-#ifdef YOCTO_EMBREE
-  // call Embree if needed
-  if (shape->embree_bvh) {
-    return intersect_embree_bvh(shape, ray_, element, uv, distance, find_any);
+// Packet of rays stored as a structure of arrays, with inverse directions.
+template <int K>
+struct bvh_packet {
+  float o[3][K]    = {};
+  float d[3][K]    = {};
+  float dinv[3][K] = {};
+  float tmin[K]    = {};
+  float tmax[K]    = {};
+  float time[K]    = {};
+};
+
+// Set and get a ray of a packet.
+template <int K>
+static void set_ray(bvh_packet<K>& packet, int lane, const ray3f& ray) {
+  for (auto axis = 0; axis < 3; axis++) {
+    packet.o[axis][lane]    = ray.o[axis];
+    packet.d[axis][lane]    = ray.d[axis];
+    packet.dinv[axis][lane] = 1 / ray.d[axis];
+  }
+  packet.tmin[lane] = ray.tmin;
+  packet.tmax[lane] = ray.tmax;
+  packet.time[lane] = ray.time;
+}
+template <int K>
+static ray3f get_ray(const bvh_packet<K>& packet, int lane) {
+  return {{packet.o[0][lane], packet.o[1][lane], packet.o[2][lane]},
+      {packet.d[0][lane], packet.d[1][lane], packet.d[2][lane]},
+      packet.tmin[lane], packet.tmax[lane], packet.time[lane]};
+}
+
+// Intersect the rays of a packet with a bounding box. Returns the mask of the
+// rays that hit, computed as in intersect_bbox.
+template <int K>
+static uint32_t intersect_bbox(
+    const bvh_packet<K>& packet, const bbox3f& bbox) {
+  auto mask = (uint32_t)0;
+#if defined(__SSE2__) || defined(_M_X64)
+  for (auto lane = 0; lane < K; lane += 4) {
+    auto tmin = _mm_loadu_ps(packet.tmin + lane);
+    auto tmax = _mm_loadu_ps(packet.tmax + lane);
+    for (auto axis = 0; axis < 3; axis++) {
+      auto origin = _mm_loadu_ps(packet.o[axis] + lane);
+      auto dinv   = _mm_loadu_ps(packet.dinv[axis] + lane);
+      auto it_min = _mm_mul_ps(
+          _mm_sub_ps(_mm_set1_ps(bbox.min[axis]), origin), dinv);
+      auto it_max = _mm_mul_ps(
+          _mm_sub_ps(_mm_set1_ps(bbox.max[axis]), origin), dinv);
+      tmin = _mm_max_ps(_mm_min_ps(it_min, it_max), tmin);
+      tmax = _mm_min_ps(_mm_max_ps(it_min, it_max), tmax);
+    }
+    tmax = _mm_mul_ps(tmax, _mm_set1_ps(1.00000024f));
+    mask |= (uint32_t)_mm_movemask_ps(_mm_cmple_ps(tmin, tmax)) << lane;
+  }
+#else
+  for (auto lane = 0; lane < K; lane++) {
+    auto tmin = packet.tmin[lane], tmax = packet.tmax[lane];
+    for (auto axis = 0; axis < 3; axis++) {
+      auto origin = packet.o[axis][lane], dinv = packet.dinv[axis][lane];
+      auto it_min = (bbox.min[axis] - origin) * dinv;
+      auto it_max = (bbox.max[axis] - origin) * dinv;
+      tmin        = max(min(it_min, it_max), tmin);
+      tmax        = min(max(it_min, it_max), tmax);
+    }
+    tmax *= 1.00000024f;
+    if (tmin <= tmax) mask |= (uint32_t)1 << lane;
   }
 #endif
+  return mask;
+}
 
-  // check empty
-  if (shape->bvh.nodes.empty()) return false;
+// Index of the first ray in a mask.
+static int first_lane(uint32_t mask) {
+  auto lane = 0;
+  while (!(mask & ((uint32_t)1 << lane))) lane++;
+  return lane;
+}
+
+// Intersect the rays of a packet in `mask` with a shape bvh. Children are
+// visited in the order of the first active ray, and leaves are intersected
+// one ray at a time. Falls back to single rays for bvhs without binary nodes.
+template <int K>
+static void intersect_packet(const bvh_shape* shape, bvh_packet<K>& packet,
+    uint32_t mask, bool find_any, bvh_intersection* intersections) {
+  // intersect single rays if needed
+  if (shape->bvh.nodes.empty()) {
+    for (auto lane = 0; lane < K; lane++) {
+      if (!(mask & ((uint32_t)1 << lane))) continue;
+      auto& intersection = intersections[lane];
+      intersection.hit   = intersect_bvh(shape, get_ray(packet, lane),
+          intersection.element, intersection.uv, intersection.distance,
+          find_any);
+      if (intersection.hit) packet.tmax[lane] = intersection.distance;
+    }
+    return;
+  }
+
+  // node stack, with the mask of the rays that visit each node
+  auto node_stack        = array<int, 128>{};
+  auto mask_stack        = array<uint32_t, 128>{};
+  auto node_cur          = 0;
+  node_stack[node_cur]   = 0;
+  mask_stack[node_cur++] = mask;
+
+  // walking stack
+  while (node_cur != 0) {
+    // grab node
+    auto& node = shape->bvh.nodes[node_stack[--node_cur]];
+    count_bvh(0, 1, 0);
+
+    // intersect bbox, skipping rays that are done
+    auto node_mask = mask_stack[node_cur] & mask;
+    if (node_mask != 0) node_mask &= intersect_bbox(packet, node.bbox);
+    if (node_mask == 0) continue;
+
+    // intersect node, switching based on node type
+    if (node.internal) {
+      // proceed along the split axis as the first active ray
+      if (packet.dinv[node.axis][first_lane(node_mask)] < 0) {
+        node_stack[node_cur]   = node.start + 0;
+        mask_stack[node_cur++] = node_mask;
+        node_stack[node_cur]   = node.start + 1;
+        mask_stack[node_cur++] = node_mask;
+      } else {
+        node_stack[node_cur]   = node.start + 1;
+        mask_stack[node_cur++] = node_mask;
+        node_stack[node_cur]   = node.start + 0;
+        mask_stack[node_cur++] = node_mask;
+      }
+    } else {
+      for (auto lane = 0; lane < K; lane++) {
+        if (!(node_mask & ((uint32_t)1 << lane))) continue;
+        auto  ray          = get_ray(packet, lane);
+        auto& intersection = intersections[lane];
+        if (intersect_elements(shape, node.start, node.num, ray,
+                intersection.element, intersection.uv,
+                intersection.distance)) {
+          intersection.hit  = true;
+          packet.tmax[lane] = ray.tmax;
+          if (find_any) mask &= ~((uint32_t)1 << lane);
+        }
+      }
+    }
+
+    // check for early exit
+    if (mask == 0) return;
+  }
+}
+
+// Intersect the rays of a packet in `mask` with a scene bvh. At the leaves,
+// the active rays are transformed to each instance and traversed as a packet.
+template <int K>
+static void intersect_packet(const bvh_scene* scene, bvh_packet<K>& packet,
+    uint32_t mask, bool find_any, bool non_rigid_frames,
+    bvh_intersection* intersections) {
+  // intersect single rays if needed
+  if (scene->bvh.nodes.empty()) {
+    for (auto lane = 0; lane < K; lane++) {
+      if (!(mask & ((uint32_t)1 << lane))) continue;
+      auto& intersection = intersections[lane];
+      intersection.hit   = intersect_bvh(scene, get_ray(packet, lane),
+          intersection.instance, intersection.subinstance,
+          intersection.element, intersection.uv, intersection.distance,
+          find_any, non_rigid_frames);
+    }
+    return;
+  }
+
+  // node stack, with the mask of the rays that visit each node
+  auto node_stack        = array<int, 128>{};
+  auto mask_stack        = array<uint32_t, 128>{};
+  auto node_cur          = 0;
+  node_stack[node_cur]   = 0;
+  mask_stack[node_cur++] = mask;
+
+  // walking stack
+  while (node_cur != 0) {
+    // grab node
+    auto& node = scene->bvh.nodes[node_stack[--node_cur]];
+    count_bvh(0, 1, 0);
+
+    // intersect bbox, skipping rays that are done
+    auto node_mask = mask_stack[node_cur] & mask;
+    if (node_mask != 0) node_mask &= intersect_bbox(packet, node.bbox);
+    if (node_mask == 0) continue;
+
+    // intersect node, switching based on node type
+    if (node.internal) {
+      // proceed along the split axis as the first active ray
+      if (packet.dinv[node.axis][first_lane(node_mask)] < 0) {
+        node_stack[node_cur]   = node.start + 0;
+        mask_stack[node_cur++] = node_mask;
+        node_stack[node_cur]   = node.start + 1;
+        mask_stack[node_cur++] = node_mask;
+      } else {
+        node_stack[node_cur]   = node.start + 1;
+        mask_stack[node_cur++] = node_mask;
+        node_stack[node_cur]   = node.start + 0;
+        mask_stack[node_cur++] = node_mask;
+      }
+    } else {
+      for (auto idx = node.start; idx < node.start + node.num; idx++) {
+        auto instance      = scene->bvh.primitives[idx];
+        auto instance_data = scene->instance_cb(instance);
+        auto inv_frame     = inverse(instance_data.frame, non_rigid_frames);
+        auto shape_packet  = bvh_packet<K>{};
+        for (auto lane = 0; lane < K; lane++) {
+          if (!(node_mask & ((uint32_t)1 << lane))) continue;
+          auto ray = get_ray(packet, lane);
+          if (instance_data.moving)
+            inv_frame = inverse(
+                eval_frame(instance_data, ray.time), non_rigid_frames);
+          set_ray(shape_packet, lane, transform_ray(inv_frame, ray));
+        }
+        auto shape_intersections = array<bvh_intersection, K>{};
+        intersect_packet(scene->shapes[instance_data.shape], shape_packet,
+            node_mask, find_any, shape_intersections.data());
+        for (auto lane = 0; lane < K; lane++) {
+          if (!shape_intersections[lane].hit) continue;
+          intersections[lane]          = shape_intersections[lane];
+          intersections[lane].instance = instance;
+          packet.tmax[lane]            = intersections[lane].distance;
+          if (find_any) mask &= ~((uint32_t)1 << lane);
+        }
+        node_mask &= mask;
+        if (node_mask == 0) break;
+      }
+    }
+
+    // check for early exit
+    if (mask == 0) return;
+  }
+}
+
+// Intersect a packet of rays with a scene bvh, skipping rays with tmin
+// greater than tmax.
+template <int K>
+static array<bvh_intersection, K> intersect_packet(const bvh_scene* scene,
+    const array<ray3f, K>& rays, bool find_any, bool non_rigid_frames) {
+  // intersect single rays for moving instances, since packets are traversed
+  // with static node bounds, and for groups
+  auto intersections = array<bvh_intersection, K>{};
+  if (!scene->bvh.motion_bboxes.empty() || !scene->groups.empty()) {
+    for (auto lane = 0; lane < K; lane++) {
+      if (rays[lane].tmin > rays[lane].tmax) continue;
+      intersections[lane] = intersect_bvh(
+          scene, rays[lane], find_any, non_rigid_frames);
+    }
+    return intersections;
+  }
+
+  auto packet = bvh_packet<K>{};
+  auto mask   = (uint32_t)0;
+  for (auto lane = 0; lane < K; lane++) {
+    if (rays[lane].tmin > rays[lane].tmax) continue;
+    set_ray(packet, lane, rays[lane]);
+    mask |= (uint32_t)1 << lane;
+    count_bvh(1, 0, 0);
+  }
+  intersect_packet(
+      scene, packet, mask, find_any, non_rigid_frames, intersections.data());
+  return intersections;
+}
+
+// Stream of rays stored as a structure of arrays, with inverse directions.
+struct bvh_stream {
+  vector<float> o[3]    = {};
+  vector<float> d[3]    = {};
+  vector<float> dinv[3] = {};
+  vector<float> tmin    = {};
+  vector<float> tmax    = {};
+  vector<float> time    = {};
+};
+
+// Initialize a stream of rays.
+static void init_stream(bvh_stream& stream, size_t num) {
+  for (auto axis = 0; axis < 3; axis++) {
+    stream.o[axis].resize(num);
+    stream.d[axis].resize(num);
+    stream.dinv[axis].resize(num);
+  }
+  stream.tmin.resize(num);
+  stream.tmax.resize(num);
+  stream.time.resize(num);
+}
+
+// Set and get a ray of a stream.
+static void set_ray(bvh_stream& stream, int idx, const ray3f& ray) {
+  for (auto axis = 0; axis < 3; axis++) {
+    stream.o[axis][idx]    = ray.o[axis];
+    stream.d[axis][idx]    = ray.d[axis];
+    stream.dinv[axis][idx] = 1 / ray.d[axis];
+  }
+  stream.tmin[idx] = ray.tmin;
+  stream.tmax[idx] = ray.tmax;
+  stream.time[idx] = ray.time;
+}
+static ray3f get_ray(const bvh_stream& stream, int idx) {
+  return {{stream.o[0][idx], stream.o[1][idx], stream.o[2][idx]},
+      {stream.d[0][idx], stream.d[1][idx], stream.d[2][idx]},
+      stream.tmin[idx], stream.tmax[idx], stream.time[idx]};
+}
+
+// Intersect a ray of a stream with a bounding box, as in intersect_bbox.
+static bool intersect_bbox(
+    const bvh_stream& stream, int idx, const bbox3f& bbox) {
+  auto tmin = stream.tmin[idx], tmax = stream.tmax[idx];
+  for (auto axis = 0; axis < 3; axis++) {
+    auto origin = stream.o[axis][idx], dinv = stream.dinv[axis][idx];
+    auto it_min = (bbox.min[axis] - origin) * dinv;
+    auto it_max = (bbox.max[axis] - origin) * dinv;
+    tmin        = max(min(it_min, it_max), tmin);
+    tmax        = min(max(it_min, it_max), tmax);
+  }
+  tmax *= 1.00000024f;
+  return tmin <= tmax;
+}
+
+// Intersect a stream of rays with a shape bvh. At each node, the rays that
+// hit it are compacted at the end of the ray indices, so that its children
+// only test the active rays. Rays that are done have a negative tmax.
+// Falls back to single rays for bvhs without binary nodes.
+static void intersect_stream(const bvh_shape* shape, bvh_stream& stream,
+    bool find_any, vector<bvh_intersection>& intersections) {
+  // intersect single rays if needed
+  auto num_rays = (int)stream.tmin.size();
+  if (shape->bvh.nodes.empty()) {
+    for (auto idx = 0; idx < num_rays; idx++) {
+      if (stream.tmin[idx] > stream.tmax[idx]) continue;
+      auto& intersection = intersections[idx];
+      intersection.hit   = intersect_bvh(shape, get_ray(stream, idx),
+          intersection.element, intersection.uv, intersection.distance,
+          find_any);
+      if (intersection.hit) stream.tmax[idx] = intersection.distance;
+    }
+    return;
+  }
+
+  // ray indices, starting with all active rays
+  auto indices = vector<int>{};
+  indices.reserve(num_rays * 4);
+  for (auto idx = 0; idx < num_rays; idx++) {
+    if (stream.tmin[idx] <= stream.tmax[idx]) indices.push_back(idx);
+  }
+
+  // node stack, with the range of the rays that visit each node
+  auto node_stack = vector<vec3i>{{0, 0, (int)indices.size()}};
+
+  // walking stack
+  while (!node_stack.empty()) {
+    // grab node, dropping the ray ranges of visited nodes
+    auto [node_id, start, end] = node_stack.back();
+    node_stack.pop_back();
+    indices.resize(end);
+    auto& node = shape->bvh.nodes[node_id];
+    count_bvh(0, 1, 0);
+
+    // intersect bbox, compacting the rays that hit
+    for (auto idx = start; idx < end; idx++) {
+      if (intersect_bbox(stream, indices[idx], node.bbox))
+        indices.push_back(indices[idx]);
+    }
+    auto first = end, last = (int)indices.size();
+    if (first == last) continue;
+
+    // intersect node, switching based on node type
+    if (node.internal) {
+      // proceed along the split axis as the first active ray
+      if (stream.dinv[node.axis][indices[first]] < 0) {
+        node_stack.push_back({node.start + 0, first, last});
+        node_stack.push_back({node.start + 1, first, last});
+      } else {
+        node_stack.push_back({node.start + 1, first, last});
+        node_stack.push_back({node.start + 0, first, last});
+      }
+    } else {
+      for (auto idx = first; idx < last; idx++) {
+        auto  ray          = get_ray(stream, indices[idx]);
+        auto& intersection = intersections[indices[idx]];
+        if (intersect_elements(shape, node.start, node.num, ray,
+                intersection.element, intersection.uv,
+                intersection.distance)) {
+          intersection.hit          = true;
+          stream.tmax[indices[idx]] = find_any ? -flt_max : ray.tmax;
+        }
+      }
+    }
+  }
+}
+
+// Intersect a stream of rays with a scene bvh. At the leaves, the active rays
+// are transformed to each instance and traversed as a stream.
+static void intersect_stream(const bvh_scene* scene, bvh_stream& stream,
+    bool find_any, bool non_rigid_frames,
+    vector<bvh_intersection>& intersections) {
+  // intersect single rays if needed
+  auto num_rays = (int)stream.tmin.size();
+  if (scene->bvh.nodes.empty()) {
+    for (auto idx = 0; idx < num_rays; idx++) {
+      if (stream.tmin[idx] > stream.tmax[idx]) continue;
+      auto& intersection = intersections[idx];
+      intersection.hit   = intersect_bvh(scene, get_ray(stream, idx),
+          intersection.instance, intersection.subinstance,
+          intersection.element, intersection.uv, intersection.distance,
+          find_any, non_rigid_frames);
+    }
+    return;
+  }
+
+  // ray indices, starting with all active rays
+  auto indices = vector<int>{};
+  indices.reserve(num_rays * 4);
+  for (auto idx = 0; idx < num_rays; idx++) {
+    if (stream.tmin[idx] <= stream.tmax[idx]) indices.push_back(idx);
+  }
+
+  // node stack, with the range of the rays that visit each node
+  auto node_stack = vector<vec3i>{{0, 0, (int)indices.size()}};
+
+  // instance rays and intersections
+  auto shape_stream        = bvh_stream{};
+  auto shape_intersections = vector<bvh_intersection>{};
+
+  // walking stack
+  while (!node_stack.empty()) {
+    // grab node, dropping the ray ranges of visited nodes
+    auto [node_id, start, end] = node_stack.back();
+    node_stack.pop_back();
+    indices.resize(end);
+    auto& node = scene->bvh.nodes[node_id];
+    count_bvh(0, 1, 0);
+
+    // intersect bbox, compacting the rays that hit
+    for (auto idx = start; idx < end; idx++) {
+      if (intersect_bbox(stream, indices[idx], node.bbox))
+        indices.push_back(indices[idx]);
+    }
+    auto first = end, last = (int)indices.size();
+    if (first == last) continue;
+
+    // intersect node, switching based on node type
+    if (node.internal) {
+      // proceed along the split axis as the first active ray
+      if (stream.dinv[node.axis][indices[first]] < 0) {
+        node_stack.push_back({node.start + 0, first, last});
+        node_stack.push_back({node.start + 1, first, last});
+      } else {
+        node_stack.push_back({node.start + 1, first, last});
+        node_stack.push_back({node.start + 0, first, last});
+      }
+    } else {
+      for (auto idx = node.start; idx < node.start + node.num; idx++) {
+        auto instance      = scene->bvh.primitives[idx];
+        auto instance_data = scene->instance_cb(instance);
+        auto inv_frame     = inverse(instance_data.frame, non_rigid_frames);
+        init_stream(shape_stream, last - first);
+        for (auto ray = first; ray < last; ray++) {
+          auto stream_ray = get_ray(stream, indices[ray]);
+          if (instance_data.moving)
+            inv_frame = inverse(
+                eval_frame(instance_data, stream_ray.time), non_rigid_frames);
+          set_ray(shape_stream, ray - first,
+              transform_ray(inv_frame, stream_ray));
+        }
+        shape_intersections.assign(last - first, bvh_intersection{});
+        intersect_stream(scene->shapes[instance_data.shape], shape_stream,
+            find_any, shape_intersections);
+        for (auto ray = first; ray < last; ray++) {
+          auto& shape_intersection = shape_intersections[ray - first];
+          if (!shape_intersection.hit) continue;
+          auto& intersection    = intersections[indices[ray]];
+          intersection          = shape_intersection;
+          intersection.instance = instance;
+          stream.tmax[indices[ray]] = find_any ? -flt_max
+                                               : intersection.distance;
+        }
+      }
+    }
+  }
+}
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR BVH OCCLUSION
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Check whether a ray hits any element of a shape leaf, stopping at the first
+// hit.
+static bool occluded_elements(
+    const bvh_shape* shape, int start, int num, const ray3f& ray) {
+  count_bvh(0, 0, num);
+  auto uv       = vec2f{0, 0};
+  auto distance = 0.0f;
+  if (!shape->leaf_triangles.empty()) {
+    auto wray = make_watertight_ray(ray);
+    for (auto idx = start; idx < start + num; idx++) {
+      if (intersect_watertight(
+              ray, wray, shape->leaf_triangles[idx], uv, distance))
+        return true;
+    }
+  } else if (!shape->points.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& p = shape->points[shape->bvh.primitives[idx]];
+      if (intersect_point(
+              ray, shape->positions[p], shape->radius[p], uv, distance))
+        return true;
+    }
+  } else if (!shape->lines.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& l = shape->lines[shape->bvh.primitives[idx]];
+      if (intersect_line(ray, shape->positions[l.x], shape->positions[l.y],
+              shape->radius[l.x], shape->radius[l.y], uv, distance))
+        return true;
+    }
+  } else if (!shape->triangles.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& t = shape->triangles[shape->bvh.primitives[idx]];
+      if (intersect_triangle(ray, shape->positions[t.x],
+              shape->positions[t.y], shape->positions[t.z], uv, distance))
+        return true;
+    }
+  } else if (!shape->quads.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& q = shape->quads[shape->bvh.primitives[idx]];
+      if (intersect_quad(ray, shape->positions[q.x], shape->positions[q.y],
+              shape->positions[q.z], shape->positions[q.w], uv, distance))
+        return true;
+    }
+  }
+  return false;
+}
 
+// Check whether a ray hits a binary bvh, with `occluded_leaf(start, num)`
+// testing the leaves. The traversal descends into the near child along the
+// split axis, pushing only the far child, and stops at the first hit. Node
+// bounds are interpolated at the ray time for moving instances.
+template <typename Func>
+static bool occluded_binary_nodes(
+    const bvh_tree& bvh, const ray3f& ray, Func&& occluded_leaf) {
   // node stack
   auto node_stack        = array<int, 128>{};
   auto node_cur          = 0;
   node_stack[node_cur++] = 0;
 
-  // shared variables
-  auto hit = false;
-
-  // copy ray to modify it
-  auto ray = ray_;
-
   // prepare ray for fast queries
   auto ray_dinv  = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
   auto ray_dsign = vec3i{(ray_dinv.x < 0) ? 1 : 0, (ray_dinv.y < 0) ? 1 : 0,
@@ -902,137 +3748,170 @@ static bool intersect_bvh(const bvh_shape* shape, const ray3f& ray_,
 
   // walking stack
   while (node_cur != 0) {
-    // grab node
-    auto& node = shape->bvh.nodes[node_stack[--node_cur]];
+    // descend the tree until a leaf or a miss
+    auto node_id = node_stack[--node_cur];
+    while (true) {
+      auto& node = bvh.nodes[node_id];
+      count_bvh(0, 1, 0);
+      if (!intersect_bbox(ray, ray_dinv, eval_bbox(bvh, node_id, ray.time)))
+        break;
+      if (!node.internal) {
+        if (occluded_leaf(node.start, node.num)) return true;
+        break;
+      }
+      auto near              = ray_dsign[node.axis];
+      node_stack[node_cur++] = node.start + 1 - near;
+      node_id                = node.start + near;
+    }
+  }
 
-    // intersect bbox
-    // if (!intersect_bbox(ray, ray_dinv, ray_dsign, node.bbox)) continue;
-    if (!intersect_bbox(ray, ray_dinv, node.bbox)) continue;
+  return false;
+}
 
-    // intersect node, switching based on node type
-    // for each type, iterate over the the primitive list
-    if (node.internal) {
-      // for internal nodes, attempts to proceed along the
-      // split axis from smallest to largest nodes
-      if (ray_dsign[node.axis] != 0) {
-        node_stack[node_cur++] = node.start + 0;
-        node_stack[node_cur++] = node.start + 1;
-      } else {
-        node_stack[node_cur++] = node.start + 1;
-        node_stack[node_cur++] = node.start + 0;
-      }
-    } else if (!shape->points.empty()) {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& p = shape->points[shape->bvh.primitives[idx]];
-        if (intersect_point(
-                ray, shape->positions[p], shape->radius[p], uv, distance)) {
-          hit      = true;
-          element  = shape->bvh.primitives[idx];
-          ray.tmax = distance;
-        }
-      }
-    } else if (!shape->lines.empty()) {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& l = shape->lines[shape->bvh.primitives[idx]];
-        if (intersect_line(ray, shape->positions[l.x], shape->positions[l.y],
-                shape->radius[l.x], shape->radius[l.y], uv, distance)) {
-          hit      = true;
-          element  = shape->bvh.primitives[idx];
-          ray.tmax = distance;
-        }
-      }
-    } else if (!shape->triangles.empty()) {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& t = shape->triangles[shape->bvh.primitives[idx]];
-        if (intersect_triangle(ray, shape->positions[t.x],
-                shape->positions[t.y], shape->positions[t.z], uv, distance)) {
-          hit      = true;
-          element  = shape->bvh.primitives[idx];
-          ray.tmax = distance;
-        }
-      }
-    } else if (!shape->quads.empty()) {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& q = shape->quads[shape->bvh.primitives[idx]];
-        if (intersect_quad(ray, shape->positions[q.x], shape->positions[q.y],
-                shape->positions[q.z], shape->positions[q.w], uv, distance)) {
-          hit      = true;
-          element  = shape->bvh.primitives[idx];
-          ray.tmax = distance;
-        }
+// Check whether a ray hits a wide bvh, with `occluded_leaf(start, num)`
+// testing the leaves. Children are not sorted by distance, and leaves are
+// tested as soon as their bounds are hit, so the stack holds only nodes.
+template <typename Node, typename Func>
+static bool occluded_wide_nodes(
+    const vector<Node>& nodes, const ray3f& ray, Func&& occluded_leaf) {
+  // node width and buffer for dequantized nodes
+  constexpr auto   N = (int)std::extent_v<decltype(Node::num)>;
+  bvh_wide_node<N> buffer;
+
+  // node stack, left uninitialized since it is large
+  array<int, bvh_wide_stack> node_stack;
+  auto                       node_cur = 0;
+  node_stack[node_cur++]              = 0;
+
+  // prepare ray for fast queries
+  auto ray_dinv = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+
+  // walking stack
+  while (node_cur != 0) {
+    // intersect children bounds
+    count_bvh(0, 1, 0);
+    auto& node  = get_wide_node(nodes[node_stack[--node_cur]], buffer);
+    auto  dists = array<float, N>{};
+    auto  mask  = intersect_bbox(node, ray, ray_dinv, dists.data());
+
+    // test hit leaves and push hit nodes
+    for (auto lane = 0; lane < N; lane++) {
+      if (!(mask & (1 << lane)) || node.num[lane] < 0) continue;
+      if (node.num[lane] == 0) {
+        node_stack[node_cur++] = node.start[lane];
+      } else if (occluded_leaf(node.start[lane], node.num[lane])) {
+        return true;
       }
     }
-
-    // check for early exit
-    if (find_any && hit) return hit;
   }
 
-  return hit;
+  return false;
 }
 
-// Intersect ray with a bvh.
-static bool intersect_bvh(const bvh_scene* scene, const ray3f& ray_,
-    int& instance, int& element, vec2f& uv, float& distance, bool find_any,
-    bool non_rigid_frames) {
+// Check whether a ray hits a bvh tree, using its wide nodes if present.
+template <typename Func>
+static bool occluded_nodes(
+    const bvh_tree& bvh, const ray3f& ray, Func&& occluded_leaf) {
+  if (!bvh.nodes4.empty())
+    return occluded_wide_nodes(bvh.nodes4, ray, occluded_leaf);
+  if (!bvh.nodes8.empty())
+    return occluded_wide_nodes(bvh.nodes8, ray, occluded_leaf);
+  if (!bvh.nodes4q8.empty())
+    return occluded_wide_nodes(bvh.nodes4q8, ray, occluded_leaf);
+  if (!bvh.nodes8q8.empty())
+    return occluded_wide_nodes(bvh.nodes8q8, ray, occluded_leaf);
+  if (!bvh.nodes4q16.empty())
+    return occluded_wide_nodes(bvh.nodes4q16, ray, occluded_leaf);
+  if (!bvh.nodes8q16.empty())
+    return occluded_wide_nodes(bvh.nodes8q16, ray, occluded_leaf);
+  if (!bvh.nodes.empty())
+    return occluded_binary_nodes(bvh, ray, occluded_leaf);
+  return false;
+}
+
+// Check whether a ray hits a shape bvh.
+static bool occluded_bvh(const bvh_shape* shape, const ray3f& ray) {
 #ifdef YOCTO_EMBREE
   // call Embree if needed
-  if (scene->embree_bvh) {
-    return intersect_embree_bvh(
-        scene, ray_, instance, element, uv, distance, find_any);
+  if (shape->embree_bvh) {
+    auto element = 0;
+    auto uv      = vec2f{0, 0};
+    auto dist    = 0.0f;
+    return intersect_embree_bvh(shape, ray, element, uv, dist, true);
   }
 #endif
 
-  // check empty
-  if (scene->bvh.nodes.empty()) return false;
+  return occluded_nodes(shape->bvh, ray, [shape, &ray](int start, int num) {
+    return occluded_elements(shape, start, num, ray);
+  });
+}
 
-  // node stack
-  auto node_stack        = array<int, 128>{};
-  auto node_cur          = 0;
-  node_stack[node_cur++] = 0;
+// Check whether a ray hits the shape or group of an instance.
+static bool occluded_instance(const bvh_scene* scene,
+    const bvh_instance& instance, const ray3f& ray, bool non_rigid_frames) {
+  auto frame   = eval_frame(instance, ray.time);
+  auto inv_ray = transform_ray(inverse(frame, non_rigid_frames), ray);
+  if (instance.group < 0)
+    return occluded_bvh(scene->shapes[instance.shape], inv_ray);
+  auto group = scene->groups[instance.group];
+  auto shape = scene->shapes[group->shape];
+  return occluded_nodes(group->bvh, inv_ray, [&](int start, int num) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& group_frame = group->frames[group->bvh.primitives[idx]];
+      if (occluded_bvh(shape,
+              transform_ray(inverse(group_frame, non_rigid_frames), inv_ray)))
+        return true;
+    }
+    return false;
+  });
+}
 
-  // shared variables
-  auto hit = false;
+}  // namespace yocto
 
-  // copy ray to modify it
-  auto ray = ray_;
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR BVH OVERLAP
+// -----------------------------------------------------------------------------
+namespace yocto {
 
-  // prepare ray for fast queries
-  auto ray_dinv  = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
-  auto ray_dsign = vec3i{(ray_dinv.x < 0) ? 1 : 0, (ray_dinv.y < 0) ? 1 : 0,
-      (ray_dinv.z < 0) ? 1 : 0};
+// Find the closest or any overlap with a wide bvh. Leaves are overlapped with
+// `overlap_leaf(start, num, max_distance)` that returns whether it overlaps
+// and shortens the max distance.
+template <typename Node, typename Func>
+static bool overlap_wide_bvh(const vector<Node>& nodes, const vec3f& pos,
+    float max_distance, bool find_any, Func&& overlap_leaf) {
+  // node width and buffer for dequantized nodes
+  constexpr auto   N = (int)std::extent_v<decltype(Node::num)>;
+  bvh_wide_node<N> buffer;
+
+  // node stack, holding nodes or leaves as start and num
+  auto start_stack      = array<int, bvh_wide_stack>{};
+  auto num_stack        = array<int, bvh_wide_stack>{};
+  auto node_cur         = 0;
+  start_stack[node_cur] = 0;
+  num_stack[node_cur++] = 0;
+
+  // hit
+  auto hit = false;
 
   // walking stack
   while (node_cur != 0) {
     // grab node
-    auto& node = scene->bvh.nodes[node_stack[--node_cur]];
-
-    // intersect bbox
-    // if (!intersect_bbox(ray, ray_dinv, ray_dsign, node.bbox)) continue;
-    if (!intersect_bbox(ray, ray_dinv, node.bbox)) continue;
-
-    // intersect node, switching based on node type
-    // for each type, iterate over the the primitive list
-    if (node.internal) {
-      // for internal nodes, attempts to proceed along the
-      // split axis from smallest to largest nodes
-      if (ray_dsign[node.axis] != 0) {
-        node_stack[node_cur++] = node.start + 0;
-        node_stack[node_cur++] = node.start + 1;
-      } else {
-        node_stack[node_cur++] = node.start + 1;
-        node_stack[node_cur++] = node.start + 0;
+    auto start = start_stack[--node_cur], num = num_stack[node_cur];
+
+    if (num == 0) {
+      // push children that overlap
+      auto& node = get_wide_node(nodes[start], buffer);
+      for (auto lane = 0; lane < N; lane++) {
+        if (node.num[lane] < 0) continue;
+        auto bbox = bbox3f{
+            {node.bmin[0][lane], node.bmin[1][lane], node.bmin[2][lane]},
+            {node.bmax[0][lane], node.bmax[1][lane], node.bmax[2][lane]}};
+        if (!overlap_bbox(pos, max_distance, bbox)) continue;
+        start_stack[node_cur] = node.start[lane];
+        num_stack[node_cur++] = node.num[lane];
       }
     } else {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto [frame, shape_id] = scene->instance_cb(scene->bvh.primitives[idx]);
-        auto& shape            = scene->shapes[shape_id];
-        auto  inv_ray = transform_ray(inverse(frame, non_rigid_frames), ray);
-        if (intersect_bvh(shape, inv_ray, element, uv, distance, find_any)) {
-          hit      = true;
-          instance = scene->bvh.primitives[idx];
-          ray.tmax = distance;
-        }
-      }
+      if (overlap_leaf(start, num, max_distance)) hit = true;
     }
 
     // check for early exit
@@ -1042,29 +3921,36 @@ static bool intersect_bvh(const bvh_scene* scene, const ray3f& ray_,
   return hit;
 }
 
-// Intersect ray with a bvh.
-static bool intersect_bvh(const bvh_scene* scene, int instance,
-    const ray3f& ray, int& element, vec2f& uv, float& distance, bool find_any,
-    bool non_rigid_frames) {
-  auto [frame, shape_id] = scene->instance_cb(instance);
-  auto& shape            = scene->shapes[shape_id];
-  auto  inv_ray          = transform_ray(inverse(frame, non_rigid_frames), ray);
-  return intersect_bvh(shape, inv_ray, element, uv, distance, find_any);
+// Find the closest or any overlap with the wide nodes of a bvh. Only quantized
+// nodes are used, since the others are kept together with binary nodes.
+template <typename Func>
+static bool overlap_wide_bvh(const bvh_tree& bvh, const vec3f& pos,
+    float max_distance, bool find_any, Func&& overlap_leaf) {
+  if (!bvh.nodes4q8.empty())
+    return overlap_wide_bvh(
+        bvh.nodes4q8, pos, max_distance, find_any, overlap_leaf);
+  if (!bvh.nodes8q8.empty())
+    return overlap_wide_bvh(
+        bvh.nodes8q8, pos, max_distance, find_any, overlap_leaf);
+  if (!bvh.nodes4q16.empty())
+    return overlap_wide_bvh(
+        bvh.nodes4q16, pos, max_distance, find_any, overlap_leaf);
+  if (!bvh.nodes8q16.empty())
+    return overlap_wide_bvh(
+        bvh.nodes8q16, pos, max_distance, find_any, overlap_leaf);
+  return false;
 }
 
-}  // namespace yocto
-
-// -----------------------------------------------------------------------------
-// IMPLEMENTATION FOR BVH OVERLAP
-// -----------------------------------------------------------------------------
-namespace yocto {
-
-// Intersect ray with a bvh.
-static bool overlap_bvh(const bvh_shape* shape, const vec3f& pos,
-    float max_distance, int& element, vec2f& uv, float& distance,
-    bool find_any) {
-  // check if empty
-  if (shape->bvh.nodes.empty()) return false;
+// Find the closest or any overlap with the binary nodes of a bvh, or with its
+// quantized nodes if it has no binary nodes. Leaves are overlapped as in
+// `overlap_wide_bvh`.
+template <typename Func>
+static bool overlap_nodes(const bvh_tree& bvh, const vec3f& pos,
+    float max_distance, bool find_any, Func&& overlap_leaf) {
+  // use quantized nodes if present
+  if (is_empty(bvh)) return false;
+  if (bvh.nodes.empty())
+    return overlap_wide_bvh(bvh, pos, max_distance, find_any, overlap_leaf);
 
   // node stack
   auto node_stack        = array<int, 64>{};
@@ -1077,7 +3963,7 @@ static bool overlap_bvh(const bvh_shape* shape, const vec3f& pos,
   // walking stack
   while (node_cur != 0) {
     // grab node
-    auto& node = shape->bvh.nodes[node_stack[--node_cur]];
+    auto& node = bvh.nodes[node_stack[--node_cur]];
 
     // intersect bbox
     if (!overlap_bbox(pos, max_distance, node.bbox)) continue;
@@ -1088,200 +3974,439 @@ static bool overlap_bvh(const bvh_shape* shape, const vec3f& pos,
       // internal node
       node_stack[node_cur++] = node.start + 0;
       node_stack[node_cur++] = node.start + 1;
-    } else if (!shape->points.empty()) {
-      for (auto idx = 0; idx < node.num; idx++) {
-        auto  primitive = shape->bvh.primitives[node.start + idx];
-        auto& p         = shape->points[primitive];
-        if (overlap_point(pos, max_distance, shape->positions[p],
-                shape->radius[p], uv, distance)) {
+    } else {
+      if (overlap_leaf(node.start, node.num, max_distance)) hit = true;
+    }
+
+    // check for early exit
+    if (find_any && hit) return hit;
+  }
+
+  return hit;
+}
+
+// Overlap the elements of a shape leaf with a point, calling
+// `overlap_element(element, uv, distance)` for each element within the max
+// distance, that may shorten it.
+template <typename Func>
+static void overlap_elements(const bvh_shape* shape, const vec3f& pos,
+    int start, int num, float& max_distance, Func&& overlap_element) {
+  auto uv       = zero2f;
+  auto distance = 0.0f;
+  if (!shape->points.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto  primitive = shape->bvh.primitives[idx];
+      auto& p         = shape->points[primitive];
+      if (overlap_point(pos, max_distance, shape->positions[p],
+              shape->radius[p], uv, distance))
+        overlap_element(primitive, uv, distance);
+    }
+  } else if (!shape->lines.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto  primitive = shape->bvh.primitives[idx];
+      auto& l         = shape->lines[primitive];
+      if (overlap_line(pos, max_distance, shape->positions[l.x],
+              shape->positions[l.y], shape->radius[l.x], shape->radius[l.y],
+              uv, distance))
+        overlap_element(primitive, uv, distance);
+    }
+  } else if (!shape->triangles.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto  primitive = shape->bvh.primitives[idx];
+      auto& t         = shape->triangles[primitive];
+      if (overlap_triangle(pos, max_distance, shape->positions[t.x],
+              shape->positions[t.y], shape->positions[t.z], shape->radius[t.x],
+              shape->radius[t.y], shape->radius[t.z], uv, distance))
+        overlap_element(primitive, uv, distance);
+    }
+  } else if (!shape->quads.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto  primitive = shape->bvh.primitives[idx];
+      auto& q         = shape->quads[primitive];
+      if (overlap_quad(pos, max_distance, shape->positions[q.x],
+              shape->positions[q.y], shape->positions[q.z],
+              shape->positions[q.w], shape->radius[q.x], shape->radius[q.y],
+              shape->radius[q.z], shape->radius[q.w], uv, distance))
+        overlap_element(primitive, uv, distance);
+    }
+  }
+}
+
+// Find the closest or any overlap with a shape.
+static bool overlap_bvh(const bvh_shape* shape, const vec3f& pos,
+    float max_distance, int& element, vec2f& uv, float& distance,
+    bool find_any) {
+  // overlap the elements of a leaf, shortening the max distance
+  auto overlap_leaf = [&](int start, int num, float& max_distance) {
+    auto hit = false;
+    overlap_elements(shape, pos, start, num, max_distance,
+        [&](int element_, const vec2f& uv_, float distance_) {
           hit          = true;
-          element      = primitive;
-          max_distance = distance;
-        }
+          element      = element_;
+          uv           = uv_;
+          distance     = distance_;
+          max_distance = distance_;
+        });
+    return hit;
+  };
+
+  return overlap_nodes(shape->bvh, pos, max_distance, find_any, overlap_leaf);
+}
+
+// Find the closest or any overlap with an instance group, returning the group
+// frame overlapped.
+static bool overlap_bvh(const bvh_scene* scene, const bvh_group* group,
+    const vec3f& pos, float max_distance, int& subinstance, int& element,
+    vec2f& uv, float& distance, bool find_any, bool non_rigid_frames) {
+  // overlap the shape at the frames of a leaf, shortening the max distance
+  auto shape        = scene->shapes[group->shape];
+  auto overlap_leaf = [&](int start, int num, float& max_distance) {
+    auto hit = false;
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& frame   = group->frames[group->bvh.primitives[idx]];
+      auto  inv_pos = transform_point(inverse(frame, non_rigid_frames), pos);
+      if (overlap_bvh(
+              shape, inv_pos, max_distance, element, uv, distance, find_any)) {
+        hit          = true;
+        subinstance  = group->bvh.primitives[idx];
+        max_distance = distance;
       }
-    } else if (!shape->lines.empty()) {
-      for (auto idx = 0; idx < node.num; idx++) {
-        auto  primitive = shape->bvh.primitives[node.start + idx];
-        auto& l         = shape->lines[primitive];
-        if (overlap_line(pos, max_distance, shape->positions[l.x],
-                shape->positions[l.y], shape->radius[l.x], shape->radius[l.y],
-                uv, distance)) {
+    }
+    return hit;
+  };
+
+  return overlap_nodes(group->bvh, pos, max_distance, find_any, overlap_leaf);
+}
+
+// Intersect ray with a bvh.
+static bool overlap_bvh(const bvh_scene* scene, const vec3f& pos,
+    float max_distance, int& instance, int& subinstance, int& element,
+    vec2f& uv, float& distance, bool find_any, bool non_rigid_frames) {
+  // overlap the instances of a leaf, shortening the max distance
+  auto overlap_leaf = [&](int start, int num, float& max_distance) {
+    auto hit = false;
+    for (auto idx = start; idx < start + num; idx++) {
+      auto primitive     = scene->bvh.primitives[idx];
+      auto instance_data = scene->instance_cb(primitive);
+      auto inv_pos       = transform_point(
+          inverse(instance_data.frame, non_rigid_frames), pos);
+      if (instance_data.group >= 0) {
+        if (overlap_bvh(scene, scene->groups[instance_data.group], inv_pos,
+                max_distance, subinstance, element, uv, distance, find_any,
+                non_rigid_frames)) {
           hit          = true;
-          element      = primitive;
+          instance     = primitive;
           max_distance = distance;
         }
-      }
-    } else if (!shape->triangles.empty()) {
-      for (auto idx = 0; idx < node.num; idx++) {
-        auto  primitive = shape->bvh.primitives[node.start + idx];
-        auto& t         = shape->triangles[primitive];
-        if (overlap_triangle(pos, max_distance, shape->positions[t.x],
-                shape->positions[t.y], shape->positions[t.z],
-                shape->radius[t.x], shape->radius[t.y], shape->radius[t.z], uv,
-                distance)) {
+      } else {
+        if (overlap_bvh(scene->shapes[instance_data.shape], inv_pos,
+                max_distance, element, uv, distance, find_any)) {
           hit          = true;
-          element      = primitive;
+          instance     = primitive;
+          subinstance  = -1;
           max_distance = distance;
         }
       }
-    } else if (!shape->quads.empty()) {
-      for (auto idx = 0; idx < node.num; idx++) {
-        auto  primitive = shape->bvh.primitives[node.start + idx];
-        auto& q         = shape->quads[primitive];
-        if (overlap_quad(pos, max_distance, shape->positions[q.x],
-                shape->positions[q.y], shape->positions[q.z],
-                shape->positions[q.w], shape->radius[q.x], shape->radius[q.y],
-                shape->radius[q.z], shape->radius[q.w], uv, distance)) {
-          hit          = true;
-          element      = primitive;
-          max_distance = distance;
-        }
+    }
+    return hit;
+  };
+
+  return overlap_nodes(scene->bvh, pos, max_distance, find_any, overlap_leaf);
+}
+
+// Find the closest overlaps within a max distance, keeping up to `max_overlaps`
+// of them in `overlaps` as a max heap on distance, so that the farthest one
+// is replaced first. Once the heap is full, the max distance shrinks to the
+// farthest overlap. Returns the number of overlaps, sorted by distance.
+static int overlap_bvh_closest(const bvh_scene* scene, const vec3f& pos,
+    float max_distance, int max_overlaps, bvh_intersection* overlaps,
+    bool non_rigid_frames) {
+  // keep the closest overlaps, skipping the elements found more than once in
+  // bvhs with spatial splits
+  auto count   = 0;
+  auto unique  = scene->params.bvh != bvh_build_type::spatial;
+  auto farther = [](const bvh_intersection& a, const bvh_intersection& b) {
+    return a.distance < b.distance;
+  };
+  auto add_overlap = [&](int instance, int subinstance, int element,
+                         const vec2f& uv, float distance) {
+    if (!unique) {
+      for (auto idx = 0; idx < count; idx++) {
+        auto& overlap = overlaps[idx];
+        if (overlap.instance == instance && overlap.element == element &&
+            overlap.subinstance == subinstance)
+          return;
       }
     }
+    if (count == max_overlaps) {
+      std::pop_heap(overlaps, overlaps + count--, farther);
+    }
+    overlaps[count++] = {instance, subinstance, element, uv, distance, true};
+    std::push_heap(overlaps, overlaps + count, farther);
+    if (count == max_overlaps) max_distance = overlaps[0].distance;
+  };
 
-    // check for early exit
-    if (find_any && hit) return hit;
-  }
+  // overlap a shape, with leaves updating the max distance of their traversal
+  auto overlap_shape = [&](const bvh_shape* shape, const vec3f& pos,
+                           int instance, int subinstance) {
+    overlap_nodes(shape->bvh, pos, max_distance, false,
+        [&](int start, int num, float& max_distance_) {
+          overlap_elements(shape, pos, start, num, max_distance,
+              [&](int element, const vec2f& uv, float distance) {
+                add_overlap(instance, subinstance, element, uv, distance);
+              });
+          max_distance_ = max_distance;
+          return false;
+        });
+  };
 
-  return hit;
+  // overlap instances and groups
+  overlap_nodes(scene->bvh, pos, max_distance, false,
+      [&](int start, int num, float& max_distance_) {
+        for (auto idx = start; idx < start + num; idx++) {
+          auto primitive     = scene->bvh.primitives[idx];
+          auto instance_data = scene->instance_cb(primitive);
+          auto inv_pos       = transform_point(
+              inverse(instance_data.frame, non_rigid_frames), pos);
+          if (instance_data.group < 0) {
+            overlap_shape(
+                scene->shapes[instance_data.shape], inv_pos, primitive, -1);
+            continue;
+          }
+          auto group = scene->groups[instance_data.group];
+          overlap_nodes(group->bvh, inv_pos, max_distance, false,
+              [&](int start, int num, float& max_distance_) {
+                for (auto idx = start; idx < start + num; idx++) {
+                  auto subinstance = group->bvh.primitives[idx];
+                  overlap_shape(scene->shapes[group->shape],
+                      transform_point(inverse(group->frames[subinstance],
+                                          non_rigid_frames),
+                          inv_pos),
+                      primitive, subinstance);
+                }
+                max_distance_ = max_distance;
+                return false;
+              });
+        }
+        max_distance_ = max_distance;
+        return false;
+      });
+
+  // sort by distance
+  std::sort_heap(overlaps, overlaps + count, farther);
+  return count;
 }
 
-// Intersect ray with a bvh.
-static bool overlap_bvh(const bvh_scene* scene, const vec3f& pos,
-    float max_distance, int& instance, int& element, vec2f& uv, float& distance,
-    bool find_any, bool non_rigid_frames) {
-  // check if empty
-  if (scene->bvh.nodes.empty()) return false;
+// Find the pairs of elements of two shapes whose bounds overlap, descending
+// the larger node of each pair of nodes. Bvhs built with spatial splits
+// reference elements more than once, so pairs are made unique at the end.
+static vector<vec2i> overlap_elems(const bvh_shape* shape1,
+    const bvh_shape* shape2, const bvh_elements_callback& overlap_elements) {
+  // check bvhs
+  if (is_empty(shape1->bvh) || is_empty(shape2->bvh)) return {};
+  if (shape1->bvh.nodes.empty() || shape2->bvh.nodes.empty())
+    throw std::runtime_error("bvh overlap needs binary nodes");
+
+  // element bounds
+  auto  self     = shape1 == shape2;
+  auto  bboxes1  = compute_bboxes(shape1, true);
+  auto  bboxes2  = self ? vector<bbox3f>{} : compute_bboxes(shape2, true);
+  auto& ebboxes2 = self ? bboxes1 : bboxes2;
 
   // node stack
-  auto node_stack        = array<int, 64>{};
-  auto node_cur          = 0;
-  node_stack[node_cur++] = 0;
+  auto node_stack = vector<vec2i>{{0, 0}};
 
-  // hit
-  auto hit = false;
+  // overlaps
+  auto overlaps = vector<vec2i>{};
 
   // walking stack
-  while (node_cur != 0) {
-    // grab node
-    auto& node = scene->bvh.nodes[node_stack[--node_cur]];
+  while (!node_stack.empty()) {
+    // grab nodes
+    auto [node1_id, node2_id] = node_stack.back();
+    node_stack.pop_back();
+    auto& node1 = shape1->bvh.nodes[node1_id];
+    auto& node2 = shape2->bvh.nodes[node2_id];
 
     // intersect bbox
-    if (!overlap_bbox(pos, max_distance, node.bbox)) continue;
-
-    // intersect node, switching based on node type
-    // for each type, iterate over the the primitive list
-    if (node.internal) {
-      // internal node
-      node_stack[node_cur++] = node.start + 0;
-      node_stack[node_cur++] = node.start + 1;
+    if (!overlap_bbox(node1.bbox, node2.bbox)) continue;
+
+    // descend the larger internal node or collide elements
+    if (node1.internal &&
+        (!node2.internal || bbox_area(node1.bbox) >= bbox_area(node2.bbox))) {
+      // the two children of a node need to be tested only once for self
+      // overlaps, since the pair is symmetric
+      if (self && node1_id == node2_id) {
+        node_stack.push_back({node1.start + 0, node1.start + 0});
+        node_stack.push_back({node1.start + 0, node1.start + 1});
+        node_stack.push_back({node1.start + 1, node1.start + 1});
+      } else {
+        node_stack.push_back({node1.start + 0, node2_id});
+        node_stack.push_back({node1.start + 1, node2_id});
+      }
+    } else if (node2.internal) {
+      node_stack.push_back({node1_id, node2.start + 0});
+      node_stack.push_back({node1_id, node2.start + 1});
     } else {
-      for (auto idx = 0; idx < node.num; idx++) {
-        auto primitive         = scene->bvh.primitives[node.start + idx];
-        auto [frame, shape_id] = scene->instance_cb(primitive);
-        auto shape             = scene->shapes[shape_id];
-        auto inv_pos = transform_point(inverse(frame, non_rigid_frames), pos);
-        if (overlap_bvh(shape, inv_pos, max_distance, element, uv, distance,
-                find_any)) {
-          hit          = true;
-          instance     = primitive;
-          max_distance = distance;
+      for (auto idx1 = node1.start; idx1 < node1.start + node1.num; idx1++) {
+        for (auto idx2 = node2.start; idx2 < node2.start + node2.num; idx2++) {
+          auto element1 = shape1->bvh.primitives[idx1];
+          auto element2 = shape2->bvh.primitives[idx2];
+          if (self && element1 >= element2) {
+            if (element1 == element2) continue;
+            std::swap(element1, element2);
+          }
+          if (!overlap_bbox(bboxes1[element1], ebboxes2[element2])) continue;
+          if (overlap_elements && !overlap_elements(element1, element2))
+            continue;
+          overlaps.push_back({element1, element2});
         }
       }
     }
-
-    // check for early exit
-    if (find_any && hit) return hit;
   }
 
-  return hit;
-}
-
-#if 0
-// Finds the overlap between BVH leaf nodes.
-template <typename OverlapElem>
-void overlap_bvh_elems(const bvh_data& bvh1, const bvh_data& bvh2,
-                bool skip_duplicates, bool skip_self, vector<vec2i>& overlaps,
-                const OverlapElem& overlap_elems) {
-    // node stack
-    vec2i node_stack[128];
-    auto node_cur = 0;
-    node_stack[node_cur++] = {0, 0};
-
-    // walking stack
-    while (node_cur) {
-        // grab node
-        auto node_idx = node_stack[--node_cur];
-        const auto node1 = bvh1->nodes[node_idx.x];
-        const auto node2 = bvh2->nodes[node_idx.y];
-
-        // intersect bbox
-        if (!overlap_bbox(node1.bbox, node2.bbox)) continue;
-
-        // check for leaves
-        if (node1.isleaf && node2.isleaf) {
-            // collide primitives
-            for (auto i1 = node1.start; i1 < node1.start + node1.count; i1++) {
-                for (auto i2 = node2.start; i2 < node2.start + node2.count;
-                      i2++) {
-                    auto idx1 = bvh1->sorted_prim[i1];
-                    auto idx2 = bvh2->sorted_prim[i2];
-                    if (skip_duplicates && idx1 > idx2) continue;
-                    if (skip_self && idx1 == idx2) continue;
-                    if (overlap_elems(idx1, idx2))
-                        overlaps.push_back({idx1, idx2});
-                }
-            }
-        } else {
-            // descend
-            if (node1.isleaf) {
-                for (auto idx2 = node2.start; idx2 < node2.start + node2.count;
-                      idx2++) {
-                    node_stack[node_cur++] = {node_idx.x, (int)idx2};
-                }
-            } else if (node2.isleaf) {
-                for (auto idx1 = node1.start; idx1 < node1.start + node1.count;
-                      idx1++) {
-                    node_stack[node_cur++] = {(int)idx1, node_idx.y};
-                }
-            } else {
-                for (auto idx2 = node2.start; idx2 < node2.start + node2.count;
-                      idx2++) {
-                    for (auto idx1 = node1.start;
-                          idx1 < node1.start + node1.count; idx1++) {
-                        node_stack[node_cur++] = {(int)idx1, (int)idx2};
-                    }
-                }
-            }
-        }
-    }
+  // remove duplicates
+  std::sort(overlaps.begin(), overlaps.end(), [](auto& a, auto& b) {
+    return a.x < b.x || (a.x == b.x && a.y < b.y);
+  });
+  overlaps.erase(std::unique(overlaps.begin(), overlaps.end()), overlaps.end());
+  return overlaps;
 }
-#endif
 
 bvh_intersection intersect_bvh(const bvh_scene* scene, const ray3f& ray,
     bool find_any, bool non_rigid_frames) {
+  count_bvh(1, 0, 0);
   auto intersection = bvh_intersection{};
   intersection.hit  = intersect_bvh(scene, ray, intersection.instance,
-      intersection.element, intersection.uv, intersection.distance, find_any,
-      non_rigid_frames);
+      intersection.subinstance, intersection.element, intersection.uv,
+      intersection.distance, find_any, non_rigid_frames);
   return intersection;
 }
 bvh_intersection intersect_bvh(const bvh_scene* scene, int instance,
     const ray3f& ray, bool find_any, bool non_rigid_frames) {
+  count_bvh(1, 0, 0);
   auto intersection = bvh_intersection{};
-  intersection.hit  = intersect_bvh(scene, instance, ray, intersection.element,
-      intersection.uv, intersection.distance, find_any, non_rigid_frames);
+  intersection.hit  = intersect_bvh(scene, instance, ray,
+      intersection.subinstance, intersection.element, intersection.uv,
+      intersection.distance, find_any, non_rigid_frames);
   intersection.instance = instance;
   return intersection;
 }
 
+bool occluded_bvh(
+    const bvh_scene* scene, const ray3f& ray, bool non_rigid_frames) {
+  count_bvh(1, 0, 0);
+#ifdef YOCTO_EMBREE
+  // call Embree if needed
+  if (scene->embree_bvh) {
+    auto intersection = bvh_intersection{};
+    return intersect_embree_bvh(scene, ray, intersection.instance,
+        intersection.element, intersection.uv, intersection.distance, true);
+  }
+#endif
+
+  return occluded_nodes(scene->bvh, ray, [&](int start, int num) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto instance_data = scene->instance_cb(scene->bvh.primitives[idx]);
+      if (occluded_instance(scene, instance_data, ray, non_rigid_frames))
+        return true;
+    }
+    return false;
+  });
+}
+bool occluded_bvh(const bvh_scene* scene, int instance, const ray3f& ray,
+    bool non_rigid_frames) {
+  count_bvh(1, 0, 0);
+  return occluded_instance(
+      scene, scene->instance_cb(instance), ray, non_rigid_frames);
+}
+
+array<bvh_intersection, 4> intersect_bvh_packet(const bvh_scene* scene,
+    const array<ray3f, 4>& rays, bool find_any, bool non_rigid_frames) {
+  return intersect_packet<4>(scene, rays, find_any, non_rigid_frames);
+}
+array<bvh_intersection, 8> intersect_bvh_packet(const bvh_scene* scene,
+    const array<ray3f, 8>& rays, bool find_any, bool non_rigid_frames) {
+  return intersect_packet<8>(scene, rays, find_any, non_rigid_frames);
+}
+array<bvh_intersection, 16> intersect_bvh_packet(const bvh_scene* scene,
+    const array<ray3f, 16>& rays, bool find_any, bool non_rigid_frames) {
+  return intersect_packet<16>(scene, rays, find_any, non_rigid_frames);
+}
+
+vector<bvh_intersection> intersect_bvh_stream(const bvh_scene* scene,
+    const vector<ray3f>& rays, bool find_any, bool non_rigid_frames) {
+  // intersect single rays for moving instances, since streams are traversed
+  // with static node bounds, and for groups
+  if (!scene->bvh.motion_bboxes.empty() || !scene->groups.empty()) {
+    auto intersections = vector<bvh_intersection>(rays.size());
+    for (auto idx = 0; idx < (int)rays.size(); idx++)
+      intersections[idx] = intersect_bvh(
+          scene, rays[idx], find_any, non_rigid_frames);
+    return intersections;
+  }
+
+  count_bvh(rays.size(), 0, 0);
+  auto stream = bvh_stream{};
+  init_stream(stream, rays.size());
+  for (auto idx = 0; idx < (int)rays.size(); idx++)
+    set_ray(stream, idx, rays[idx]);
+  auto intersections = vector<bvh_intersection>(rays.size());
+  intersect_stream(scene, stream, find_any, non_rigid_frames, intersections);
+  return intersections;
+}
+
+bvh_intersection overlap_shape_bvh(const bvh_shape* shape, const vec3f& pos,
+    float max_distance, bool find_any) {
+  auto intersection = bvh_intersection{};
+  intersection.hit  = overlap_bvh(shape, pos, max_distance,
+      intersection.element, intersection.uv, intersection.distance, find_any);
+  return intersection;
+}
 bvh_intersection overlap_bvh(const bvh_scene* scene, const vec3f& pos,
     float max_distance, bool find_any, bool non_rigid_frames) {
   auto intersection = bvh_intersection{};
   intersection.hit  = overlap_bvh(scene, pos, max_distance,
-      intersection.instance, intersection.element, intersection.uv,
-      intersection.distance, find_any, non_rigid_frames);
+      intersection.instance, intersection.subinstance, intersection.element,
+      intersection.uv, intersection.distance, find_any, non_rigid_frames);
   return intersection;
 }
 
+void overlap_bvh_batch(const bvh_scene* scene, const vector<vec3f>& positions,
+    float max_distance, int max_overlaps, vector<bvh_intersection>& overlaps,
+    vector<int>& counts, bool non_rigid_frames, bool noparallel) {
+  // prepare outputs, reusing their memory
+  auto num = positions.size();
+  if (overlaps.size() != num * max_overlaps)
+    overlaps.resize(num * max_overlaps);
+  if (counts.size() != num) counts.resize(num);
+  if (num == 0 || max_overlaps <= 0) {
+    std::fill(counts.begin(), counts.end(), 0);
+    return;
+  }
+
+  // sort points by Morton code, so that consecutive queries visit the same
+  // nodes
+  auto order = vector<int>(num);
+  for (auto idx = 0; idx < (int)num; idx++) order[idx] = idx;
+  sort_morton(order, positions, noparallel);
+
+  // overlap points
+  bvh_for_range(num, noparallel, [&](size_t start, size_t end) {
+    for (auto idx = start; idx < end; idx++) {
+      auto point    = (size_t)order[idx];
+      auto results  = overlaps.data() + point * max_overlaps;
+      auto count    = overlap_bvh_closest(scene, positions[point],
+          max_distance, max_overlaps, results, non_rigid_frames);
+      counts[point] = count;
+      std::fill(results + count, results + max_overlaps, bvh_intersection{});
+    }
+  });
+}
+
+vector<vec2i> overlap_bvh_elems(const bvh_scene* scene, int shape1, int shape2,
+    const bvh_elements_callback& overlap_elements) {
+  return overlap_elems(
+      scene->shapes[shape1], scene->shapes[shape2], overlap_elements);
+}
+
 }  // namespace yocto
@@ -41,6 +41,7 @@
 #include <array>
 #include <cstdint>
 #include <functional>
+#include <future>
 #include <string>
 #include <vector>
 
@@ -81,13 +82,59 @@ struct bvh_node {
   bool    internal = false;
 };
 
+// Wide BVH node with up to N children, obtained by collapsing binary nodes.
+// Children bounds are stored as a structure of arrays, so that they can be
+// intersected at once. Children are either internal nodes, with `num` set to
+// zero and `start` referring to the wide node array, or leaves, with `start`
+// and `num` referring to primitives. Unused children have `num` set to -1.
+template <int N>
+struct alignas(32) bvh_wide_node {
+  float   bmin[3][N] = {};
+  float   bmax[3][N] = {};
+  int32_t start[N]   = {};
+  int16_t num[N]     = {};
+};
+using bvh_node4 = bvh_wide_node<4>;
+using bvh_node8 = bvh_wide_node<8>;
+
+// Quantized wide BVH node, used to reduce the bvh memory. Children bounds are
+// stored as integers relative to the node origin, scaled by a power of two per
+// axis. Bounds are rounded outwards, so that the dequantized bounds contain
+// the original ones. Children are stored as in `bvh_wide_node`.
+template <int N, typename T>
+struct bvh_quantized_node {
+  float   origin[3]   = {};
+  int8_t  exponent[3] = {};
+  T       qmin[3][N]  = {};
+  T       qmax[3][N]  = {};
+  int32_t start[N]    = {};
+  int16_t num[N]      = {};
+};
+using bvh_node4q8  = bvh_quantized_node<4, uint8_t>;
+using bvh_node8q8  = bvh_quantized_node<8, uint8_t>;
+using bvh_node4q16 = bvh_quantized_node<4, uint16_t>;
+using bvh_node8q16 = bvh_quantized_node<8, uint16_t>;
+
 // BVH tree stored as a node array with the tree structure is encoded using
 // array indices. BVH nodes indices refer to either the node array,
 // for internal nodes, or the primitive arrays, for leaf nodes.
-// Application data is not stored explicitly.
+// Application data is not stored explicitly. Optionally, the binary nodes
+// are collapsed in 4-wide or 8-wide nodes that are used for intersection.
+// Quantized bvhs store only quantized wide nodes, that are at least 4-wide.
+// Trees too deep for the fixed-size wide traversal stacks keep binary nodes.
+// Bvhs of moving instances store the node bounds at the start and end of the
+// shutter interval, in the binary nodes and in `motion_bboxes`, and are
+// intersected with bounds interpolated at the ray time.
 struct bvh_tree {
-  vector<bvh_node> nodes      = {};
-  vector<int>      primitives = {};
+  vector<bvh_node>     nodes         = {};
+  vector<int>          primitives    = {};
+  vector<bvh_node4>    nodes4        = {};
+  vector<bvh_node8>    nodes8        = {};
+  vector<bvh_node4q8>  nodes4q8      = {};
+  vector<bvh_node8q8>  nodes8q8      = {};
+  vector<bvh_node4q16> nodes4q16     = {};
+  vector<bvh_node8q16> nodes8q16     = {};
+  vector<bbox3f>       motion_bboxes = {};
 };
 
 // BVH span to give a view over an array
@@ -108,6 +155,15 @@ struct bvh_span {
   size_t    _size = 0;
 };
 
+// Triangle stored by its vertices. Used to optionally precompute the triangles
+// of the bvh leaves, in primitive order, so that intersection reads them
+// contiguously instead of going through element and vertex indices.
+struct bvh_triangle {
+  vec3f p0 = {0, 0, 0};
+  vec3f p1 = {0, 0, 0};
+  vec3f p2 = {0, 0, 0};
+};
+
 // BVH data for whole shapes. This interface makes copies of all the data.
 struct bvh_shape {
   // elements
@@ -135,31 +191,107 @@ struct bvh_shape {
 #ifdef YOCTO_EMBREE
   RTCScene embree_bvh = nullptr;
 #endif
+
+  // precomputed leaf triangles
+  vector<bvh_triangle> leaf_triangles = {};
   ~bvh_shape();
 };
 
-// instance
+// BVH data for instance groups, that place a shape at many frames. Groups
+// have their own bvh and are instanced as a whole, so that large instanced
+// sets, like the trees of a forest, are stored once and are not flattened
+// in the scene bvh. This interface makes copies of the frames.
+struct bvh_group {
+  // shape and frames
+  int               shape  = -1;
+  bvh_span<frame3f> frames = {};
+
+  // owned frames
+  vector<frame3f> frames_data = {};
+
+  // nodes
+  bvh_tree bvh = {};
+};
+
+// instance, with its frames at the start and end of the shutter interval
+// for moving instances, that are interpolated linearly at the ray time.
+// Instances reference either a shape or, if `group` is set, a group, whose
+// frames are applied before the instance frame, so that the same group may be
+// shared by many instances.
 struct bvh_instance {
-  frame3f frame = identity3x4f;
-  int     shape = -1;
+  frame3f frame        = identity3x4f;
+  int     shape        = -1;
+  bool    moving       = false;
+  frame3f motion_frame = identity3x4f;
+  int     group        = -1;
 };
 
-// Callback to get instance properties
+// Callback to get instance properties. It may be called concurrently.
 using bvh_instance_callback = function<bvh_instance(int)>;
 
+// Strategy used to build the bvh. Linear bvhs sort primitives along a Morton
+// curve and split them by Morton code, while hierarchical linear bvhs use SAH
+// splits for the top levels of the tree. Spatial bvhs also split primitives
+// across nodes, referencing them more than once, to reduce node overlap.
+// Spatial bvhs are always built serially.
+enum struct bvh_build_type {
+  default_,
+  highquality,
+  middle,
+  balanced,
+  lbvh,
+  hlbvh,
+  spatial,
+#ifdef YOCTO_EMBREE
+  embree_default,
+  embree_highquality,
+  embree_compact  // only for copy interface
+#endif
+};
+
+const auto bvh_build_names = vector<string>{
+    "default", "highquality", "middle", "balanced", "lbvh", "hlbvh", "spatial",
+#ifdef YOCTO_EMBREE
+    "embree-default", "embree-highquality", "embree-compact"
+#endif
+};
+
+// Bvh parameters
+struct bvh_params {
+  bvh_build_type bvh        = bvh_build_type::default_;
+  bool           noparallel = false;  // serial build
+  int            width      = 2;      // node width: 2, 4 or 8
+  int            quantize   = 0;      // quantization bits: 0, 8 or 16
+  bool           precompute = false;  // precompute leaf triangles
+  string         cache      = "";     // shape bvh cache directory
+  float          budget     = 0.5f;   // spatial split extra references
+  float          rebuild    = 1.5f;   // cost ratio to rebuild after updates
+};
+
 // BVH data for whole shapes. This interface makes copies of all the data.
 struct bvh_scene {
-  // instances and shapes
+  // instances, shapes and groups
   int                   num_instances  = 0;
   bvh_instance_callback instance_cb    = {};
   vector<bvh_instance>  instances_data = {};
   vector<bvh_shape*>    shapes         = {};
+  vector<bvh_group*>    groups         = {};
 
   // nodes
   bvh_tree bvh = {};
 #ifdef YOCTO_EMBREE
   RTCScene embree_bvh = nullptr;
 #endif
+
+  // incremental updates, with instance bounds, node parents, instance leaves,
+  // current and build sah cost, and the background rebuild
+  bvh_params            params     = {};
+  vector<bbox3f>        bboxes     = {};
+  vector<int>           parents    = {};
+  vector<int>           leaves     = {};
+  double                cost       = 0;
+  double                build_cost = 0;
+  std::future<bvh_tree> rebuild    = {};
   ~bvh_scene();
 };
 
@@ -177,66 +309,141 @@ void set_shape(bvh_scene* bvh, int shape_id, const vector<int>& points,
 void set_instances(bvh_scene* bvh, int num_instances,
     bvh_instance_callback instance_cb, bool as_view = false);
 
-// Strategy used to build the bvh
-enum struct bvh_build_type {
-  default_,
-  highquality,
-  middle,
-  balanced,
-#ifdef YOCTO_EMBREE
-  embree_default,
-  embree_highquality,
-  embree_compact  // only for copy interface
-#endif
-};
-
-const auto bvh_build_names = vector<string>{
-    "default", "highquality", "middle", "balanced",
-#ifdef YOCTO_EMBREE
-    "embree-default", "embree-highquality", "embree-compact"
-#endif
-};
-
-// Bvh parameters
-struct bvh_params {
-  bvh_build_type bvh        = bvh_build_type::default_;
-  bool           noparallel = false;  // only serial momentarily
-};
+// Add instance groups, placing a shape at the given frames
+int add_group(bvh_scene* bvh, int shape, const vector<frame3f>& frames,
+    bool as_view = false);
 
 // Progress report callback
 using progress_callback =
     function<void(const string& message, int current, int total)>;
 
-// Build the bvh acceleration structure.
+// Cancellation token from Yocto/Parallel
+struct cancel_token;
+
+// Build the bvh acceleration structure. If the optional token is canceled,
+// the build stops early leaving empty bvhs. If a cache directory is set,
+// shape bvhs are loaded from files named by a hash of the shape geometry and
+// build parameters, and are built and saved there if missing or invalid.
+// Instance bvhs with moving instances keep only binary nodes. Group bvhs are
+// built after the shapes and before the scene bvh.
 void init_bvh(bvh_scene* bvh, const bvh_params& params,
-    const progress_callback& progress_cb = {});
+    const progress_callback& progress_cb = {}, cancel_token* cancel = nullptr);
 
-// Refit bvh data
+// Refit bvh data. Groups of the updated shapes are refitted with them. If
+// only instances are updated, binary instance bvhs are
+// refitted incrementally, rotating the refitted nodes to keep the tree quality,
+// and are rebuilt in the background when their sah cost exceeds the build cost
+// times the `rebuild` parameter.
 void update_bvh(bvh_scene* bvh, const vector<int>& updated_instances,
     const vector<int>&       updated_shapes,
     const progress_callback& progress_cb = {});
 
+// Compute the SAH cost of a bvh tree, with unit costs for node traversal and
+// primitive intersection, and areas relative to the root bounds. Only binary
+// nodes are considered, so the cost of quantized bvhs is zero.
+float compute_sah_cost(const bvh_tree& bvh);
+
+// Memory used by a bvh tree, in bytes, and memory used by the same tree
+// without quantization.
+struct bvh_memory {
+  size_t bytes        = 0;
+  size_t uncompressed = 0;
+};
+
+// Compute the memory used by a bvh tree.
+bvh_memory compute_memory(const bvh_tree& bvh);
+
+// Statistics of a bvh tree, with histograms of the number of leaves at each
+// depth and with each number of primitives. The overlap is the average ratio
+// of the area shared by the children of a node to the area of the node. Only
+// binary nodes are considered, so quantized bvhs report only their memory.
+struct bvh_stats {
+  float       sah_cost   = 0;
+  int         nodes      = 0;
+  int         leaves     = 0;
+  vector<int> depths     = {};
+  vector<int> leaf_sizes = {};
+  float       overlap    = 0;
+  bvh_memory  memory     = {};
+};
+
+// Compute the statistics of a bvh tree.
+bvh_stats compute_stats(const bvh_tree& bvh);
+
+// Traversal counters of rays intersected, nodes visited and elements tested.
+// Counters are kept per thread and are updated only if the library is
+// compiled with YOCTO_BVH_STATS, since counting slows down traversal. Packets
+// and streams count a node once for all their rays.
+struct bvh_counters {
+  uint64_t rays     = 0;
+  uint64_t nodes    = 0;
+  uint64_t elements = 0;
+};
+
+// Get the counters of the calling thread or of all threads that traversed a
+// bvh. Counters should be reset only when no bvh is being traversed.
+bvh_counters         get_bvh_counters();
+vector<bvh_counters> get_bvh_thread_counters();
+void                 reset_bvh_counters();
+
 // Results of intersect_xxx and overlap_xxx functions that include hit flag,
 // instance id, shape element id, shape element uv and intersection distance.
 // The values are all set for scene intersection. Shape intersection does not
 // set the instance id and element intersections do not set shape element id
 // and the instance id. Results values are set only if hit is true.
+// For instances of groups, the subinstance is the index of the group frame.
 struct bvh_intersection {
-  int   instance = -1;
-  int   element  = -1;
-  vec2f uv       = {0, 0};
-  float distance = 0;
-  bool  hit      = false;
+  int   instance    = -1;
+  int   subinstance = -1;
+  int   element     = -1;
+  vec2f uv          = {0, 0};
+  float distance    = 0;
+  bool  hit         = false;
 };
 
 // Intersect ray with a bvh returning either the first or any intersection
 // depending on `find_any`. Returns the ray distance , the instance id,
 // the shape element index and the element barycentric coordinates.
+// Moving instances are intersected at the ray time, in [0, 1] over the
+// shutter interval.
 bvh_intersection intersect_bvh(const bvh_scene* bvh, const ray3f& ray,
     bool find_any = false, bool non_rigid_frames = true);
 bvh_intersection intersect_bvh(const bvh_scene* bvh, int instance,
     const ray3f& ray, bool find_any = false, bool non_rigid_frames = true);
 
+// Check whether a ray hits a bvh, for shadow and visibility rays. This is
+// faster than intersect_bvh with `find_any`, since it skips the intersection
+// data and stops at the first element hit.
+bool occluded_bvh(const bvh_scene* bvh, const ray3f& ray,
+    bool non_rigid_frames = true);
+bool occluded_bvh(const bvh_scene* bvh, int instance, const ray3f& ray,
+    bool non_rigid_frames = true);
+
+// Intersect a packet of 4, 8 or 16 rays with a bvh, returning either the first
+// or any intersection for each ray. Rays traverse the bvh together, testing
+// node bounds for all rays at once, which is faster for coherent rays such as
+// camera rays. Rays with tmin greater than tmax are skipped, to pad packets.
+// Scenes with groups or moving instances are intersected one ray at a time,
+// as are bvhs without binary nodes, such as quantized ones.
+array<bvh_intersection, 4>  intersect_bvh_packet(const bvh_scene* bvh,
+     const array<ray3f, 4>& rays, bool find_any = false,
+     bool non_rigid_frames = true);
+array<bvh_intersection, 8>  intersect_bvh_packet(const bvh_scene* bvh,
+     const array<ray3f, 8>& rays, bool find_any = false,
+     bool non_rigid_frames = true);
+array<bvh_intersection, 16> intersect_bvh_packet(const bvh_scene* bvh,
+    const array<ray3f, 16>& rays, bool find_any = false,
+    bool non_rigid_frames = true);
+
+// Intersect a stream of rays with a bvh, returning either the first or any
+// intersection for each ray. At each node, only the rays that hit the node
+// are kept, so that coherent rays share the traversal of the tree. Scenes with
+// groups or moving instances are intersected one ray at a time, as are bvhs
+// without binary nodes, such as quantized ones.
+vector<bvh_intersection> intersect_bvh_stream(const bvh_scene* bvh,
+    const vector<ray3f>& rays, bool find_any = false,
+    bool non_rigid_frames = true);
+
 // Find a shape element that overlaps a point within a given distance
 // max distance, returning either the closest or any overlap depending on
 // `find_any`. Returns the point distance, the instance id, the shape element
@@ -246,6 +453,25 @@ bvh_intersection overlap_shape_bvh(const bvh_shape* bvh, const vec3f& pos,
 bvh_intersection overlap_bvh(const bvh_scene* bvh, const vec3f& pos,
     float max_distance, bool find_any = false, bool non_rigid_frames = true);
 
+// Find the `max_overlaps` closest shape elements within a max distance of
+// many points, for k-nearest and radius queries. The results of a point are
+// sorted by distance and stored in `overlaps` at `idx * max_overlaps + i`,
+// for i less than `counts[idx]`. Outputs are resized only if their size
+// differs, so that preallocated buffers are reused. Points are overlapped in
+// parallel in Morton order, so that nearby points are processed together.
+void overlap_bvh_batch(const bvh_scene* bvh, const vector<vec3f>& positions,
+    float max_distance, int max_overlaps, vector<bvh_intersection>& overlaps,
+    vector<int>& counts, bool non_rigid_frames = true, bool noparallel = false);
+
+// Find the pairs of elements of two shapes whose bounds overlap, for
+// collision detection. Candidate pairs are checked with `overlap_elements`,
+// if set. Shapes are in the same space and need binary nodes. For a shape
+// with itself, pairs are reported once and elements are not paired with
+// themselves. Pairs are sorted and unique.
+using bvh_elements_callback = function<bool(int element1, int element2)>;
+vector<vec2i> overlap_bvh_elems(const bvh_scene* bvh, int shape1, int shape2,
+    const bvh_elements_callback& overlap_elements = {});
+
 }  // namespace yocto
 
 #endif
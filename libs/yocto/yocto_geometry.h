@@ -124,12 +124,13 @@ struct ray2f {
   float tmax = flt_max;
 };
 
-// Rays with origin, direction and min/max t value.
+// Rays with origin, direction, min/max t value and time for motion blur.
 struct ray3f {
   vec3f o    = {0, 0, 0};
   vec3f d    = {0, 0, 1};
   float tmin = ray_eps;
   float tmax = flt_max;
+  float time = 0;
 };
 
 // Computes a point on a ray
@@ -398,10 +399,12 @@ namespace yocto {
 
 // Transforms rays and bounding boxes by matrices.
 inline ray3f transform_ray(const mat4f& a, const ray3f& b) {
-  return {transform_point(a, b.o), transform_vector(a, b.d), b.tmin, b.tmax};
+  return {transform_point(a, b.o), transform_vector(a, b.d), b.tmin, b.tmax,
+      b.time};
 }
 inline ray3f transform_ray(const frame3f& a, const ray3f& b) {
-  return {transform_point(a, b.o), transform_vector(a, b.d), b.tmin, b.tmax};
+  return {transform_point(a, b.o), transform_vector(a, b.d), b.tmin, b.tmax,
+      b.time};
 }
 inline bbox3f transform_bbox(const mat4f& a, const bbox3f& b) {
   auto corners = {vec3f{b.min.x, b.min.y, b.min.z},
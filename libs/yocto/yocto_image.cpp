@@ -720,14 +720,16 @@ image<vec4b> tonemap_imageb(
 
 void tonemap_image_mt(image<vec4f>& ldr, const image<vec4f>& hdr,
     float exposure, bool filmic, bool srgb) {
-  parallel_for(hdr.width(), hdr.height(), [&](int i, int j) {
-    ldr[{i, j}] = tonemap(hdr[{i, j}], exposure, filmic, srgb);
+  parallel_for_range(hdr.count(), (size_t)0, [&](size_t start, size_t end) {
+    for (auto i = start; i < end; i++)
+      ldr[i] = tonemap(hdr[i], exposure, filmic, srgb);
   });
 }
 void tonemap_image_mt(image<vec4b>& ldr, const image<vec4f>& hdr,
     float exposure, bool filmic, bool srgb) {
-  parallel_for(hdr.width(), hdr.height(), [&](int i, int j) {
-    ldr[{i, j}] = float_to_byte(tonemap(hdr[{i, j}], exposure, filmic, srgb));
+  parallel_for_range(hdr.count(), (size_t)0, [&](size_t start, size_t end) {
+    for (auto i = start; i < end; i++)
+      ldr[i] = float_to_byte(tonemap(hdr[i], exposure, filmic, srgb));
   });
 }
 
@@ -782,14 +784,16 @@ image<vec4f> colorgrade_image(
 // Apply exposure and filmic tone mapping
 void colorgrade_image_mt(image<vec4f>& corrected, const image<vec4f>& img,
     bool linear, const colorgrade_params& params) {
-  parallel_for(img.width(), img.height(), [&](int i, int j) {
-    corrected[{i, j}] = colorgrade(img[{i, j}], linear, params);
+  parallel_for_range(img.count(), (size_t)0, [&](size_t start, size_t end) {
+    for (auto i = start; i < end; i++)
+      corrected[i] = colorgrade(img[i], linear, params);
   });
 }
 void colorgrade_image_mt(image<vec4b>& corrected, const image<vec4f>& img,
     bool linear, const colorgrade_params& params) {
-  parallel_for(img.width(), img.height(), [&](int i, int j) {
-    corrected[{i, j}] = float_to_byte(colorgrade(img[{i, j}], linear, params));
+  parallel_for_range(img.count(), (size_t)0, [&](size_t start, size_t end) {
+    for (auto i = start; i < end; i++)
+      corrected[i] = float_to_byte(colorgrade(img[i], linear, params));
   });
 }
 
@@ -844,6 +844,9 @@ inline frame3f& operator*=(frame3f& a, const frame3f& b);
 // Frame inverse, equivalent to rigid affine inverse.
 inline frame3f inverse(const frame3f& a, bool non_rigid = false);
 
+// Frame interpolation, component-wise, that is not rigid for rotations.
+inline frame3f lerp(const frame3f& a, const frame3f& b, float u);
+
 // Frame construction from axis.
 inline frame3f frame_fromz(const vec3f& o, const vec3f& v);
 inline frame3f frame_fromzx(const vec3f& o, const vec3f& z_, const vec3f& x_);
@@ -2085,6 +2088,12 @@ inline frame3f inverse(const frame3f& a, bool non_rigid) {
   }
 }
 
+// Frame interpolation, component-wise, that is not rigid for rotations.
+inline frame3f lerp(const frame3f& a, const frame3f& b, float u) {
+  return {lerp(a.x, b.x, u), lerp(a.y, b.y, u), lerp(a.z, b.z, u),
+      lerp(a.o, b.o, u)};
+}
+
 // Frame construction from axis.
 inline frame3f frame_fromz(const vec3f& o, const vec3f& v) {
   // https://graphics.pixar.com/library/OrthonormalB/paper.pdf
@@ -37,11 +37,19 @@
 // INCLUDES
 // -----------------------------------------------------------------------------
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <deque>
+#include <exception>
+#include <functional>
 #include <future>
+#include <memory>
 #include <mutex>
 #include <thread>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
@@ -53,7 +61,9 @@ namespace yocto {
 // using directives
 using std::atomic;
 using std::deque;
+using std::function;
 using std::future;
+using std::unique_ptr;
 using std::vector;
 
 }  // namespace yocto
@@ -80,7 +90,45 @@ struct concurrent_queue {
   deque<T>   queue;
 };
 
-// Run a task asynchronously
+// Statistics of the process-wide thread pool used by all parallel algorithms.
+// Idle time is summed over all worker threads.
+struct parallel_stats {
+  int      num_threads = 0;  // number of threads used by parallel algorithms
+  uint64_t tasks       = 0;  // number of tasks run by the pool
+  uint64_t steals      = 0;  // number of tasks stolen from another queue
+  double   idle_time   = 0;  // seconds spent by workers waiting for tasks
+};
+
+// Set the number of threads used by parallel algorithms, with 0 using the
+// hardware concurrency. This recreates the thread pool, so call it before
+// starting parallel work.
+inline void set_parallel_threads(int num_threads);
+// Get the number of threads used by parallel algorithms.
+inline int get_parallel_threads();
+
+// Get and reset the thread pool statistics.
+inline parallel_stats get_parallel_stats();
+inline void           reset_parallel_stats();
+
+// Token used to cooperatively cancel long-running work and to query its
+// progress. Parallel loops stop handing out work once the token is canceled,
+// and functions that take a token return early, leaving partial results.
+struct cancel_token {
+  atomic<bool> canceled = false;  // set to cancel the work
+  atomic<int>  current  = 0;      // progress of the current step
+  atomic<int>  total    = 0;      // total progress of the current step
+};
+
+// Cancel the work, check for cancellation and reset a token for reuse.
+// Tokens may be null, meaning that the work cannot be canceled.
+inline void cancel_work(cancel_token* cancel);
+inline bool is_canceled(const cancel_token* cancel);
+inline void reset_cancel(cancel_token* cancel);
+// Update the progress stored in a token, if not null.
+inline void set_progress(cancel_token* cancel, int current, int total);
+
+// Run a task asynchronously on a dedicated thread, so that long tasks do not
+// take workers away from parallel loops
 template <typename Func, typename... Args>
 inline auto run_async(Func&& func, Args&&... args);
 
@@ -90,20 +138,89 @@ inline bool is_running(const future<void>& result);
 inline bool is_ready(const future<void>& result);
 
 // Simple parallel for used since our target platforms do not yet support
-// parallel algorithms. `Func` takes the integer index.
+// parallel algorithms. `Func` takes the integer index. All parallel loops
+// stop early if the optional cancel token is canceled.
 template <typename T, typename Func>
-inline void parallel_for(T num, Func&& func);
+inline void parallel_for(
+    T num, Func&& func, const cancel_token* cancel = nullptr);
 // Simple parallel for used since our target platforms do not yet support
-// parallel algorithms. `Func` takes the two integer indices.
+// parallel algorithms. `Func` takes the two integer indices. Indices are
+// processed in image tiles for locality.
 template <typename T, typename Func>
-inline void parallel_for(T num1, T num2, Func&& func);
+inline void parallel_for(
+    T num1, T num2, Func&& func, const cancel_token* cancel = nullptr);
 
 // Simple parallel for used since our target platforms do not yet support
 // parallel algorithms. `Func` takes a reference to a `T`.
 template <typename T, typename Func>
-inline void parallel_foreach(vector<T>& values, Func&& func);
+inline void parallel_foreach(
+    vector<T>& values, Func&& func, const cancel_token* cancel = nullptr);
+template <typename T, typename Func>
+inline void parallel_foreach(const vector<T>& values, Func&& func,
+    const cancel_token* cancel = nullptr);
+
+// Parallel for over contiguous ranges of at most `grain` indices. `Func` takes
+// the range begin and end indices. A `grain` of 0 picks a size that gives a
+// few ranges per thread.
 template <typename T, typename Func>
-inline void parallel_foreach(const vector<T>& values, Func&& func);
+inline void parallel_for_range(
+    T num, T grain, Func&& func, const cancel_token* cancel = nullptr);
+
+// Image tile covering the pixels in [xmin, xmax) x [ymin, ymax).
+struct parallel_tile {
+  int xmin = 0;
+  int ymin = 0;
+  int xmax = 0;
+  int ymax = 0;
+};
+
+// Order in which image tiles are handed out to threads.
+enum struct parallel_tile_order { scanline, morton, hilbert };
+
+// Default tile size used by tiled parallel loops.
+const auto parallel_default_tile = 32;
+
+// Parallel for over the image tiles of size `tile_size`. `Func` takes a
+// `parallel_tile`. Tiles are scheduled in Morton or Hilbert order to improve
+// locality between concurrently processed tiles.
+template <typename Func>
+inline void parallel_for_tiles(int width, int height, int tile_size,
+    Func&& func, parallel_tile_order order = parallel_tile_order::morton,
+    const cancel_token* cancel = nullptr);
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// PARALLEL REDUCTIONS, SCANS AND SORTS
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Parallel reduction over [0, num). `Func` takes the range begin and end
+// indices and returns the range value. Range values are combined in order
+// with `Reduce`, starting from `init`. Ranges depend only on `num`, so
+// results are deterministic regardless of the number of threads.
+template <typename T, typename Value, typename Func, typename Reduce>
+inline Value parallel_reduce(
+    T num, const Value& init, Func&& func, Reduce&& reduce);
+
+// Parallel prefix sums computed in place. The inclusive scan sets each
+// value to the sum of all values up to it, while the exclusive scan sets it
+// to `init` plus the sum of all values before it. Values are combined with
+// `Op`, that defaults to addition. Results are deterministic.
+template <typename T, typename Op = std::plus<T>>
+inline void parallel_inclusive_scan(vector<T>& values, Op&& op = Op{});
+template <typename T, typename Op = std::plus<T>>
+inline void parallel_exclusive_scan(
+    vector<T>& values, const T& init = T{}, Op&& op = Op{});
+
+// Parallel stable sort using `Less` to compare values. Implemented as a
+// merge sort of sorted blocks.
+template <typename T, typename Less = std::less<T>>
+inline void parallel_sort(vector<T>& values, Less&& less = Less{});
+// Parallel stable radix sort by the unsigned integer returned by `Key`.
+// Only the bytes needed to represent the largest key are sorted.
+template <typename T, typename Key>
+inline void parallel_radix_sort(vector<T>& values, Key&& key);
 
 }  // namespace yocto
 
@@ -145,7 +262,236 @@ bool concurrent_queue<T>::try_pop(T& value) {
   return true;
 }
 
-// Run a task asynchronously
+// Process-wide thread pool with one task deque per worker and work stealing.
+// Workers pop from the back of their own deque and steal from the front of
+// the others. Tasks submitted from outside the pool go to a shared deque.
+// Threads waiting for their tasks run pending tasks, and sleep otherwise.
+struct _thread_pool {
+  struct task_queue {
+    std::mutex              mutex = {};
+    deque<function<void()>> tasks = {};
+  };
+
+  vector<std::thread>            threads     = {};
+  vector<unique_ptr<task_queue>> queues      = {};  // workers and shared
+  std::mutex                     sleep_mutex = {};
+  std::condition_variable        sleep_cv    = {};  // workers
+  std::condition_variable        wait_cv     = {};  // waiting threads
+  atomic<int64_t>                pending     = 0;
+  atomic<bool>                   done        = false;
+  int                            num_threads = 0;
+
+  // statistics
+  atomic<uint64_t> num_tasks  = 0;
+  atomic<uint64_t> num_steals = 0;
+  atomic<int64_t>  idle_ns    = 0;
+
+  _thread_pool() { start(0); }
+  ~_thread_pool() { stop(); }
+
+  // worker id of the current thread, -1 for threads outside the pool
+  static int& worker_id() {
+    static thread_local int id = -1;
+    return id;
+  }
+
+  void start(int num_threads_) {
+    num_threads = num_threads_ > 0
+                      ? num_threads_
+                      : std::max((int)std::thread::hardware_concurrency(), 1);
+    // the calling thread takes part in parallel loops, so we start one
+    // worker less
+    auto num_workers = num_threads - 1;
+    done             = false;
+    queues.clear();
+    for (auto idx = 0; idx < num_workers + 1; idx++)
+      queues.push_back(std::make_unique<task_queue>());
+    for (auto idx = 0; idx < num_workers; idx++) {
+      threads.emplace_back([this, idx]() { run_worker(idx); });
+    }
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex);
+      done = true;
+    }
+    sleep_cv.notify_all();
+    for (auto& thread : threads) thread.join();
+    threads.clear();
+  }
+
+  int shared_queue() const { return (int)queues.size() - 1; }
+
+  void submit(function<void()>&& task) {
+    auto id    = worker_id();
+    auto queue = id >= 0 ? id : shared_queue();
+    {
+      std::lock_guard<std::mutex> lock(queues[queue]->mutex);
+      queues[queue]->tasks.push_back(std::move(task));
+    }
+    pending += 1;
+    { std::lock_guard<std::mutex> lock(sleep_mutex); }
+    sleep_cv.notify_one();
+    wait_cv.notify_all();
+  }
+
+  bool pop_back(int queue, function<void()>& task) {
+    std::lock_guard<std::mutex> lock(queues[queue]->mutex);
+    if (queues[queue]->tasks.empty()) return false;
+    task = std::move(queues[queue]->tasks.back());
+    queues[queue]->tasks.pop_back();
+    pending -= 1;
+    return true;
+  }
+  bool pop_front(int queue, function<void()>& task) {
+    std::lock_guard<std::mutex> lock(queues[queue]->mutex);
+    if (queues[queue]->tasks.empty()) return false;
+    task = std::move(queues[queue]->tasks.front());
+    queues[queue]->tasks.pop_front();
+    pending -= 1;
+    return true;
+  }
+
+  // get a task from the own queue, the shared queue or by stealing
+  bool pop_task(function<void()>& task) {
+    auto id = worker_id();
+    if (id >= 0 && pop_back(id, task)) return true;
+    if (pop_front(shared_queue(), task)) return true;
+    // workers own the queues before the shared one, that are all created
+    // before the workers start, unlike `threads`
+    auto num_workers = shared_queue();
+    for (auto offset = 1; offset <= num_workers; offset++) {
+      auto victim = (std::max(id, 0) + offset) % num_workers;
+      if (victim == id) continue;
+      if (pop_front(victim, task)) {
+        num_steals += 1;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // run a task, if available, returning whether a task was run
+  bool run_pending() {
+    auto task = function<void()>{};
+    if (!pop_task(task)) return false;
+    num_tasks += 1;
+    task();
+    return true;
+  }
+
+  void run_worker(int id) {
+    worker_id() = id;
+    while (!done) {
+      if (run_pending()) continue;
+      auto start = std::chrono::steady_clock::now();
+      {
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        sleep_cv.wait(lock, [this]() { return done || pending > 0; });
+      }
+      idle_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - start)
+                     .count();
+    }
+  }
+
+  // decrement a counter, waking up the threads waiting for it
+  void finish(atomic<int>& counter) {
+    if (counter.fetch_sub(1) != 1) return;
+    { std::lock_guard<std::mutex> lock(sleep_mutex); }
+    wait_cv.notify_all();
+  }
+
+  // wait for a counter to reach zero, running other tasks in the meantime
+  // and sleeping when no task is available
+  void wait(const atomic<int>& counter) {
+    while (counter > 0) {
+      if (run_pending()) continue;
+      std::unique_lock<std::mutex> lock(sleep_mutex);
+      wait_cv.wait(lock, [this, &counter]() {
+        return counter <= 0 || pending > 0;
+      });
+    }
+  }
+};
+
+// Get the process-wide thread pool.
+inline _thread_pool& _get_thread_pool() {
+  static auto pool = _thread_pool{};
+  return pool;
+}
+
+// Set the number of threads used by parallel algorithms.
+inline void set_parallel_threads(int num_threads) {
+  auto& pool = _get_thread_pool();
+  pool.stop();
+  pool.start(num_threads);
+}
+// Get the number of threads used by parallel algorithms.
+inline int get_parallel_threads() { return _get_thread_pool().num_threads; }
+
+// Get and reset the thread pool statistics.
+inline parallel_stats get_parallel_stats() {
+  auto& pool = _get_thread_pool();
+  return {pool.num_threads, pool.num_tasks, pool.num_steals,
+      pool.idle_ns * 1e-9};
+}
+inline void reset_parallel_stats() {
+  auto& pool      = _get_thread_pool();
+  pool.num_tasks  = 0;
+  pool.num_steals = 0;
+  pool.idle_ns    = 0;
+}
+
+// Run a function on `num_tasks` tasks in the thread pool, with the calling
+// thread running the first one. Waits for all tasks to finish and rethrows
+// the first exception, if any.
+template <typename Func>
+inline void _parallel_run(int num_tasks, Func&& func) {
+  auto& pool      = _get_thread_pool();
+  auto  running   = atomic<int>{num_tasks - 1};
+  auto  error     = std::exception_ptr{};
+  auto  has_error = atomic<bool>{false};
+  auto  run_task  = [&func, &error, &has_error](int task_id) {
+    try {
+      func(task_id);
+    } catch (...) {
+      if (!has_error.exchange(true)) error = std::current_exception();
+    }
+  };
+  for (auto task_id = 1; task_id < num_tasks; task_id++) {
+    pool.submit([&pool, &run_task, &running, task_id]() {
+      run_task(task_id);
+      pool.finish(running);
+    });
+  }
+  run_task(0);
+  pool.wait(running);
+  if (error) std::rethrow_exception(error);
+}
+
+// Cancel the work, check for cancellation and reset a token for reuse.
+inline void cancel_work(cancel_token* cancel) {
+  if (cancel) cancel->canceled = true;
+}
+inline bool is_canceled(const cancel_token* cancel) {
+  return cancel && cancel->canceled.load(std::memory_order_relaxed);
+}
+inline void reset_cancel(cancel_token* cancel) {
+  if (!cancel) return;
+  cancel->canceled = false;
+  cancel->current  = 0;
+  cancel->total    = 0;
+}
+// Update the progress stored in a token, if not null.
+inline void set_progress(cancel_token* cancel, int current, int total) {
+  if (!cancel) return;
+  cancel->current = current;
+  cancel->total   = total;
+}
+
+// Run a task asynchronously on a dedicated thread
 template <typename Func, typename... Args>
 inline auto run_async(Func&& func, Args&&... args) {
   return std::async(std::launch::async, std::forward<Func>(func),
@@ -165,54 +511,390 @@ inline bool is_ready(const future<void>& result) {
 // Simple parallel for used since our target platforms do not yet support
 // parallel algorithms. `Func` takes the integer index.
 template <typename T, typename Func>
-inline void parallel_for(T num, Func&& func) {
-  auto      futures  = vector<future<void>>{};
-  auto      nthreads = std::thread::hardware_concurrency();
-  atomic<T> next_idx(0);
-  for (auto thread_id = 0; thread_id < nthreads; thread_id++) {
-    futures.emplace_back(
-        std::async(std::launch::async, [&func, &next_idx, num]() {
-          while (true) {
-            auto idx = next_idx.fetch_add(1);
-            if (idx >= num) break;
-            func(idx);
-          }
-        }));
-  }
-  for (auto& f : futures) f.get();
+inline void parallel_for(T num, Func&& func, const cancel_token* cancel) {
+  if (num <= 0) return;
+  auto num_tasks = (int)std::min((T)get_parallel_threads(), num);
+  if (num_tasks <= 1) {
+    for (auto idx = (T)0; idx < num; idx++) {
+      if (is_canceled(cancel)) break;
+      func(idx);
+    }
+    return;
+  }
+  auto next_idx = atomic<T>{0};
+  _parallel_run(num_tasks, [&func, &next_idx, num, cancel](int) {
+    while (true) {
+      if (is_canceled(cancel)) break;
+      auto idx = next_idx.fetch_add(1);
+      if (idx >= num) break;
+      func(idx);
+    }
+  });
 }
 
 // Simple parallel for used since our target platforms do not yet support
 // parallel algorithms. `Func` takes the two integer indices.
 template <typename T, typename Func>
-inline void parallel_for(T num1, T num2, Func&& func) {
-  auto      futures  = vector<future<void>>{};
-  auto      nthreads = std::thread::hardware_concurrency();
-  atomic<T> next_idx(0);
-  for (auto thread_id = 0; thread_id < nthreads; thread_id++) {
-    futures.emplace_back(
-        std::async(std::launch::async, [&func, &next_idx, num1, num2]() {
-          while (true) {
-            auto j = next_idx.fetch_add(1);
-            if (j >= num2) break;
-            for (auto i = (T)0; i < num1; i++) func(i, j);
-          }
-        }));
-  }
-  for (auto& f : futures) f.get();
+inline void parallel_for(
+    T num1, T num2, Func&& func, const cancel_token* cancel) {
+  parallel_for_tiles(
+      (int)num1, (int)num2, parallel_default_tile,
+      [&func](const parallel_tile& tile) {
+        for (auto j = (T)tile.ymin; j < (T)tile.ymax; j++)
+          for (auto i = (T)tile.xmin; i < (T)tile.xmax; i++) func(i, j);
+      },
+      parallel_tile_order::morton, cancel);
 }
 
 // Simple parallel for used since our target platforms do not yet support
 // parallel algorithms. `Func` takes a reference to a `T`.
 template <typename T, typename Func>
-inline void parallel_foreach(vector<T>& values, Func&& func) {
+inline void parallel_foreach(
+    vector<T>& values, Func&& func, const cancel_token* cancel) {
   parallel_for(
-      0, (int)values.size(), [&func, &values](int idx) { func(values[idx]); });
+      (int)values.size(), [&func, &values](int idx) { func(values[idx]); },
+      cancel);
 }
 template <typename T, typename Func>
-inline void parallel_foreach(const vector<T>& values, Func&& func) {
+inline void parallel_foreach(
+    const vector<T>& values, Func&& func, const cancel_token* cancel) {
   parallel_for(
-      0, (int)values.size(), [&func, &values](int idx) { func(values[idx]); });
+      (int)values.size(), [&func, &values](int idx) { func(values[idx]); },
+      cancel);
+}
+
+// Parallel for over contiguous ranges of at most `grain` indices. `Func` takes
+// the range begin and end indices.
+template <typename T, typename Func>
+inline void parallel_for_range(
+    T num, T grain, Func&& func, const cancel_token* cancel) {
+  if (num <= 0) return;
+  auto num_threads = (T)get_parallel_threads();
+  if (grain <= 0) grain = std::max(num / (num_threads * 8), (T)1);
+  auto num_ranges = (num + grain - 1) / grain;
+  auto num_tasks  = (int)std::min(num_threads, num_ranges);
+  if (num_tasks <= 1) {
+    for (auto range = (T)0; range < num_ranges; range++) {
+      if (is_canceled(cancel)) break;
+      func(range * grain, std::min(range * grain + grain, num));
+    }
+    return;
+  }
+  auto next_range = atomic<T>{0};
+  _parallel_run(num_tasks, [&func, &next_range, num, grain, num_ranges,
+                               cancel](int) {
+    while (true) {
+      if (is_canceled(cancel)) break;
+      auto range = next_range.fetch_add(1);
+      if (range >= num_ranges) break;
+      func(range * grain, std::min(range * grain + grain, num));
+    }
+  });
+}
+
+// Interleave the lower 16 bits of x and y, used for Morton ordering.
+inline uint32_t _morton_code2(uint32_t x, uint32_t y) {
+  auto spread = [](uint32_t v) {
+    v &= 0x0000ffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+  };
+  return spread(x) | (spread(y) << 1);
+}
+
+// Distance of a point along the Hilbert curve covering a grid of size n,
+// where n is a power of two.
+inline uint32_t _hilbert_code2(uint32_t n, uint32_t x, uint32_t y) {
+  auto d = (uint32_t)0;
+  for (auto s = n / 2; s > 0; s /= 2) {
+    auto rx = (x & s) > 0 ? (uint32_t)1 : (uint32_t)0;
+    auto ry = (y & s) > 0 ? (uint32_t)1 : (uint32_t)0;
+    d += s * s * ((3 * rx) ^ ry);
+    if (ry == 0) {
+      if (rx == 1) {
+        x = s - 1 - x;
+        y = s - 1 - y;
+      }
+      std::swap(x, y);
+    }
+  }
+  return d;
+}
+
+// Parallel for over the image tiles of size `tile_size`. `Func` takes a
+// `parallel_tile`.
+template <typename Func>
+inline void parallel_for_tiles(int width, int height, int tile_size,
+    Func&& func, parallel_tile_order order, const cancel_token* cancel) {
+  if (width <= 0 || height <= 0) return;
+  if (tile_size <= 0) tile_size = parallel_default_tile;
+  auto tiles_x   = (width + tile_size - 1) / tile_size;
+  auto tiles_y   = (height + tile_size - 1) / tile_size;
+  auto num_tiles = tiles_x * tiles_y;
+
+  // tile ordering
+  auto tiles = vector<int>(num_tiles);
+  for (auto idx = 0; idx < num_tiles; idx++) tiles[idx] = idx;
+  if (order != parallel_tile_order::scanline) {
+    auto size = (uint32_t)1;
+    while (size < (uint32_t)std::max(tiles_x, tiles_y)) size *= 2;
+    auto codes = vector<uint32_t>(num_tiles);
+    for (auto idx = 0; idx < num_tiles; idx++) {
+      auto tx = (uint32_t)(idx % tiles_x), ty = (uint32_t)(idx / tiles_x);
+      codes[idx] = order == parallel_tile_order::morton
+                       ? _morton_code2(tx, ty)
+                       : _hilbert_code2(size, tx, ty);
+    }
+    std::sort(tiles.begin(), tiles.end(),
+        [&codes](int a, int b) { return codes[a] < codes[b]; });
+  }
+
+  // run tiles
+  auto make_tile = [tiles_x, tile_size, width, height](int idx) {
+    auto tx = idx % tiles_x, ty = idx / tiles_x;
+    return parallel_tile{tx * tile_size, ty * tile_size,
+        std::min(tx * tile_size + tile_size, width),
+        std::min(ty * tile_size + tile_size, height)};
+  };
+  auto num_tasks = std::min(get_parallel_threads(), num_tiles);
+  if (num_tasks <= 1) {
+    for (auto idx : tiles) {
+      if (is_canceled(cancel)) break;
+      func(make_tile(idx));
+    }
+    return;
+  }
+  auto next_tile = atomic<int>{0};
+  _parallel_run(
+      num_tasks, [&func, &next_tile, &tiles, &make_tile, cancel](int) {
+        while (true) {
+          if (is_canceled(cancel)) break;
+          auto tile = next_tile.fetch_add(1);
+          if (tile >= (int)tiles.size()) break;
+          func(make_tile(tiles[tile]));
+        }
+      });
+}
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// PARALLEL REDUCTIONS, SCANS AND SORTS
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Number of blocks used to split reductions, scans and sorts. Blocks depend
+// only on the number of elements, so that results are deterministic.
+template <typename T>
+inline T _parallel_blocks(T num) {
+  const auto min_block = (T)4096, max_blocks = (T)256;
+  return std::min(
+      std::max((num + min_block - 1) / min_block, (T)1), max_blocks);
+}
+// Begin index of a block, with blocks of nearly equal size.
+template <typename T>
+inline T _parallel_block_begin(T num, T num_blocks, T block) {
+  return (T)((uint64_t)num * (uint64_t)block / (uint64_t)num_blocks);
+}
+
+// Parallel reduction over [0, num).
+template <typename T, typename Value, typename Func, typename Reduce>
+inline Value parallel_reduce(
+    T num, const Value& init, Func&& func, Reduce&& reduce) {
+  if (num <= 0) return init;
+  auto num_blocks = _parallel_blocks(num);
+  auto values     = vector<Value>(num_blocks, init);
+  parallel_for(num_blocks, [&func, &values, num, num_blocks](T block) {
+    values[block] = func(_parallel_block_begin(num, num_blocks, block),
+        _parallel_block_begin(num, num_blocks, block + 1));
+  });
+  auto result = init;
+  for (auto& value : values) result = reduce(result, value);
+  return result;
+}
+
+// Parallel prefix sums computed in place. Block sums are computed in
+// parallel and scanned serially, to get the offset of each block, then each
+// block is scanned in parallel. If `init` is null, the scan is inclusive.
+template <typename T, typename Op>
+inline void _parallel_scan(vector<T>& values, const T* init, Op&& op) {
+  auto num = values.size();
+  if (num == 0) return;
+  auto num_blocks = _parallel_blocks(num);
+
+  // block offsets
+  auto offsets = vector<T>(num_blocks);
+  if (num_blocks > 1) {
+    auto sums = vector<T>(num_blocks);
+    parallel_for(num_blocks - 1, [&](size_t block) {
+      auto start = _parallel_block_begin(num, num_blocks, block);
+      auto end   = _parallel_block_begin(num, num_blocks, block + 1);
+      auto sum   = values[start];
+      for (auto idx = start + 1; idx < end; idx++) sum = op(sum, values[idx]);
+      sums[block] = sum;
+    });
+    offsets[1] = init ? op(*init, sums[0]) : sums[0];
+    for (auto block = (size_t)2; block < num_blocks; block++)
+      offsets[block] = op(offsets[block - 1], sums[block - 1]);
+  }
+  if (init) offsets[0] = *init;
+
+  // scan blocks
+  parallel_for(num_blocks, [&](size_t block) {
+    auto start = _parallel_block_begin(num, num_blocks, block);
+    auto end   = _parallel_block_begin(num, num_blocks, block + 1);
+    if (init) {
+      auto sum = offsets[block];
+      for (auto idx = start; idx < end; idx++) {
+        auto value  = values[idx];
+        values[idx] = sum;
+        sum         = op(sum, value);
+      }
+    } else {
+      if (block != 0) values[start] = op(offsets[block], values[start]);
+      for (auto idx = start + 1; idx < end; idx++)
+        values[idx] = op(values[idx - 1], values[idx]);
+    }
+  });
+}
+
+// Parallel prefix sums computed in place.
+template <typename T, typename Op>
+inline void parallel_inclusive_scan(vector<T>& values, Op&& op) {
+  _parallel_scan(values, (const T*)nullptr, op);
+}
+template <typename T, typename Op>
+inline void parallel_exclusive_scan(
+    vector<T>& values, const T& init, Op&& op) {
+  _parallel_scan(values, &init, op);
+}
+
+// Number of elements taken from the first sequence in the first `diag`
+// elements of the stable merge of two sorted sequences.
+template <typename Iterator, typename Less>
+inline size_t _merge_path(Iterator first, size_t num_first, Iterator second,
+    size_t num_second, size_t diag, Less& less) {
+  auto lo = diag > num_second ? diag - num_second : (size_t)0;
+  auto hi = std::min(diag, num_first);
+  while (lo < hi) {
+    auto mid = (lo + hi) / 2;
+    if (less(second[diag - mid - 1], first[mid])) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return lo;
+}
+
+// Parallel stable sort. Blocks are sorted in parallel, then merged in
+// pairs. Each merge is split at block boundaries with merge paths, so that
+// all blocks are processed in parallel also in the last merges.
+template <typename T, typename Less>
+inline void parallel_sort(vector<T>& values, Less&& less) {
+  auto num        = values.size();
+  auto num_blocks = _parallel_blocks(num);
+  if (num_blocks <= 1) {
+    std::stable_sort(values.begin(), values.end(), less);
+    return;
+  }
+  auto block_begin = [num, num_blocks](size_t block) {
+    return _parallel_block_begin(num, num_blocks, block);
+  };
+
+  // sort blocks
+  parallel_for(num_blocks, [&](size_t block) {
+    std::stable_sort(values.begin() + block_begin(block),
+        values.begin() + block_begin(block + 1), less);
+  });
+
+  // merge blocks
+  auto buffer = vector<T>(num);
+  auto source = &values, destination = &buffer;
+  for (auto width = (size_t)1; width < num_blocks; width *= 2) {
+    parallel_for(num_blocks, [&](size_t block) {
+      auto group       = block / (2 * width) * (2 * width);
+      auto first       = source->begin() + block_begin(group);
+      auto second      = source->begin() +
+                    block_begin(std::min(group + width, num_blocks));
+      auto last        = source->begin() +
+                  block_begin(std::min(group + 2 * width, num_blocks));
+      auto num_first   = (size_t)(second - first);
+      auto num_second  = (size_t)(last - second);
+      auto diag_start  = block_begin(block) - block_begin(group);
+      auto diag_end    = block_begin(block + 1) - block_begin(group);
+      auto first_start = _merge_path(
+          first, num_first, second, num_second, diag_start, less);
+      auto first_end   = _merge_path(
+          first, num_first, second, num_second, diag_end, less);
+      std::merge(first + first_start, first + first_end,
+          second + (diag_start - first_start),
+          second + (diag_end - first_end),
+          destination->begin() + block_begin(block), less);
+    });
+    std::swap(source, destination);
+  }
+  if (source != &values) values.swap(buffer);
+}
+
+// Parallel stable radix sort. Each pass sorts one byte by computing
+// per-block digit counts in parallel, scanning them in digit-major order,
+// and scattering each block in parallel.
+template <typename T, typename Key>
+inline void parallel_radix_sort(vector<T>& values, Key&& key) {
+  using key_type = std::decay_t<std::invoke_result_t<Key, const T&>>;
+  static_assert(std::is_unsigned_v<key_type>, "radix sort needs unsigned keys");
+  auto num = values.size();
+  if (num <= 1) return;
+  auto num_blocks  = _parallel_blocks(num);
+  auto block_begin = [num, num_blocks](size_t block) {
+    return _parallel_block_begin(num, num_blocks, block);
+  };
+
+  // largest key
+  auto max_key = parallel_reduce(
+      num, (key_type)0,
+      [&](size_t start, size_t end) {
+        auto max_key = (key_type)0;
+        for (auto idx = start; idx < end; idx++)
+          max_key = std::max(max_key, (key_type)key(values[idx]));
+        return max_key;
+      },
+      [](key_type a, key_type b) { return std::max(a, b); });
+
+  // sort by bytes
+  auto buffer = vector<T>(num);
+  auto counts = vector<size_t>(num_blocks * 256);
+  auto source = &values, destination = &buffer;
+  for (auto shift = 0; shift < (int)sizeof(key_type) * 8; shift += 8) {
+    if ((max_key >> shift) == 0) break;
+    parallel_for(num_blocks, [&](size_t block) {
+      auto block_counts = counts.data() + block * 256;
+      std::fill(block_counts, block_counts + 256, (size_t)0);
+      for (auto idx = block_begin(block); idx < block_begin(block + 1); idx++)
+        block_counts[(key((*source)[idx]) >> shift) & 0xff] += 1;
+    });
+    auto offset = (size_t)0;
+    for (auto digit = 0; digit < 256; digit++) {
+      for (auto block = (size_t)0; block < num_blocks; block++) {
+        auto count                  = counts[block * 256 + digit];
+        counts[block * 256 + digit] = offset;
+        offset += count;
+      }
+    }
+    parallel_for(num_blocks, [&](size_t block) {
+      auto block_offsets = counts.data() + block * 256;
+      for (auto idx = block_begin(block); idx < block_begin(block + 1); idx++) {
+        auto digit = (key((*source)[idx]) >> shift) & 0xff;
+        (*destination)[block_offsets[digit]++] = std::move((*source)[idx]);
+      }
+    });
+    std::swap(source, destination);
+  }
+  if (source != &values) values.swap(buffer);
 }
 
 }  // namespace yocto
@@ -81,6 +81,12 @@ struct rng_state {
 // Init a random number generator with a state state from the sequence seq.
 inline rng_state make_rng(uint64_t seed, uint64_t seq = 1);
 
+// Init a random number generator for a sample of an element, like a pixel,
+// by hashing the seed, the element index and the sample index. Samples get
+// independent sequences, that can be generated in any order without storing
+// generator states. Random numbers of a sample are taken in sequence.
+inline rng_state make_rng(uint64_t seed, uint64_t index, uint64_t sample);
+
 // Next random numbers: floats in [0,1), ints in [0,n).
 inline int   rand1i(rng_state& rng, int n);
 inline float rand1f(rng_state& rng);
@@ -93,6 +99,52 @@ inline void shuffle(vector<T>& vals, rng_state& rng);
 
 }  // namespace yocto
 
+// -----------------------------------------------------------------------------
+// LOW-DISCREPANCY SAMPLERS
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Sequences used by samplers. Random sequences draw independent numbers.
+// Sobol sequences draw each one or two dimensions from the first two Sobol
+// dimensions, with Owen scrambling and index shuffling seeded per dimension
+// and pixel. Z-order Sobol sequences instead shuffle the sample indices of
+// nearby pixels along a Morton curve, so that the error is distributed as
+// blue noise in the image. Blue-noise sequences draw the same Sobol points
+// in all pixels, offset per pixel by a blue-noise mask.
+enum struct sampler_sequence { random, sobol, zsobol, bluenoise };
+
+// Sampler of the dimensions of a sample of a pixel, drawn in sequence.
+// Random samplers use `rng`, while the others use the sample `index`,
+// that is a Morton index of the pixel and sample for Z-order Sobol.
+struct sampler_state {
+  sampler_sequence sequence     = sampler_sequence::random;
+  rng_state        rng          = {};
+  uint64_t         index        = 0;
+  uint32_t         seed         = 0;
+  uint32_t         dimension    = 0;
+  vec2i            pixel        = {0, 0};
+  int              digits       = 0;
+  int              log2_samples = 0;
+};
+
+// Init a sampler for the sample `sample`, out of `samples`, of the pixel
+// `ij` of an image of size `size`. Samples past `samples` are still drawn,
+// but Z-order Sobol sequences are then not stratified across samples.
+inline sampler_state make_sampler(sampler_sequence sequence, uint64_t seed,
+    const vec2i& ij, const vec2i& size, int sample, int samples);
+
+// Next dimensions: floats in [0,1), ints in [0,n).
+inline int   rand1i(sampler_state& sampler, int n);
+inline float rand1f(sampler_state& sampler);
+inline vec2f rand2f(sampler_state& sampler);
+
+// Skip to the next group of `count` dimensions. Used to allocate the same
+// dimensions to the same sampling decisions, like the ones of a bounce,
+// even if the previous ones used fewer dimensions.
+inline void next_dimensions(sampler_state& sampler, int count);
+
+}  // namespace yocto
+
 // -----------------------------------------------------------------------------
 // MONETACARLO SAMPLING FUNCTIONS
 // -----------------------------------------------------------------------------
@@ -213,6 +265,22 @@ inline rng_state make_rng(uint64_t seed, uint64_t seq) {
   return rng;
 }
 
+// Hash of a 64-bit integer, from the SplitMix64 finalizer.
+inline uint64_t _hash_rng(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+// Init a random number generator for a sample of an element.
+inline rng_state make_rng(uint64_t seed, uint64_t index, uint64_t sample) {
+  auto hash = _hash_rng(seed ^ _hash_rng(index ^ _hash_rng(sample)));
+  return make_rng(hash, _hash_rng(index ^ seed));
+}
+
 // Next random numbers: floats in [0,1), ints in [0,n).
 inline int   rand1i(rng_state& rng, int n) { return _advance_rng(rng) % n; }
 inline float rand1f(rng_state& rng) {
@@ -252,6 +320,266 @@ inline void shuffle(vector<T>& vals, rng_state& rng) {
 
 }  // namespace yocto
 
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION OF LOW-DISCREPANCY SAMPLERS
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Hash of two 32-bit integers.
+inline uint32_t _hash_rng(uint32_t a, uint32_t b) {
+  return (uint32_t)_hash_rng(((uint64_t)a << 32) | b);
+}
+
+// Reverse the bits of an integer.
+inline uint32_t _reverse_bits(uint32_t x) {
+  x = (x << 16) | (x >> 16);
+  x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+  x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+  x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+  x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+  return x;
+}
+
+// Owen scrambling, as a nested uniform scramble of the bits from the most
+// significant, with the hash-based permutation from Burley, "Practical
+// Hash-based Owen Scrambling", JCGT 2020.
+inline uint32_t _owen_scramble(uint32_t x, uint32_t seed) {
+  x = _reverse_bits(x);
+  x ^= x * 0x3d20adeau;
+  x += seed;
+  x *= (seed >> 16) | 1;
+  x ^= x * 0x05526c56u;
+  x ^= x * 0x53a22864u;
+  return _reverse_bits(x);
+}
+
+// Point of the first two Sobol dimensions, whose direction numbers are
+// computed from their primitive polynomials.
+inline uint32_t _sobol(uint32_t index, int dimension) {
+  auto value = 0u, direction = 1u << 31;
+  for (; index != 0; index >>= 1) {
+    if ((index & 1) != 0) value ^= direction;
+    direction = (dimension == 0) ? direction >> 1
+                                 : direction ^ (direction >> 1);
+  }
+  return value;
+}
+
+// Float in [0,1) from the most significant bits of an integer.
+inline float _uint_to_float(uint32_t x) { return (x >> 8) * 0x1p-24f; }
+
+// Interleave the bits of two coordinates as a Morton code.
+inline uint64_t _encode_morton(uint32_t x, uint32_t y) {
+  auto spread = [](uint64_t v) {
+    v = (v | (v << 16)) & 0x0000ffff0000ffffull;
+    v = (v | (v << 8)) & 0x00ff00ff00ff00ffull;
+    v = (v | (v << 4)) & 0x0f0f0f0f0f0f0f0full;
+    v = (v | (v << 2)) & 0x3333333333333333ull;
+    v = (v | (v << 1)) & 0x5555555555555555ull;
+    return v;
+  };
+  return (spread(y) << 1) | spread(x);
+}
+
+// Sample index of a Z-order Sobol sampler for the current dimension. The
+// base-4 digits of the Morton index are permuted randomly, depending on the
+// higher digits, as in Ahmed and Wonka, "Screen-Space Blue-Noise Diffusion
+// of Monte Carlo Sampling Error via Hierarchical Ordering of Pixels", 2020.
+inline uint64_t _zsobol_index(const sampler_state& sampler) {
+  static const uint8_t permutations[24][4] = {{0, 1, 2, 3}, {0, 1, 3, 2},
+      {0, 2, 1, 3}, {0, 2, 3, 1}, {0, 3, 2, 1}, {0, 3, 1, 2}, {1, 0, 2, 3},
+      {1, 0, 3, 2}, {1, 2, 0, 3}, {1, 2, 3, 0}, {1, 3, 2, 0}, {1, 3, 0, 2},
+      {2, 1, 0, 3}, {2, 1, 3, 0}, {2, 0, 1, 3}, {2, 0, 3, 1}, {2, 3, 0, 1},
+      {2, 3, 1, 0}, {3, 1, 2, 0}, {3, 1, 0, 2}, {3, 2, 1, 0}, {3, 2, 0, 1},
+      {3, 0, 2, 1}, {3, 0, 1, 2}};
+  auto odd   = (sampler.log2_samples & 1) != 0;
+  auto mix   = 0x55555555ull * sampler.dimension;
+  auto index = (uint64_t)0;
+  for (auto i = sampler.digits - 1; i >= (odd ? 1 : 0); i--) {
+    auto shift  = 2 * i - (odd ? 1 : 0);
+    auto digit  = (sampler.index >> shift) & 3;
+    auto higher = sampler.index >> (shift + 2);
+    auto permutation = (_hash_rng(higher ^ mix) >> 24) % 24;
+    index |= (uint64_t)permutations[permutation][digit] << shift;
+  }
+  if (odd) {
+    index |= (sampler.index & 1) ^ (_hash_rng((sampler.index >> 1) ^ mix) & 1);
+  }
+  return index;
+}
+
+// Blue-noise mask of 64x64 values in [0,1), made once with the
+// void-and-cluster method from Ulichney, "The void-and-cluster method for
+// dither array generation", 1993. The mask tiles the image.
+inline const vector<float>& _bluenoise_mask() {
+  static const auto mask = []() {
+    const auto size = 64, count = size * size;
+    auto       kernel = vector<float>(count);
+    for (auto j = 0; j < size; j++) {
+      for (auto i = 0; i < size; i++) {
+        auto dx = (float)min(i, size - i), dy = (float)min(j, size - j);
+        kernel[j * size + i] = exp(-(dx * dx + dy * dy) / (2 * 1.5f * 1.5f));
+      }
+    }
+    // set a pixel in a pattern, updating the energy of the pattern
+    auto toggle = [&](vector<bool>& pattern, vector<float>& energy, int idx) {
+      pattern[idx] = !pattern[idx];
+      auto sign = pattern[idx] ? 1.0f : -1.0f;
+      auto x = idx % size, y = idx / size;
+      for (auto j = 0; j < size; j++) {
+        for (auto i = 0; i < size; i++) {
+          energy[j * size + i] += sign * kernel[((j - y) & (size - 1)) * size +
+                                                ((i - x) & (size - 1))];
+        }
+      }
+    };
+    // tightest cluster, among set pixels, or largest void otherwise
+    auto find = [&](const vector<bool>& pattern, const vector<float>& energy,
+                    bool cluster) {
+      auto found = -1;
+      for (auto idx = 0; idx < count; idx++) {
+        if (pattern[idx] != cluster) continue;
+        if (found < 0 || (cluster ? energy[idx] > energy[found]
+                                  : energy[idx] < energy[found]))
+          found = idx;
+      }
+      return found;
+    };
+    // initial pattern, relaxed by moving clusters to voids
+    auto pattern = vector<bool>(count, false);
+    auto energy  = vector<float>(count, 0);
+    auto rng     = make_rng(1301081);
+    auto ones    = count / 10;
+    for (auto set = 0; set < ones;) {
+      auto idx = rand1i(rng, count);
+      if (pattern[idx]) continue;
+      toggle(pattern, energy, idx);
+      set++;
+    }
+    for (auto iteration = 0; iteration < count; iteration++) {
+      auto cluster = find(pattern, energy, true);
+      toggle(pattern, energy, cluster);
+      auto hole = find(pattern, energy, false);
+      toggle(pattern, energy, hole);
+      if (hole == cluster) break;
+    }
+    // rank pixels, removing clusters and then filling voids
+    auto ranks     = vector<int>(count, 0);
+    auto removed   = pattern;
+    auto reenergy  = energy;
+    for (auto rank = ones - 1; rank >= 0; rank--) {
+      auto cluster = find(removed, reenergy, true);
+      toggle(removed, reenergy, cluster);
+      ranks[cluster] = rank;
+    }
+    for (auto rank = ones; rank < count; rank++) {
+      auto hole = find(pattern, energy, false);
+      toggle(pattern, energy, hole);
+      ranks[hole] = rank;
+    }
+    auto mask = vector<float>(count);
+    for (auto idx = 0; idx < count; idx++)
+      mask[idx] = (ranks[idx] + 0.5f) / count;
+    return mask;
+  }();
+  return mask;
+}
+
+// Init a sampler for a sample of a pixel.
+inline sampler_state make_sampler(sampler_sequence sequence, uint64_t seed,
+    const vec2i& ij, const vec2i& size, int sample, int samples) {
+  auto sampler     = sampler_state{};
+  auto pixel       = (uint64_t)ij.y * (uint64_t)size.x + ij.x;
+  sampler.sequence = sequence;
+  sampler.pixel    = ij;
+  switch (sequence) {
+    case sampler_sequence::random: {
+      sampler.rng = make_rng(seed, pixel, sample);
+    } break;
+    case sampler_sequence::sobol: {
+      sampler.index = sample;
+      sampler.seed  = (uint32_t)_hash_rng(seed ^ _hash_rng(pixel));
+    } break;
+    case sampler_sequence::zsobol: {
+      auto log2_size = 0;
+      while ((1 << log2_size) < max(size.x, size.y)) log2_size++;
+      while ((1 << sampler.log2_samples) < max(samples, sample + 1))
+        sampler.log2_samples++;
+      sampler.digits = log2_size + (sampler.log2_samples + 1) / 2;
+      sampler.index  = (_encode_morton(ij.x, ij.y) << sampler.log2_samples) |
+                      (uint64_t)sample;
+      sampler.seed = (uint32_t)_hash_rng(seed);
+    } break;
+    case sampler_sequence::bluenoise: {
+      sampler.index = sample;
+      sampler.seed  = (uint32_t)_hash_rng(seed);
+    } break;
+  }
+  return sampler;
+}
+
+// Point of the first two dimensions of an Owen-scrambled Sobol sequence,
+// drawn for the current dimension of a sampler.
+inline vec2f _sample_sobol(const sampler_state& sampler) {
+  auto seed = _hash_rng(sampler.seed, sampler.dimension);
+  switch (sampler.sequence) {
+    case sampler_sequence::zsobol: {
+      // Sobol points use the low 32 bits of the index, so the higher bits
+      // of large images and sample counts select the scrambling instead
+      auto index = _zsobol_index(sampler);
+      if ((index >> 32) != 0)
+        seed = _hash_rng(seed, (uint32_t)_hash_rng(index >> 32));
+      return {_uint_to_float(_owen_scramble(_sobol((uint32_t)index, 0), seed)),
+          _uint_to_float(
+              _owen_scramble(_sobol((uint32_t)index, 1), seed ^ 1))};
+    }
+    case sampler_sequence::bluenoise: {
+      auto& mask   = _bluenoise_mask();
+      auto  offset = _hash_rng(seed, 0xb10e);
+      auto  lookup = [&](uint32_t shift) {
+        auto x = (sampler.pixel.x + (shift & 63)) & 63;
+        auto y = (sampler.pixel.y + ((shift >> 6) & 63)) & 63;
+        return mask[y * 64 + x];
+      };
+      auto index = _owen_scramble((uint32_t)sampler.index, seed ^ 2);
+      auto x     = _uint_to_float(_owen_scramble(_sobol(index, 0), seed)) +
+               lookup(offset);
+      auto y = _uint_to_float(_owen_scramble(_sobol(index, 1), seed ^ 1)) +
+               lookup(offset >> 12);
+      return {x < 1 ? x : x - 1, y < 1 ? y : y - 1};
+    }
+    default: {
+      auto index = _owen_scramble((uint32_t)sampler.index, seed ^ 2);
+      return {_uint_to_float(_owen_scramble(_sobol(index, 0), seed)),
+          _uint_to_float(_owen_scramble(_sobol(index, 1), seed ^ 1))};
+    }
+  }
+}
+
+// Next dimensions: floats in [0,1), ints in [0,n).
+inline int rand1i(sampler_state& sampler, int n) {
+  return min((int)(rand1f(sampler) * n), n - 1);
+}
+inline float rand1f(sampler_state& sampler) {
+  if (sampler.sequence == sampler_sequence::random) return rand1f(sampler.rng);
+  auto value = _sample_sobol(sampler).x;
+  sampler.dimension += 1;
+  return value;
+}
+inline vec2f rand2f(sampler_state& sampler) {
+  if (sampler.sequence == sampler_sequence::random) return rand2f(sampler.rng);
+  auto value = _sample_sobol(sampler);
+  sampler.dimension += 2;
+  return value;
+}
+
+// Skip to the next group of dimensions.
+inline void next_dimensions(sampler_state& sampler, int count) {
+  sampler.dimension = (sampler.dimension + count - 1) / count * count;
+}
+
+}  // namespace yocto
+
 // -----------------------------------------------------------------------------
 // IMPLEMENTATION OF MONETACARLO SAMPLING FUNCTIONS
 // -----------------------------------------------------------------------------
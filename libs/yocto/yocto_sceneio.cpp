@@ -207,6 +207,7 @@ vector<string> scene_validation(const sceneio_scene* scene, bool notextures) {
   check_names(scene->cameras, "camera");
   check_names(scene->shapes, "shape");
   check_names(scene->instances, "instance");
+  check_names(scene->groups, "group");
   check_names(scene->textures, "texture");
   check_names(scene->environments, "environment");
   if (!notextures) check_empty_textures(scene->textures);
@@ -228,6 +229,7 @@ sceneio_scene::~sceneio_scene() {
   for (auto instance : instances) delete instance;
   for (auto texture : textures) delete texture;
   for (auto environment : environments) delete environment;
+  for (auto group : groups) delete group;
 }
 
 // add an element
@@ -259,6 +261,9 @@ sceneio_instance* add_instance(sceneio_scene* scene, const string& name) {
 sceneio_material* add_material(sceneio_scene* scene, const string& name) {
   return add_element(scene->materials, name, "material");
 }
+sceneio_group* add_group(sceneio_scene* scene, const string& name) {
+  return add_element(scene->groups, name, "group");
+}
 sceneio_instance* add_complete_instance(
     sceneio_scene* scene, const string& name) {
   auto instance      = add_instance(scene, name);
@@ -321,6 +326,30 @@ void add_sky(sceneio_scene* scene, float sun_angle) {
   environment->emission_tex = texture;
 }
 
+// Flatten instance groups.
+void flatten_instances(sceneio_scene* scene) {
+  if (scene->groups.empty()) return;
+  auto instances = scene->instances;
+  scene->instances.clear();
+  for (auto instance : instances) {
+    if (instance->group == nullptr) {
+      scene->instances.push_back(instance);
+      continue;
+    }
+    for (auto& frame : instance->group->frames) {
+      auto ninstance          = add_instance(scene, instance->name);
+      ninstance->frame        = instance->frame * frame;
+      ninstance->shape        = instance->shape;
+      ninstance->material     = instance->material;
+      ninstance->moving       = instance->moving;
+      ninstance->motion_frame = instance->motion_frame * frame;
+    }
+    delete instance;
+  }
+  for (auto group : scene->groups) delete group;
+  scene->groups.clear();
+}
+
 // get named camera or default if camera is empty
 sceneio_camera* get_camera(const sceneio_scene* scene, const string& name) {
   if (scene->cameras.empty()) return nullptr;
@@ -341,18 +370,39 @@ sceneio_camera* get_camera(const sceneio_scene* scene, const string& name) {
 
 // Updates the scene and scene's instances bounding boxes
 bbox3f compute_bounds(const sceneio_scene* scene) {
+  auto merge_bbox = [](const bbox3f& a, const bbox3f& b) {
+    return merge(a, b);
+  };
   auto shape_bbox = unordered_map<sceneio_shape*, bbox3f>{};
-  auto bbox       = invalidb3f;
   for (auto shape : scene->shapes) {
-    auto sbvh = invalidb3f;
-    for (auto p : shape->positions) sbvh = merge(sbvh, p);
-    shape_bbox[shape] = sbvh;
-  }
-  for (auto instance : scene->instances) {
-    auto sbvh = shape_bbox[instance->shape];
-    bbox      = merge(bbox, transform_bbox(instance->frame, sbvh));
-  }
-  return bbox;
+    shape_bbox[shape] = parallel_reduce(
+        shape->positions.size(), invalidb3f,
+        [shape](size_t start, size_t end) {
+          auto sbbox = invalidb3f;
+          for (auto idx = start; idx < end; idx++)
+            sbbox = merge(sbbox, shape->positions[idx]);
+          return sbbox;
+        },
+        merge_bbox);
+  }
+  return parallel_reduce(
+      scene->instances.size(), invalidb3f,
+      [scene, &shape_bbox](size_t start, size_t end) {
+        auto bbox = invalidb3f;
+        for (auto idx = start; idx < end; idx++) {
+          auto instance = scene->instances[idx];
+          auto sbbox    = shape_bbox.at(instance->shape);
+          if (instance->group == nullptr) {
+            bbox = merge(bbox, transform_bbox(instance->frame, sbbox));
+          } else {
+            for (auto& frame : instance->group->frames)
+              bbox = merge(bbox,
+                  transform_bbox(instance->frame * frame, sbbox));
+          }
+        }
+        return bbox;
+      },
+      merge_bbox);
 }
 
 // Clone a scene
@@ -383,6 +433,9 @@ void trim_memory(sceneio_scene* scene) {
     texture->hdr.shrink_to_fit();
     texture->ldr.shrink_to_fit();
   }
+  for (auto group : scene->groups) {
+    group->frames.shrink_to_fit();
+  }
   scene->cameras.shrink_to_fit();
   scene->shapes.shrink_to_fit();
   scene->textures.shrink_to_fit();
@@ -536,13 +589,15 @@ void tesselate_shape(sceneio_shape* shape) {
   }
 }  // namespace yocto
 
-void tesselate_shapes(
-    sceneio_scene* scene, const progress_callback& progress_cb) {
+void tesselate_shapes(sceneio_scene* scene,
+    const progress_callback& progress_cb, cancel_token* cancel) {
   // handle progress
   auto progress = vec2i{0, (int)scene->shapes.size()};
 
   // tesselate shapes
   for (auto shape : scene->shapes) {
+    if (is_canceled(cancel)) return;
+    set_progress(cancel, progress.x, progress.y);
     if (progress_cb) progress_cb("tesselate shape", progress.x++, progress.y);
     tesselate_shape(shape);
   }
@@ -1015,31 +1070,36 @@ namespace yocto {
 
 // Load/save a scene in the builtin JSON format.
 static bool load_json_scene(const string& filename, sceneio_scene* scene,
-    string& error, const progress_callback& progress_cb, bool noparallel);
+    string& error, const progress_callback& progress_cb, bool noparallel,
+    cancel_token* cancel);
 static bool save_json_scene(const string& filename, const sceneio_scene* scene,
     string& error, const progress_callback& progress_cb, bool noparallel);
 
 // Load/save a scene from/to OBJ.
 static bool load_obj_scene(const string& filename, sceneio_scene* scene,
-    string& error, const progress_callback& progress_cb, bool noparallel);
+    string& error, const progress_callback& progress_cb, bool noparallel,
+    cancel_token* cancel);
 static bool save_obj_scene(const string& filename, const sceneio_scene* scene,
     string& error, const progress_callback& progress_cb, bool noparallel);
 
 // Load/save a scene from/to PLY. Loads/saves only one mesh with no other data.
 static bool load_ply_scene(const string& filename, sceneio_scene* scene,
-    string& error, const progress_callback& progress_cb, bool noparallel);
+    string& error, const progress_callback& progress_cb, bool noparallel,
+    cancel_token* cancel);
 static bool save_ply_scene(const string& filename, const sceneio_scene* scene,
     string& error, const progress_callback& progress_cb, bool noparallel);
 
 // Load/save a scene from/to STL. Loads/saves only one mesh with no other data.
 static bool load_stl_scene(const string& filename, sceneio_scene* scene,
-    string& error, const progress_callback& progress_cb, bool noparallel);
+    string& error, const progress_callback& progress_cb, bool noparallel,
+    cancel_token* cancel);
 static bool save_stl_scene(const string& filename, const sceneio_scene* scene,
     string& error, const progress_callback& progress_cb, bool noparallel);
 
 // Load/save a scene from/to glTF.
 static bool load_gltf_scene(const string& filename, sceneio_scene* scene,
-    string& error, const progress_callback& progress_cb, bool noparallel);
+    string& error, const progress_callback& progress_cb, bool noparallel,
+    cancel_token* cancel);
 static bool save_gltf_scene(const string& filename, const sceneio_scene* scene,
     string& error, const progress_callback& progress_cb, bool noparallel);
 
@@ -1047,31 +1107,49 @@ static bool save_gltf_scene(const string& filename, const sceneio_scene* scene,
 // works on scene that have been previously adapted since the two renderers
 // are too different to match.
 static bool load_pbrt_scene(const string& filename, sceneio_scene* scene,
-    string& error, const progress_callback& progress_cb, bool noparallel);
+    string& error, const progress_callback& progress_cb, bool noparallel,
+    cancel_token* cancel);
 static bool save_pbrt_scene(const string& filename, const sceneio_scene* scene,
     string& error, const progress_callback& progress_cb, bool noparallel);
 
 // Load a scene
 bool load_scene(const string& filename, sceneio_scene* scene, string& error,
-    const progress_callback& progress_cb, bool noparallel) {
+    const progress_callback& progress_cb_, bool noparallel,
+    cancel_token* cancel) {
   auto format_error = [filename, &error]() {
     error = filename + ": unknown format";
     return false;
   };
 
+  // report progress also in the cancel token
+  auto progress_cb = progress_cb_;
+  if (cancel) {
+    progress_cb = [progress_cb_, cancel](
+                      const string& message, int current, int total) {
+      set_progress(cancel, current, total);
+      if (progress_cb_) progress_cb_(message, current, total);
+    };
+  }
+
   auto ext = path_extension(filename);
   if (ext == ".json" || ext == ".JSON") {
-    return load_json_scene(filename, scene, error, progress_cb, noparallel);
+    return load_json_scene(
+        filename, scene, error, progress_cb, noparallel, cancel);
   } else if (ext == ".obj" || ext == ".OBJ") {
-    return load_obj_scene(filename, scene, error, progress_cb, noparallel);
+    return load_obj_scene(
+        filename, scene, error, progress_cb, noparallel, cancel);
   } else if (ext == ".gltf" || ext == ".GLTF") {
-    return load_gltf_scene(filename, scene, error, progress_cb, noparallel);
+    return load_gltf_scene(
+        filename, scene, error, progress_cb, noparallel, cancel);
   } else if (ext == ".pbrt" || ext == ".PBRT") {
-    return load_pbrt_scene(filename, scene, error, progress_cb, noparallel);
+    return load_pbrt_scene(
+        filename, scene, error, progress_cb, noparallel, cancel);
   } else if (ext == ".ply" || ext == ".PLY") {
-    return load_ply_scene(filename, scene, error, progress_cb, noparallel);
+    return load_ply_scene(
+        filename, scene, error, progress_cb, noparallel, cancel);
   } else if (ext == ".stl" || ext == ".STL") {
-    return load_stl_scene(filename, scene, error, progress_cb, noparallel);
+    return load_stl_scene(
+        filename, scene, error, progress_cb, noparallel, cancel);
   } else {
     return format_error();
   }
@@ -1084,8 +1162,15 @@ bool save_scene(const string& filename, const sceneio_scene* scene,
     error = filename + ": unknown format";
     return false;
   };
+  auto group_error = [filename, &error]() {
+    error = filename + ": instance groups not supported";
+    return false;
+  };
 
   auto ext = path_extension(filename);
+  if (!scene->groups.empty() && ext != ".json" && ext != ".JSON" &&
+      ext != ".pbrt" && ext != ".PBRT")
+    return group_error();
   if (ext == ".json" || ext == ".JSON") {
     return save_json_scene(filename, scene, error, progress_cb, noparallel);
   } else if (ext == ".obj" || ext == ".OBJ") {
@@ -1189,6 +1274,9 @@ inline void from_json(const njson& j, frame3f& value) {
 #endif
 
 // support for json conversions
+inline bool set_value(json_tview js, const vec2f& value) {
+  return set_value(js, (const array<float, 2>&)value);
+}
 inline bool set_value(json_tview js, const vec3f& value) {
   return set_value(js, (const array<float, 3>&)value);
 }
@@ -1202,6 +1290,9 @@ inline bool set_value(json_tview js, const mat4f& value) {
   return set_value(js, (const array<float, 16>&)value);
 }
 
+inline bool get_value(json_ctview js, vec2f& value) {
+  return get_value(js, (array<float, 2>&)value);
+}
 inline bool get_value(json_ctview js, vec3f& value) {
   return get_value(js, (array<float, 3>&)value);
 }
@@ -1221,7 +1312,8 @@ namespace yocto {
 
 // Save a scene in the builtin JSON format.
 static bool load_json_scene(const string& filename, sceneio_scene* scene,
-    string& error, const progress_callback& progress_cb, bool noparallel) {
+    string& error, const progress_callback& progress_cb, bool noparallel,
+    cancel_token* cancel) {
   auto json_error = [filename]() {
     // error does not need setting
     return false;
@@ -1234,10 +1326,18 @@ static bool load_json_scene(const string& filename, sceneio_scene* scene,
     error = filename + ": missing material " + string{name};
     return false;
   };
+  auto group_error = [filename, &error](string_view name) {
+    error = filename + ": unsupported moving instance group " + string{name};
+    return false;
+  };
   auto dependent_error = [filename, &error]() {
     error = filename + ": error in " + error;
     return false;
   };
+  auto canceled_error = [filename, &error]() {
+    error = filename + ": canceled";
+    return false;
+  };
 
   // handle progress
   auto progress = vec2i{0, 2};
@@ -1304,28 +1404,20 @@ static bool load_json_scene(const string& filename, sceneio_scene* scene,
     return true;
   };
 
-  struct ply_instance {
-    vector<frame3f> frames = {};
-  };
-
-  // load json instance
-  auto ply_instances     = vector<unique_ptr<ply_instance>>{};
-  auto ply_instance_map  = unordered_map<string, ply_instance*>{{"", nullptr}};
-  auto instance_ply      = unordered_map<sceneio_instance*, ply_instance*>{};
-  auto get_ply_instances = [&ply_instances, &ply_instance_map, &instance_ply](
-                               json_ctview       js,
-                               sceneio_instance* instance) -> bool {
+  // load json instance groups
+  auto group_map = unordered_map<string, sceneio_group*>{{"", nullptr}};
+  auto get_group = [scene, &group_map](
+                       json_ctview js, sceneio_group*& value) -> bool {
     auto name = ""s;
     if (!get_value(js, name)) return false;
-    if (name.empty()) return true;
-    auto it = ply_instance_map.find(name);
-    if (it != ply_instance_map.end()) {
-      instance_ply[instance] = it->second;
+    auto it = group_map.find(name);
+    if (it != group_map.end()) {
+      value = it->second;
       return true;
     }
-    auto ply_instance_ = ply_instances.emplace_back(new ply_instance()).get();
-    ply_instance_map[name] = ply_instance_;
-    instance_ply[instance] = ply_instance_;
+    auto group      = add_group(scene, name);
+    group_map[name] = group;
+    value           = group;
     return true;
   };
 
@@ -1366,6 +1458,8 @@ static bool load_json_scene(const string& filename, sceneio_scene* scene,
             get_value(value, camera->focus);
           } else if (key == "aperture") {
             get_value(value, camera->aperture);
+          } else if (key == "shutter") {
+            get_value(value, camera->shutter);
           } else if (key == "lookat") {
             get_value(value, (mat3f&)camera->frame);
             camera->focus = length(camera->frame.x - camera->frame.y);
@@ -1468,12 +1562,15 @@ static bool load_json_scene(const string& filename, sceneio_scene* scene,
             get_value(value, (mat3f&)instance->frame);
             instance->frame = lookat_frame(
                 instance->frame.x, instance->frame.y, instance->frame.z, true);
+          } else if (key == "motion_frame") {
+            get_value(value, instance->motion_frame);
+            instance->moving = true;
           } else if (key == "material") {
             get_material(value, instance->material);
           } else if (key == "shape") {
             get_shape(value, instance->shape);
           } else if (key == "instance") {
-            get_ply_instances(value, instance);
+            get_group(value, instance->group);
           } else if (key == "subdivisions") {
             if (instance->shape) {
               get_value(value, instance->shape->subdivisions);
@@ -1495,7 +1592,7 @@ static bool load_json_scene(const string& filename, sceneio_scene* scene,
               get_texture(value, instance->shape->displacement_tex);
             }
           } else if (key == "instance") {
-            get_ply_instances(value, instance);
+            get_group(value, instance->group);
           } else {
             // set_error(element, "unknown key " + string{key});
           }
@@ -1517,7 +1614,7 @@ static bool load_json_scene(const string& filename, sceneio_scene* scene,
   // handle progress
   progress.y += scene->shapes.size();
   progress.y += scene->textures.size();
-  progress.y += ply_instances.size();
+  progress.y += scene->groups.size();
 
   // get filename from name
   auto make_filename = [filename](const string& name, const string& group,
@@ -1534,6 +1631,7 @@ static bool load_json_scene(const string& filename, sceneio_scene* scene,
   shape_map.erase("");
   for (auto [name, value] : shape_map) {
     auto shape = value.first;
+    if (is_canceled(cancel)) return canceled_error();
     if (progress_cb) progress_cb("load shape", progress.x++, progress.y);
     auto path = make_filename(name, "shapes", {".ply", ".obj"});
     if (!load_shape(path, shape->points, shape->lines, shape->triangles,
@@ -1547,6 +1645,7 @@ static bool load_json_scene(const string& filename, sceneio_scene* scene,
   texture_map.erase("");
   for (auto [name, value] : texture_map) {
     auto texture = value.first;
+    if (is_canceled(cancel)) return canceled_error();
     if (progress_cb) progress_cb("load texture", progress.x++, progress.y);
     auto path = make_filename(
         name, "textures", {".hdr", ".exr", ".png", ".jpg"});
@@ -1554,38 +1653,34 @@ static bool load_json_scene(const string& filename, sceneio_scene* scene,
       return dependent_error();
   }
 
-  // load instances
-  ply_instance_map.erase("");
-  for (auto [name, instance] : ply_instance_map) {
+  // load instance groups, that are kept unflattened
+  for (auto group : scene->groups) {
+    if (is_canceled(cancel)) return canceled_error();
     if (progress_cb) progress_cb("load instance", progress.x++, progress.y);
-    auto path = make_filename(name, "instances", {".ply"});
-    if (!load_instance(path, instance->frames, error)) return dependent_error();
-  }
-
-  // apply instances
-  if (!ply_instances.empty()) {
-    if (progress_cb)
-      progress_cb("flatten instances", progress.x++, progress.y++);
-    auto instances = scene->instances;
-    scene->instances.clear();
-    for (auto instance : instances) {
-      auto it = instance_ply.find(instance);
-      if (it == instance_ply.end()) {
-        auto ninstance      = add_instance(scene, instance->name);
-        ninstance->frame    = instance->frame;
-        ninstance->shape    = instance->shape;
-        ninstance->material = instance->material;
-      } else {
-        auto ply_instance = it->second;
-        for (auto& frame : ply_instance->frames) {
-          auto ninstance      = add_instance(scene, instance->name);
-          ninstance->frame    = frame * instance->frame;
-          ninstance->shape    = instance->shape;
-          ninstance->material = instance->material;
-        }
-      }
+    auto path = make_filename(group->name, "instances", {".ply"});
+    if (!load_instance(path, group->frames, error)) return dependent_error();
+  }
+
+  // in Json scenes, group frames are applied after the instance frame, so
+  // instance frames are folded into the group frames, copying the groups
+  // shared by other instances
+  auto group_uses = unordered_map<sceneio_group*, int>{};
+  for (auto instance : scene->instances) {
+    if (instance->group != nullptr) group_uses[instance->group] += 1;
+  }
+  for (auto instance : scene->instances) {
+    if (instance->group == nullptr) continue;
+    if (instance->moving) return group_error(instance->group->name);
+    if (instance->frame == identity3x4f) continue;
+    auto group = instance->group;
+    if (group_uses.at(group) > 1) {
+      group_uses.at(group) -= 1;
+      group           = add_group(scene, group->name + "-" + instance->name);
+      group->frames   = instance->group->frames;
+      instance->group = group;
     }
-    for (auto instance : instances) delete instance;
+    for (auto& frame : group->frames) frame = frame * instance->frame;
+    instance->frame = identity3x4f;
   }
 
   // fix scene
@@ -1613,12 +1708,26 @@ static bool save_json_scene(const string& filename, const sceneio_scene* scene,
     error = filename + ": error in " + error;
     return false;
   };
+  auto group_error = [filename, &error](string_view name) {
+    error = filename + ": unsupported frame for instance group " +
+            string{name};
+    return false;
+  };
 
   // handle progress
   auto progress = vec2i{
-      0, 2 + (int)scene->shapes.size() + (int)scene->textures.size()};
+      0, 2 + (int)scene->shapes.size() + (int)scene->textures.size() +
+             (int)scene->groups.size()};
   if (progress_cb) progress_cb("save scene", progress.x++, progress.y);
 
+  // in Json scenes, group frames are applied after the instance frame, so
+  // grouped instances cannot be saved with frames that place the group
+  for (auto instance : scene->instances) {
+    if (instance->group == nullptr) continue;
+    if (instance->moving || instance->frame != identity3x4f)
+      return group_error(instance->group->name);
+  }
+
   // save json file
   auto js_tree = json_tree{};
   auto js      = get_root(js_tree);
@@ -1661,6 +1770,9 @@ static bool save_json_scene(const string& filename, const sceneio_scene* scene,
       if (camera->aperture != def_cam.aperture) {
         insert_value(elemnt, "aperture", camera->aperture);
       }
+      if (camera->shutter != def_cam.shutter) {
+        insert_value(elemnt, "shutter", camera->shutter);
+      }
     }
   }
 
@@ -1775,12 +1887,18 @@ static bool save_json_scene(const string& filename, const sceneio_scene* scene,
       if (instance->frame != def_instance.frame) {
         insert_value(elment, "frame", instance->frame);
       }
+      if (instance->moving) {
+        insert_value(elment, "motion_frame", instance->motion_frame);
+      }
       if (instance->shape != nullptr) {
         insert_value(elment, "shape", instance->shape->name);
       }
       if (instance->material != nullptr) {
         insert_value(elment, "material", instance->material->name);
       }
+      if (instance->group != nullptr) {
+        insert_value(elment, "instance", instance->group->name);
+      }
       if (instance->shape != nullptr) {
         if (instance->shape->subdivisions != def_shape.subdivisions) {
           insert_value(elment, "subdivisions", instance->shape->subdivisions);
@@ -1839,6 +1957,13 @@ static bool save_json_scene(const string& filename, const sceneio_scene* scene,
       return dependent_error();
   }
 
+  // save instance groups
+  for (auto group : scene->groups) {
+    if (progress_cb) progress_cb("save instance", progress.x++, progress.y);
+    auto path = make_filename(group->name, "instances", ".ply");
+    if (!save_instance(path, group->frames, error)) return dependent_error();
+  }
+
   // done
   if (progress_cb) progress_cb("save done", progress.x++, progress.y);
   return true;
@@ -1853,7 +1978,8 @@ namespace yocto {
 
 // Loads an OBJ
 static bool load_obj_scene(const string& filename, sceneio_scene* scene,
-    string& error, const progress_callback& progress_cb, bool noparallel) {
+    string& error, const progress_callback& progress_cb, bool noparallel,
+    cancel_token* cancel) {
   auto shape_error = [filename, &error]() {
     error = filename + ": empty shape";
     return false;
@@ -1866,6 +1992,10 @@ static bool load_obj_scene(const string& filename, sceneio_scene* scene,
     error = filename + ": error in " + error;
     return false;
   };
+  auto canceled_error = [filename, &error]() {
+    error = filename + ": canceled";
+    return false;
+  };
 
   // handle progress
   auto progress = vec2i{0, 2};
@@ -2012,6 +2142,7 @@ static bool load_obj_scene(const string& filename, sceneio_scene* scene,
   // load textures
   ctexture_map.erase("");
   for (auto [name, texture] : ctexture_map) {
+    if (is_canceled(cancel)) return canceled_error();
     if (progress_cb) progress_cb("load texture", progress.x++, progress.y);
     if (!load_image(make_filename(name), texture->hdr, texture->ldr, error))
       return dependent_error();
@@ -2020,6 +2151,7 @@ static bool load_obj_scene(const string& filename, sceneio_scene* scene,
   // load textures
   stexture_map.erase("");
   for (auto [name, texture] : stexture_map) {
+    if (is_canceled(cancel)) return canceled_error();
     if (progress_cb) progress_cb("load texture", progress.x++, progress.y);
     if (!load_image(make_filename(name), texture->hdr, texture->ldr, error))
       return dependent_error();
@@ -2184,7 +2316,8 @@ void print_obj_camera(sceneio_camera* camera) {
 namespace yocto {
 
 static bool load_ply_scene(const string& filename, sceneio_scene* scene,
-    string& error, const progress_callback& progress_cb, bool noparallel) {
+    string& error, const progress_callback& progress_cb, bool noparallel,
+    cancel_token*) {
   // handle progress
   auto progress = vec2i{0, 1};
   if (progress_cb) progress_cb("load scene", progress.x++, progress.y);
@@ -2245,7 +2378,8 @@ static bool save_ply_scene(const string& filename, const sceneio_scene* scene,
 namespace yocto {
 
 static bool load_stl_scene(const string& filename, sceneio_scene* scene,
-    string& error, const progress_callback& progress_cb, bool noparallel) {
+    string& error, const progress_callback& progress_cb, bool noparallel,
+    cancel_token*) {
   // handle progress
   auto progress = vec2i{0, 1};
   if (progress_cb) progress_cb("load scene", progress.x++, progress.y);
@@ -2307,7 +2441,8 @@ namespace yocto {
 
 // Load a scene
 static bool load_gltf_scene(const string& filename, sceneio_scene* scene,
-    string& error, const progress_callback& progress_cb, bool noparallel) {
+    string& error, const progress_callback& progress_cb, bool noparallel,
+    cancel_token* cancel) {
   auto read_error = [filename, &error]() {
     error = filename + ": read error";
     return false;
@@ -2320,6 +2455,10 @@ static bool load_gltf_scene(const string& filename, sceneio_scene* scene,
     error = filename + ": error in " + error;
     return false;
   };
+  auto canceled_error = [filename, &error]() {
+    error = filename + ": canceled";
+    return false;
+  };
 
   // handle progress
   auto progress = vec2i{0, 3};
@@ -2671,6 +2810,7 @@ static bool load_gltf_scene(const string& filename, sceneio_scene* scene,
   // load texture
   ctexture_map.erase("");
   for (auto [tpath, texture] : ctexture_map) {
+    if (is_canceled(cancel)) return canceled_error();
     if (progress_cb) progress_cb("load texture", progress.x++, progress.y);
     if (!load_image(path_join(path_dirname(filename), tpath), texture->hdr,
             texture->ldr, error))
@@ -2680,6 +2820,7 @@ static bool load_gltf_scene(const string& filename, sceneio_scene* scene,
   // load texture
   cotexture_map.erase("");
   for (auto [tpath, textures] : cotexture_map) {
+    if (is_canceled(cancel)) return canceled_error();
     if (progress_cb) progress_cb("load texture", progress.x++, progress.y);
     auto color_opacityf = image<vec4f>{};
     auto color_opacityb = image<vec4b>{};
@@ -2723,6 +2864,7 @@ static bool load_gltf_scene(const string& filename, sceneio_scene* scene,
   // load texture
   mrtexture_map.erase("");
   for (auto [tpath, textures] : mrtexture_map) {
+    if (is_canceled(cancel)) return canceled_error();
     if (progress_cb) progress_cb("load texture", progress.x++, progress.y);
     auto metallic_roughnessf = image<vec4f>{};
     auto metallic_roughnessb = image<vec4b>{};
@@ -3150,11 +3292,16 @@ namespace yocto {
 
 // load pbrt scenes
 static bool load_pbrt_scene(const string& filename, sceneio_scene* scene,
-    string& error, const progress_callback& progress_cb, bool noparallel) {
+    string& error, const progress_callback& progress_cb, bool noparallel,
+    cancel_token* cancel) {
   auto dependent_error = [filename, &error]() {
     error = filename + ": error in " + error;
     return false;
   };
+  auto canceled_error = [filename, &error]() {
+    error = filename + ": canceled";
+    return false;
+  };
 
   // handle progress
   auto progress = vec2i{0, 2};
@@ -3241,19 +3388,15 @@ static bool load_pbrt_scene(const string& filename, sceneio_scene* scene,
     shape->texcoords = pshape->texcoords;
     shape->triangles = pshape->triangles;
     for (auto& uv : shape->texcoords) uv.y = 1 - uv.y;
-    auto material = material_map.at(pshape->material);
-    if (pshape->instances.empty()) {
-      auto instance      = add_instance(scene);
-      instance->frame    = pshape->frame;
-      instance->shape    = shape;
-      instance->material = material;
-    } else {
-      for (auto frame : pshape->instances) {
-        auto instance      = add_instance(scene);
-        instance->frame    = frame * pshape->frame;
-        instance->shape    = shape;
-        instance->material = material;
-      }
+    auto instance      = add_instance(scene);
+    instance->frame    = pshape->frame;
+    instance->shape    = shape;
+    instance->material = material_map.at(pshape->material);
+    if (!pshape->instances.empty()) {
+      instance->frame = identity3x4f;
+      instance->group = add_group(scene);
+      for (auto& frame : pshape->instances)
+        instance->group->frames.push_back(frame * pshape->frame);
     }
   }
 
@@ -3288,6 +3431,7 @@ static bool load_pbrt_scene(const string& filename, sceneio_scene* scene,
   // load texture
   ctexture_map.erase("");
   for (auto [name, texture] : ctexture_map) {
+    if (is_canceled(cancel)) return canceled_error();
     if (progress_cb) progress_cb("load texture", progress.x++, progress.y);
     if (!load_image(make_filename(name), texture->hdr, texture->ldr, error))
       return dependent_error();
@@ -3296,6 +3440,7 @@ static bool load_pbrt_scene(const string& filename, sceneio_scene* scene,
   // load texture
   stexture_map.erase("");
   for (auto [name, texture] : stexture_map) {
+    if (is_canceled(cancel)) return canceled_error();
     if (progress_cb) progress_cb("load texture", progress.x++, progress.y);
     if (!load_image(make_filename(name), texture->hdr, texture->ldr, error))
       return dependent_error();
@@ -3304,6 +3449,7 @@ static bool load_pbrt_scene(const string& filename, sceneio_scene* scene,
   // load alpha
   atexture_map.erase("");
   for (auto [name, texture] : atexture_map) {
+    if (is_canceled(cancel)) return canceled_error();
     if (progress_cb) progress_cb("load texture", progress.x++, progress.y);
     if (!load_image(make_filename(name), texture->hdr, texture->ldr, error))
       return dependent_error();
@@ -3382,6 +3528,12 @@ static bool save_pbrt_scene(const string& filename, const sceneio_scene* scene,
     pshape->frame     = instance->frame;
     pshape->frend     = instance->frame;
     pshape->material  = material_map.at(instance->material);
+    if (instance->group != nullptr) {
+      pshape->frame = identity3x4f;
+      pshape->frend = identity3x4f;
+      for (auto& frame : instance->group->frames)
+        pshape->instances.push_back(instance->frame * frame);
+    }
   }
 
   // convert environments
@@ -81,6 +81,8 @@ namespace yocto {
 // 2.4:1  on 35 mm:  0.036 x 0.015   or 0.05760 x 0.024 (approx. 2.39 : 1)
 // To compute good apertures, one can use the F-stop number from photography
 // and set the aperture to focal length over f-stop.
+// For motion blur, the shutter interval gives the times at which the camera
+// samples moving instances, with 0 and 1 at their frames and motion frames.
 struct sceneio_camera {
   string  name         = "";
   frame3f frame        = identity3x4f;
@@ -90,6 +92,7 @@ struct sceneio_camera {
   float   aspect       = 1.500;
   float   focus        = 10000;
   float   aperture     = 0;
+  vec2f   shutter      = {0, 0};
 };
 
 // Texture containing either an LDR or HDR image. HdR images are encoded
@@ -180,13 +183,28 @@ struct sceneio_shape {
   vector<float> elements_cdf = {};
 };
 
-// Object.
+// Instance group, with the frames at which instances are replicated. Groups
+// are shared by instances, so that large instanced sets, like the trees of a
+// forest, are stored once and are not flattened into many instances.
+struct sceneio_group {
+  string          name   = "";
+  vector<frame3f> frames = {};
+};
+
+// Object. Instances of a group are replicated at each group frame, with the
+// instance frame placing the whole group. Moving instances go from `frame` to
+// `motion_frame` over the camera shutter. Json scenes instead apply group
+// frames after the instance frame, so their instance frames are folded into
+// the group frames on load, and moving groups are not supported there.
 struct sceneio_instance {
   // instance data
-  string            name     = "";
-  frame3f           frame    = identity3x4f;
-  sceneio_shape*    shape    = nullptr;
-  sceneio_material* material = nullptr;
+  string            name         = "";
+  frame3f           frame        = identity3x4f;
+  sceneio_shape*    shape        = nullptr;
+  sceneio_material* material     = nullptr;
+  sceneio_group*    group        = nullptr;
+  bool              moving       = false;
+  frame3f           motion_frame = identity3x4f;
 };
 
 // Environment map.
@@ -219,6 +237,7 @@ struct sceneio_scene {
   vector<sceneio_shape*>       shapes       = {};
   vector<sceneio_texture*>     textures     = {};
   vector<sceneio_material*>    materials    = {};
+  vector<sceneio_group*>       groups       = {};
 
   // cleanup
   ~sceneio_scene();
@@ -239,6 +258,7 @@ sceneio_instance* add_instance(sceneio_scene* scene, const string& name = "");
 sceneio_material* add_material(sceneio_scene* scene, const string& name = "");
 sceneio_shape*    add_shape(sceneio_scene* scene, const string& name = "");
 sceneio_texture*  add_texture(sceneio_scene* scene, const string& name = "");
+sceneio_group*    add_group(sceneio_scene* scene, const string& name = "");
 sceneio_instance* add_complete_instance(
     sceneio_scene* scene, const string& name);
 
@@ -248,6 +268,10 @@ void add_radius(sceneio_scene* scene, float radius = 0.001f);
 void add_materials(sceneio_scene* scene);
 void add_sky(sceneio_scene* scene, float sun_angle = pif / 4);
 
+// Flatten instance groups, replacing each instance of a group with an
+// instance for each group frame, for formats and apps without groups.
+void flatten_instances(sceneio_scene* scene);
+
 // Trim all unused memory
 void trim_memory(sceneio_scene* scene);
 
@@ -268,10 +292,17 @@ namespace yocto {
 using progress_callback =
     function<void(const string& message, int current, int total)>;
 
+// Cancellation token from Yocto/Parallel
+struct cancel_token;
+
 // Load/save a scene in the supported formats. Throws on error.
 // Calls the progress callback, if defined, as we process more data.
+// Loading stops with an error if the optional cancel token is canceled.
+// Instance groups are kept by Json and Pbrt, and are not supported by the
+// other formats, so those scenes should be flattened before saving.
 bool load_scene(const string& filename, sceneio_scene* scene, string& error,
-    const progress_callback& progress_cb = {}, bool noparallel = false);
+    const progress_callback& progress_cb = {}, bool noparallel = false,
+    cancel_token* cancel = nullptr);
 bool save_scene(const string& filename, const sceneio_scene* scene,
     string& error, const progress_callback& progress_cb = {},
     bool noparallel = false);
@@ -283,9 +314,10 @@ bool save_scene(const string& filename, const sceneio_scene* scene,
 // -----------------------------------------------------------------------------
 namespace yocto {
 
-// Apply subdivision and displacement rules.
-void tesselate_shapes(
-    sceneio_scene* scene, const progress_callback& progress_cb = {});
+// Apply subdivision and displacement rules. Stops early, leaving some shapes
+// untesselated, if the optional cancel token is canceled.
+void tesselate_shapes(sceneio_scene* scene,
+    const progress_callback& progress_cb = {}, cancel_token* cancel = nullptr);
 void tesselate_shape(sceneio_shape* shape);
 
 }  // namespace yocto
@@ -42,6 +42,7 @@
 #include "yocto_geometry.h"
 #include "yocto_modelio.h"
 #include "yocto_noise.h"
+#include "yocto_parallel.h"
 #include "yocto_sampling.h"
 
 // -----------------------------------------------------------------------------
@@ -1979,11 +1980,13 @@ pair<int, float> sample_lines(const vector<float>& cdf, float re, float ru) {
 vector<float> sample_lines_cdf(
     const vector<vec2i>& lines, const vector<vec3f>& positions) {
   auto cdf = vector<float>(lines.size());
-  for (auto i = 0; i < cdf.size(); i++) {
-    auto l = lines[i];
-    auto w = line_length(positions[l.x], positions[l.y]);
-    cdf[i] = w + (i != 0 ? cdf[i - 1] : 0);
-  }
+  parallel_for_range(cdf.size(), (size_t)0, [&](size_t start, size_t end) {
+    for (auto i = start; i < end; i++) {
+      auto l = lines[i];
+      cdf[i] = line_length(positions[l.x], positions[l.y]);
+    }
+  });
+  parallel_inclusive_scan(cdf);
   return cdf;
 }
 
@@ -1995,11 +1998,13 @@ pair<int, vec2f> sample_triangles(
 vector<float> sample_triangles_cdf(
     const vector<vec3i>& triangles, const vector<vec3f>& positions) {
   auto cdf = vector<float>(triangles.size());
-  for (auto i = 0; i < cdf.size(); i++) {
-    auto t = triangles[i];
-    auto w = triangle_area(positions[t.x], positions[t.y], positions[t.z]);
-    cdf[i] = w + (i != 0 ? cdf[i - 1] : 0);
-  }
+  parallel_for_range(cdf.size(), (size_t)0, [&](size_t start, size_t end) {
+    for (auto i = start; i < end; i++) {
+      auto t = triangles[i];
+      cdf[i] = triangle_area(positions[t.x], positions[t.y], positions[t.z]);
+    }
+  });
+  parallel_inclusive_scan(cdf);
   return cdf;
 }
 
@@ -2020,12 +2025,14 @@ pair<int, vec2f> sample_quads(const vector<vec4i>& quads,
 vector<float> sample_quads_cdf(
     const vector<vec4i>& quads, const vector<vec3f>& positions) {
   auto cdf = vector<float>(quads.size());
-  for (auto i = 0; i < cdf.size(); i++) {
-    auto q = quads[i];
-    auto w = quad_area(
-        positions[q.x], positions[q.y], positions[q.z], positions[q.w]);
-    cdf[i] = w + (i ? cdf[i - 1] : 0);
-  }
+  parallel_for_range(cdf.size(), (size_t)0, [&](size_t start, size_t end) {
+    for (auto i = start; i < end; i++) {
+      auto q = quads[i];
+      cdf[i] = quad_area(
+          positions[q.x], positions[q.y], positions[q.z], positions[q.w]);
+    }
+  });
+  parallel_inclusive_scan(cdf);
   return cdf;
 }
 
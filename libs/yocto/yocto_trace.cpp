@@ -33,6 +33,7 @@
 #include <deque>
 #include <memory>
 #include <stdexcept>
+#include <unordered_map>
 #include <utility>
 
 #include "yocto_color.h"
@@ -50,6 +51,7 @@ namespace yocto {
 
 // using directives
 using std::deque;
+using std::unordered_map;
 using namespace std::string_literals;
 
 }  // namespace yocto
@@ -66,6 +68,7 @@ trace_scene::~trace_scene() {
   for (auto instance : instances) delete instance;
   for (auto texture : textures) delete texture;
   for (auto environment : environments) delete environment;
+  for (auto group : groups) delete group;
 }
 
 trace_lights::~trace_lights() {}
@@ -93,6 +96,9 @@ trace_instance* add_instance(trace_scene* scene) {
 trace_material* add_material(trace_scene* scene) {
   return scene->materials.emplace_back(new trace_material{});
 }
+trace_group* add_group(trace_scene* scene) {
+  return scene->groups.emplace_back(new trace_group{});
+}
 
 }  // namespace yocto
 
@@ -248,14 +254,16 @@ void tesselate_shape(trace_shape* shape) {
   }
 }
 
-void tesselate_shapes(
-    trace_scene* scene, const progress_callback& progress_cb) {
+void tesselate_shapes(trace_scene* scene, const progress_callback& progress_cb,
+    cancel_token* cancel) {
   // handle progress
   auto progress = vec2i{0, (int)scene->shapes.size() + 1};
   if (progress_cb) progress_cb("tesselate shape", progress.x++, progress.y);
 
   // tesselate shapes
   for (auto shape : scene->shapes) {
+    if (is_canceled(cancel)) return;
+    set_progress(cancel, progress.x, progress.y);
     if (progress_cb) progress_cb("tesselate shape", progress.x++, progress.y);
     tesselate_shape(shape);
   }
@@ -791,6 +799,30 @@ bool has_volume(const trace_instance* instance) {
   return !instance->material->thin && instance->material->transmission != 0;
 }
 
+// Instance at the given time and group frame. Moving and grouped instances
+// are posed in `posed`, that needs to outlive the returned pointer.
+static const trace_instance* eval_instance(const trace_instance* instance,
+    int subinstance, float time, trace_instance& posed) {
+  auto grouped = instance->group != nullptr && subinstance >= 0;
+  if (!grouped && !instance->moving) return instance;
+  posed = *instance;
+  if (instance->moving)
+    posed.frame = lerp(instance->frame, instance->motion_frame, time);
+  if (grouped) posed.frame = posed.frame * instance->group->frames[subinstance];
+  return &posed;
+}
+
+// Number of sampler dimensions reserved for the camera and for each bounce,
+// so that the same sampling decisions use the same dimensions.
+const auto trace_bounce_dimensions = 16;
+
+// Sample a time in the camera shutter interval. No random numbers are drawn
+// for cameras without motion blur.
+static float sample_shutter(const trace_camera* camera, sampler_state& rng) {
+  if (camera->shutter.x == camera->shutter.y) return camera->shutter.x;
+  return lerp(camera->shutter.x, camera->shutter.y, rand1f(rng));
+}
+
 // Sample camera
 static ray3f sample_camera(const trace_camera* camera, const vec2i& ij,
     const vec2i& image_size, const vec2f& puv, const vec2f& luv, bool tent) {
@@ -823,23 +855,46 @@ namespace yocto {
 
 // Build the bvh acceleration structure.
 void init_bvh(trace_bvh* bvh, const trace_scene* scene,
-    const trace_params& params, const progress_callback& progress_cb) {
+    const trace_params& params, const progress_callback& progress_cb,
+    cancel_token* cancel) {
   // initialize bvh
   for (auto shape : scene->shapes) {
     add_shape(bvh, shape->points, shape->lines, shape->triangles, shape->quads,
         shape->positions, shape->radius, true);
   }
+  // groups are shared by all instances of the same group and shape, that
+  // place them with their own frame at traversal
+  auto group_ids = vector<int>(scene->instances.size(), -1);
+  auto group_map = unordered_map<trace_group*, unordered_map<int, int>>{};
+  for (auto idx = 0; idx < (int)scene->instances.size(); idx++) {
+    auto instance = scene->instances[idx];
+    auto group    = instance->group;
+    if (group == nullptr) continue;
+    auto  shape_id = instance->shape->shape_id;
+    auto& shared   = group_map[group];
+    auto  it       = shared.find(shape_id);
+    if (it != shared.end()) {
+      group_ids[idx] = it->second;
+    } else {
+      group_ids[idx]   = add_group(bvh, shape_id, group->frames, true);
+      shared[shape_id] = group_ids[idx];
+    }
+  }
   set_instances(
       bvh, (int)scene->instances.size(),
-      [scene](int idx) {
+      [scene, group_ids](int idx) {
         auto instance = scene->instances[idx];
-        return bvh_instance{instance->frame, instance->shape->shape_id};
+        return bvh_instance{instance->frame, instance->shape->shape_id,
+            instance->moving, instance->motion_frame, group_ids[idx]};
       },
       true);
 
   // build
-  init_bvh(bvh, bvh_params{(bvh_build_type)params.bvh, params.noparallel},
-      progress_cb);
+  init_bvh(bvh,
+      bvh_params{(bvh_build_type)params.bvh, params.noparallel,
+          params.bvhwidth, params.bvhquantize, params.bvhprecompute,
+          params.bvhcache, params.bvhbudget},
+      progress_cb, cancel);
 }
 
 // Refit bvh data
@@ -1143,15 +1198,24 @@ static float sample_scattering_pdf(
 
 // Sample lights wrt solid angle
 static vec3f sample_lights(const trace_scene* scene, const trace_lights* lights,
-    const vec3f& position, float rl, float rel, const vec2f& ruv) {
+    const vec3f& position, float time, float rl, float rel, const vec2f& ruv) {
   auto light_id = sample_uniform((int)lights->lights.size(), rl);
   auto light    = lights->lights[light_id];
   if (light->instance != nullptr) {
-    auto instance = light->instance;
+    // grouped instances pick a group frame uniformly, reusing the fraction of
+    // the light random number within the light
+    auto subinstance = -1;
+    if (light->instance->group != nullptr) {
+      auto& frames = light->instance->group->frames;
+      subinstance  = sample_uniform(
+          (int)frames.size(), rl * lights->lights.size() - light_id);
+    }
+    auto posed    = trace_instance{};
+    auto instance = eval_instance(light->instance, subinstance, time, posed);
     auto element  = sample_discrete_cdf(light->elements_cdf, rel);
     auto uv       = (!instance->shape->triangles.empty()) ? sample_triangle(ruv)
                                                           : ruv;
-    auto lposition = eval_position(light->instance, element, uv);
+    auto lposition = eval_position(instance, element, uv);
     return normalize(lposition - position);
   } else if (light->environment != nullptr) {
     auto environment = light->environment;
@@ -1174,26 +1238,32 @@ static vec3f sample_lights(const trace_scene* scene, const trace_lights* lights,
 
 // Sample lights pdf
 static float sample_lights_pdf(const trace_scene* scene, const trace_bvh* bvh,
-    const trace_lights* lights, const vec3f& position, const vec3f& direction) {
+    const trace_lights* lights, const vec3f& position, float time,
+    const vec3f& direction) {
   auto pdf = 0.0f;
   for (auto light : lights->lights) {
     if (light->instance != nullptr) {
-      // check all intersection
+      // check all intersection, with the group frames picked uniformly
+      auto num_frames    = light->instance->group != nullptr
+                               ? (int)light->instance->group->frames.size()
+                               : 1;
       auto lpdf          = 0.0f;
       auto next_position = position;
       for (auto bounce = 0; bounce < 100; bounce++) {
-        auto intersection = intersect_bvh(
-            bvh, light->instance->instance_id, {next_position, direction});
+        auto intersection = intersect_bvh(bvh, light->instance->instance_id,
+            {next_position, direction, ray_eps, flt_max, time});
         if (!intersection.hit) break;
         // accumulate pdf
+        auto posed    = trace_instance{};
+        auto instance = eval_instance(
+            light->instance, intersection.subinstance, time, posed);
         auto lposition = eval_position(
-            light->instance, intersection.element, intersection.uv);
-        auto lnormal = eval_element_normal(
-            light->instance, intersection.element);
+            instance, intersection.element, intersection.uv);
+        auto lnormal = eval_element_normal(instance, intersection.element);
         // prob triangle * area triangle = area triangle mesh
         auto area = light->elements_cdf.back();
         lpdf += distance_squared(lposition, position) /
-                (abs(dot(lnormal, direction)) * area);
+                (abs(dot(lnormal, direction)) * area * num_frames);
         // continue
         next_position = lposition + direction * 1e-3f;
       }
@@ -1224,22 +1294,29 @@ static float sample_lights_pdf(const trace_scene* scene, const trace_bvh* bvh,
   return pdf;
 }
 
-// Recursive path tracing.
+// Recursive path tracing, given the intersection of the camera ray.
 static vec4f trace_path(const trace_scene* scene, const trace_bvh* bvh,
-    const trace_lights* lights, const ray3f& ray_, rng_state& rng,
+    const trace_lights* lights, const ray3f& ray_,
+    const bvh_intersection& intersection_, sampler_state& rng,
     const trace_params& params) {
   // initialize
   auto radiance      = zero3f;
   auto weight        = vec3f{1, 1, 1};
   auto ray           = ray_;
+  auto intersection  = intersection_;
+  auto intersected   = true;
   auto volume_stack  = vector<trace_vsdf>{};
   auto max_roughness = 0.0f;
   auto hit           = !params.envhidden && !scene->environments.empty();
 
   // trace  path
   for (auto bounce = 0; bounce < params.bounces; bounce++) {
-    // intersect next point
-    auto intersection = intersect_bvh(bvh, ray);
+    // dimensions of the bounce
+    next_dimensions(rng, trace_bounce_dimensions);
+
+    // intersect next point, if not done already
+    if (!intersected) intersection = intersect_bvh(bvh, ray);
+    intersected = false;
     if (!intersection.hit) {
       if (bounce > 0 || !params.envhidden)
         radiance += weight * eval_environment(scene, ray.d);
@@ -1263,7 +1340,9 @@ static vec4f trace_path(const trace_scene* scene, const trace_bvh* bvh,
     if (!in_volume) {
       // prepare shading point
       auto outgoing = -ray.d;
-      auto instance = scene->instances[intersection.instance];
+      auto posed    = trace_instance{};
+      auto instance = eval_instance(scene->instances[intersection.instance],
+          intersection.subinstance, ray.time, posed);
       auto element  = intersection.element;
       auto uv       = intersection.uv;
       auto position = eval_position(instance, element, uv);
@@ -1280,7 +1359,7 @@ static vec4f trace_path(const trace_scene* scene, const trace_bvh* bvh,
 
       // handle opacity
       if (opacity < 1 && rand1f(rng) >= opacity) {
-        ray = {position + ray.d * 1e-2f, ray.d};
+        ray = {position + ray.d * 1e-2f, ray.d, ray_eps, flt_max, ray.time};
         bounce -= 1;
         continue;
       }
@@ -1296,13 +1375,13 @@ static vec4f trace_path(const trace_scene* scene, const trace_bvh* bvh,
           incoming = sample_bsdfcos(
               bsdf, normal, outgoing, rand1f(rng), rand2f(rng));
         } else {
-          incoming = sample_lights(
-              scene, lights, position, rand1f(rng), rand1f(rng), rand2f(rng));
+          incoming = sample_lights(scene, lights, position, ray.time,
+              rand1f(rng), rand1f(rng), rand2f(rng));
         }
         weight *= eval_bsdfcos(bsdf, normal, outgoing, incoming) /
                   (0.5f * sample_bsdfcos_pdf(bsdf, normal, outgoing, incoming) +
-                      0.5f * sample_lights_pdf(
-                                 scene, bvh, lights, position, incoming));
+                      0.5f * sample_lights_pdf(scene, bvh, lights, position,
+                                 ray.time, incoming));
       } else {
         incoming = sample_delta(bsdf, normal, outgoing, rand1f(rng));
         weight *= eval_delta(bsdf, normal, outgoing, incoming) /
@@ -1321,7 +1400,7 @@ static vec4f trace_path(const trace_scene* scene, const trace_bvh* bvh,
       }
 
       // setup next iteration
-      ray = {position, incoming};
+      ray = {position, incoming, ray_eps, flt_max, ray.time};
     } else {
       // prepare shading point
       auto  outgoing = -ray.d;
@@ -1339,16 +1418,16 @@ static vec4f trace_path(const trace_scene* scene, const trace_bvh* bvh,
       if (rand1f(rng) < 0.5f) {
         incoming = sample_scattering(vsdf, outgoing, rand1f(rng), rand2f(rng));
       } else {
-        incoming = sample_lights(
-            scene, lights, position, rand1f(rng), rand1f(rng), rand2f(rng));
+        incoming = sample_lights(scene, lights, position, ray.time,
+            rand1f(rng), rand1f(rng), rand2f(rng));
       }
-      weight *=
-          eval_scattering(vsdf, outgoing, incoming) /
-          (0.5f * sample_scattering_pdf(vsdf, outgoing, incoming) +
-              0.5f * sample_lights_pdf(scene, bvh, lights, position, incoming));
+      weight *= eval_scattering(vsdf, outgoing, incoming) /
+                (0.5f * sample_scattering_pdf(vsdf, outgoing, incoming) +
+                    0.5f * sample_lights_pdf(scene, bvh, lights, position,
+                               ray.time, incoming));
 
       // setup next iteration
-      ray = {position, incoming};
+      ray = {position, incoming, ray_eps, flt_max, ray.time};
     }
 
     // check weight
@@ -1365,9 +1444,17 @@ static vec4f trace_path(const trace_scene* scene, const trace_bvh* bvh,
   return {radiance.x, radiance.y, radiance.z, hit ? 1.0f : 0.0f};
 }
 
+// Recursive path tracing.
+static vec4f trace_path(const trace_scene* scene, const trace_bvh* bvh,
+    const trace_lights* lights, const ray3f& ray, sampler_state& rng,
+    const trace_params& params) {
+  return trace_path(
+      scene, bvh, lights, ray, intersect_bvh(bvh, ray), rng, params);
+}
+
 // Recursive path tracing.
 static vec4f trace_naive(const trace_scene* scene, const trace_bvh* bvh,
-    const trace_lights* lights, const ray3f& ray_, rng_state& rng,
+    const trace_lights* lights, const ray3f& ray_, sampler_state& rng,
     const trace_params& params) {
   // initialize
   auto radiance = zero3f;
@@ -1377,6 +1464,9 @@ static vec4f trace_naive(const trace_scene* scene, const trace_bvh* bvh,
 
   // trace  path
   for (auto bounce = 0; bounce < params.bounces; bounce++) {
+    // dimensions of the bounce
+    next_dimensions(rng, trace_bounce_dimensions);
+
     // intersect next point
     auto intersection = intersect_bvh(bvh, ray);
     if (!intersection.hit) {
@@ -1387,7 +1477,9 @@ static vec4f trace_naive(const trace_scene* scene, const trace_bvh* bvh,
 
     // prepare shading point
     auto outgoing = -ray.d;
-    auto instance = scene->instances[intersection.instance];
+    auto posed    = trace_instance{};
+    auto instance = eval_instance(scene->instances[intersection.instance],
+        intersection.subinstance, ray.time, posed);
     auto element  = intersection.element;
     auto uv       = intersection.uv;
     auto position = eval_position(instance, element, uv);
@@ -1398,7 +1490,7 @@ static vec4f trace_naive(const trace_scene* scene, const trace_bvh* bvh,
 
     // handle opacity
     if (opacity < 1 && rand1f(rng) >= opacity) {
-      ray = {position + ray.d * 1e-2f, ray.d};
+      ray = {position + ray.d * 1e-2f, ray.d, ray_eps, flt_max, ray.time};
       bounce -= 1;
       continue;
     }
@@ -1431,26 +1523,33 @@ static vec4f trace_naive(const trace_scene* scene, const trace_bvh* bvh,
     }
 
     // setup next iteration
-    ray = {position, incoming};
+    ray = {position, incoming, ray_eps, flt_max, ray.time};
   }
 
   return {radiance.x, radiance.y, radiance.z, hit ? 1.0f : 0.0f};
 }
 
-// Eyelight for quick previewing.
+// Eyelight for quick previewing, given the intersection of the camera ray.
 static vec4f trace_eyelight(const trace_scene* scene, const trace_bvh* bvh,
-    const trace_lights* lights, const ray3f& ray_, rng_state& rng,
+    const trace_lights* lights, const ray3f& ray_,
+    const bvh_intersection& intersection_, sampler_state& rng,
     const trace_params& params) {
   // initialize
-  auto radiance = zero3f;
-  auto weight   = vec3f{1, 1, 1};
-  auto ray      = ray_;
-  auto hit      = !params.envhidden && !scene->environments.empty();
+  auto radiance     = zero3f;
+  auto weight       = vec3f{1, 1, 1};
+  auto ray          = ray_;
+  auto intersection = intersection_;
+  auto intersected  = true;
+  auto hit          = !params.envhidden && !scene->environments.empty();
 
   // trace  path
   for (auto bounce = 0; bounce < max(params.bounces, 4); bounce++) {
-    // intersect next point
-    auto intersection = intersect_bvh(bvh, ray);
+    // dimensions of the bounce
+    next_dimensions(rng, trace_bounce_dimensions);
+
+    // intersect next point, if not done already
+    if (!intersected) intersection = intersect_bvh(bvh, ray);
+    intersected = false;
     if (!intersection.hit) {
       if (bounce > 0 || !params.envhidden)
         radiance += weight * eval_environment(scene, ray.d);
@@ -1459,7 +1558,9 @@ static vec4f trace_eyelight(const trace_scene* scene, const trace_bvh* bvh,
 
     // prepare shading point
     auto outgoing = -ray.d;
-    auto instance = scene->instances[intersection.instance];
+    auto posed    = trace_instance{};
+    auto instance = eval_instance(scene->instances[intersection.instance],
+        intersection.subinstance, ray.time, posed);
     auto element  = intersection.element;
     auto uv       = intersection.uv;
     auto position = eval_position(instance, element, uv);
@@ -1470,7 +1571,7 @@ static vec4f trace_eyelight(const trace_scene* scene, const trace_bvh* bvh,
 
     // handle opacity
     if (opacity < 1 && rand1f(rng) >= opacity) {
-      ray = {position + ray.d * 1e-2f, ray.d};
+      ray = {position + ray.d * 1e-2f, ray.d, ray_eps, flt_max, ray.time};
       bounce -= 1;
       continue;
     }
@@ -1491,15 +1592,23 @@ static vec4f trace_eyelight(const trace_scene* scene, const trace_bvh* bvh,
     if (weight == zero3f || !isfinite(weight)) break;
 
     // setup next iteration
-    ray = {position, incoming};
+    ray = {position, incoming, ray_eps, flt_max, ray.time};
   }
 
   return {radiance.x, radiance.y, radiance.z, hit ? 1.0f : 0.0f};
 }
 
+// Eyelight for quick previewing.
+static vec4f trace_eyelight(const trace_scene* scene, const trace_bvh* bvh,
+    const trace_lights* lights, const ray3f& ray, sampler_state& rng,
+    const trace_params& params) {
+  return trace_eyelight(
+      scene, bvh, lights, ray, intersect_bvh(bvh, ray), rng, params);
+}
+
 // False color rendering
 static vec4f trace_falsecolor(const trace_scene* scene, const trace_bvh* bvh,
-    const trace_lights* lights, const ray3f& ray, rng_state& rng,
+    const trace_lights* lights, const ray3f& ray, sampler_state& rng,
     const trace_params& params) {
   // intersect next point
   auto intersection = intersect_bvh(bvh, ray);
@@ -1509,7 +1618,9 @@ static vec4f trace_falsecolor(const trace_scene* scene, const trace_bvh* bvh,
 
   // prepare shading point
   auto outgoing = -ray.d;
-  auto instance = scene->instances[intersection.instance];
+  auto posed    = trace_instance{};
+  auto instance = eval_instance(scene->instances[intersection.instance],
+      intersection.subinstance, ray.time, posed);
   auto element  = intersection.element;
   auto uv       = intersection.uv;
   auto position = eval_position(instance, element, uv);
@@ -1575,7 +1686,7 @@ static vec4f trace_falsecolor(const trace_scene* scene, const trace_bvh* bvh,
 }
 
 static vec4f trace_albedo(const trace_scene* scene, const trace_bvh* bvh,
-    const trace_lights* lights, const ray3f& ray, rng_state& rng,
+    const trace_lights* lights, const ray3f& ray, sampler_state& rng,
     const trace_params& params, int bounce) {
   auto intersection = intersect_bvh(bvh, ray);
   if (!intersection.hit) {
@@ -1585,10 +1696,12 @@ static vec4f trace_albedo(const trace_scene* scene, const trace_bvh* bvh,
 
   // prepare shading point
   auto outgoing = -ray.d;
-  auto instance = scene->instances[intersection.instance];
+  auto posed    = trace_instance{};
+  auto instance = eval_instance(scene->instances[intersection.instance],
+      intersection.subinstance, ray.time, posed);
   auto element  = intersection.element;
   auto uv       = intersection.uv;
-  auto material = scene->instances[intersection.instance]->material;
+  auto material = instance->material;
   auto position = eval_position(instance, element, uv);
   auto normal   = eval_shading_normal(instance, element, uv, outgoing);
   auto texcoord = eval_texcoord(instance, element, uv);
@@ -1607,7 +1720,8 @@ static vec4f trace_albedo(const trace_scene* scene, const trace_bvh* bvh,
   // handle opacity
   if (opacity < 1.0f) {
     auto blend_albedo = trace_albedo(scene, bvh, lights,
-        ray3f{position + ray.d * 1e-2f, ray.d}, rng, params, bounce);
+        ray3f{position + ray.d * 1e-2f, ray.d, ray_eps, flt_max, ray.time},
+        rng, params, bounce);
     return lerp(blend_albedo, vec4f{albedo.x, albedo.y, albedo.z, 1}, opacity);
   }
 
@@ -1615,11 +1729,13 @@ static vec4f trace_albedo(const trace_scene* scene, const trace_bvh* bvh,
     if (bsdf.transmission != zero3f && material->thin) {
       auto incoming     = -outgoing;
       auto trans_albedo = trace_albedo(scene, bvh, lights,
-          ray3f{position, incoming}, rng, params, bounce + 1);
+          ray3f{position, incoming, ray_eps, flt_max, ray.time}, rng, params,
+          bounce + 1);
 
       incoming         = reflect(outgoing, normal);
       auto spec_albedo = trace_albedo(scene, bvh, lights,
-          ray3f{position, incoming}, rng, params, bounce + 1);
+          ray3f{position, incoming, ray_eps, flt_max, ray.time}, rng, params,
+          bounce + 1);
 
       auto fresnel = fresnel_dielectric(material->ior, outgoing, normal);
       auto dielectric_albedo = lerp(trans_albedo, spec_albedo, fresnel);
@@ -1627,7 +1743,8 @@ static vec4f trace_albedo(const trace_scene* scene, const trace_bvh* bvh,
     } else if (bsdf.metal != zero3f) {
       auto incoming    = reflect(outgoing, normal);
       auto refl_albedo = trace_albedo(scene, bvh, lights,
-          ray3f{position, incoming}, rng, params, bounce + 1);
+          ray3f{position, incoming, ray_eps, flt_max, ray.time}, rng, params,
+          bounce + 1);
       return refl_albedo * vec4f{albedo.x, albedo.y, albedo.z, 1};
     }
   }
@@ -1636,14 +1753,14 @@ static vec4f trace_albedo(const trace_scene* scene, const trace_bvh* bvh,
 }
 
 static vec4f trace_albedo(const trace_scene* scene, const trace_bvh* bvh,
-    const trace_lights* lights, const ray3f& ray, rng_state& rng,
+    const trace_lights* lights, const ray3f& ray, sampler_state& rng,
     const trace_params& params) {
   auto albedo = trace_albedo(scene, bvh, lights, ray, rng, params, 0);
   return clamp(albedo, 0.0, 1.0);
 }
 
 static vec4f trace_normal(const trace_scene* scene, const trace_bvh* bvh,
-    const trace_lights* lights, const ray3f& ray, rng_state& rng,
+    const trace_lights* lights, const ray3f& ray, sampler_state& rng,
     const trace_params& params, int bounce) {
   auto intersection = intersect_bvh(bvh, ray);
   if (!intersection.hit) {
@@ -1652,10 +1769,12 @@ static vec4f trace_normal(const trace_scene* scene, const trace_bvh* bvh,
 
   // prepare shading point
   auto outgoing = -ray.d;
-  auto instance = scene->instances[intersection.instance];
+  auto posed    = trace_instance{};
+  auto instance = eval_instance(scene->instances[intersection.instance],
+      intersection.subinstance, ray.time, posed);
   auto element  = intersection.element;
   auto uv       = intersection.uv;
-  auto material = scene->instances[intersection.instance]->material;
+  auto material = instance->material;
   auto position = eval_position(instance, element, uv);
   auto normal   = eval_shading_normal(instance, element, uv, outgoing);
   auto opacity  = eval_opacity(instance, element, uv, normal, outgoing);
@@ -1664,7 +1783,8 @@ static vec4f trace_normal(const trace_scene* scene, const trace_bvh* bvh,
   // handle opacity
   if (opacity < 1.0f) {
     auto normal = trace_normal(scene, bvh, lights,
-        ray3f{position + ray.d * 1e-2f, ray.d}, rng, params, bounce);
+        ray3f{position + ray.d * 1e-2f, ray.d, ray_eps, flt_max, ray.time},
+        rng, params, bounce);
     return lerp(normal, normal, opacity);
   }
 
@@ -1672,18 +1792,21 @@ static vec4f trace_normal(const trace_scene* scene, const trace_bvh* bvh,
     if (bsdf.transmission != zero3f && material->thin) {
       auto incoming   = -outgoing;
       auto trans_norm = trace_normal(scene, bvh, lights,
-          ray3f{position, incoming}, rng, params, bounce + 1);
+          ray3f{position, incoming, ray_eps, flt_max, ray.time}, rng, params,
+          bounce + 1);
 
       incoming       = reflect(outgoing, normal);
       auto spec_norm = trace_normal(scene, bvh, lights,
-          ray3f{position, incoming}, rng, params, bounce + 1);
+          ray3f{position, incoming, ray_eps, flt_max, ray.time}, rng, params,
+          bounce + 1);
 
       auto fresnel = fresnel_dielectric(material->ior, outgoing, normal);
       return lerp(trans_norm, spec_norm, fresnel);
     } else if (bsdf.metal != zero3f) {
       auto incoming = reflect(outgoing, normal);
-      return trace_normal(scene, bvh, lights, ray3f{position, incoming}, rng,
-          params, bounce + 1);
+      return trace_normal(scene, bvh, lights,
+          ray3f{position, incoming, ray_eps, flt_max, ray.time}, rng, params,
+          bounce + 1);
     }
   }
 
@@ -1691,14 +1814,30 @@ static vec4f trace_normal(const trace_scene* scene, const trace_bvh* bvh,
 }
 
 static vec4f trace_normal(const trace_scene* scene, const trace_bvh* bvh,
-    const trace_lights* lights, const ray3f& ray, rng_state& rng,
+    const trace_lights* lights, const ray3f& ray, sampler_state& rng,
     const trace_params& params) {
   return trace_normal(scene, bvh, lights, ray, rng, params, 0);
 }
 
+// Heatmap of the bvh nodes visited by a ray, on a logarithmic scale up to
+// 1024 nodes. Nodes are counted only if bvh counters are enabled, so the
+// heatmap is not available otherwise.
+#ifdef YOCTO_BVH_STATS
+static vec4f trace_heatmap(const trace_scene* scene, const trace_bvh* bvh,
+    const trace_lights* lights, const ray3f& ray, sampler_state& rng,
+    const trace_params& params) {
+  auto nodes = get_bvh_counters().nodes;
+  intersect_bvh(bvh, ray);
+  nodes     = get_bvh_counters().nodes - nodes;
+  auto heat = srgb_to_rgb(
+      colormap(log2(1 + (float)nodes) / 10, colormap_type::inferno));
+  return {heat.x, heat.y, heat.z, 1};
+}
+#endif
+
 // Trace a single ray from the camera using the given algorithm.
 using sampler_func = vec4f (*)(const trace_scene* scene, const trace_bvh* bvh,
-    const trace_lights* lights, const ray3f& ray, rng_state& rng,
+    const trace_lights* lights, const ray3f& ray, sampler_state& rng,
     const trace_params& params);
 static sampler_func get_trace_sampler_func(const trace_params& params) {
   switch (params.sampler) {
@@ -1708,6 +1847,15 @@ static sampler_func get_trace_sampler_func(const trace_params& params) {
     case trace_sampler_type::falsecolor: return trace_falsecolor;
     case trace_sampler_type::albedo: return trace_albedo;
     case trace_sampler_type::normal: return trace_normal;
+    case trace_sampler_type::heatmap: {
+#ifdef YOCTO_BVH_STATS
+      return trace_heatmap;
+#else
+      throw std::runtime_error("heatmap needs YOCTO_BVH_STATS");
+      return nullptr;
+#endif
+    }
+    case trace_sampler_type::wavefront: return trace_path;
     default: {
       throw std::runtime_error("sampler unknown");
       return nullptr;
@@ -1715,6 +1863,22 @@ static sampler_func get_trace_sampler_func(const trace_params& params) {
   }
 }
 
+// Trace a single ray from the camera given its intersection, for the
+// algorithms that intersect camera rays together. Returns null otherwise.
+using primary_sampler_func = vec4f (*)(const trace_scene* scene,
+    const trace_bvh* bvh, const trace_lights* lights, const ray3f& ray,
+    const bvh_intersection& intersection, sampler_state& rng,
+    const trace_params& params);
+static primary_sampler_func get_trace_primary_sampler_func(
+    const trace_params& params) {
+  switch (params.sampler) {
+    case trace_sampler_type::path: return trace_path;
+    case trace_sampler_type::eyelight: return trace_eyelight;
+    case trace_sampler_type::wavefront: return trace_path;
+    default: return nullptr;
+  }
+}
+
 // Check is a sampler requires lights
 bool is_sampler_lit(const trace_params& params) {
   switch (params.sampler) {
@@ -1724,6 +1888,8 @@ bool is_sampler_lit(const trace_params& params) {
     case trace_sampler_type::falsecolor: return false;
     case trace_sampler_type::albedo: return false;
     case trace_sampler_type::normal: return false;
+    case trace_sampler_type::heatmap: return false;
+    case trace_sampler_type::wavefront: return true;
     default: {
       throw std::runtime_error("sampler unknown");
       return false;
@@ -1731,19 +1897,15 @@ bool is_sampler_lit(const trace_params& params) {
   }
 }
 
-// Trace a block of samples
-void trace_sample(trace_state* state, const trace_scene* scene,
-    const trace_camera* camera, const trace_bvh* bvh,
-    const trace_lights* lights, const vec2i& ij, const trace_params& params) {
-  auto sampler = get_trace_sampler_func(params);
-  auto ray     = sample_camera(camera, ij, state->render.imsize(),
-      rand2f(state->rngs[ij]), rand2f(state->rngs[ij]), params.tentfilter);
-  auto sample  = sampler(scene, bvh, lights, ray, state->rngs[ij], params);
+// Accumulate a sample in the state
+static void accumulate_sample(trace_state* state, const vec2i& ij,
+    vec4f sample, const trace_params& params) {
   if (!isfinite(xyz(sample))) sample = {0, 0, 0, sample.w};
   if (max(sample) > params.clamp)
     sample = sample * (params.clamp / max(sample));
   state->accumulation[ij] += sample;
   state->samples[ij] += 1;
+  state->squares[ij] += luminance(xyz(sample)) * luminance(xyz(sample));
   auto radiance     = state->accumulation[ij].w != 0
                           ? xyz(state->accumulation[ij]) / state->accumulation[ij].w
                           : zero3f;
@@ -1751,7 +1913,544 @@ void trace_sample(trace_state* state, const trace_scene* scene,
   state->render[ij] = {radiance.x, radiance.y, radiance.z, coverage};
 }
 
-// Init a sequence of random number generators.
+// Maximum number of samples per pixel. With adaptive sampling, noisy pixels
+// keep sampling past `samples`, up to `adaptivemax`, or four times `samples`
+// if it is not set.
+static int max_samples(const trace_params& params) {
+  if (params.adaptive <= 0) return params.samples;
+  if (params.adaptivemax <= 0) return params.samples * 4;
+  return max(params.adaptivemax, params.samples);
+}
+
+// Sampler sequence of a trace sequence type.
+static sampler_sequence get_sampler_sequence(const trace_params& params) {
+  switch (params.sequence) {
+    case trace_sequence_type::random: return sampler_sequence::random;
+    case trace_sequence_type::sobol: return sampler_sequence::sobol;
+    case trace_sequence_type::zsobol: return sampler_sequence::zsobol;
+    case trace_sequence_type::bluenoise: return sampler_sequence::bluenoise;
+    default: {
+      throw std::runtime_error("sequence unknown");
+      return sampler_sequence::random;
+    }
+  }
+}
+
+// Sampler of the next sample of a pixel, derived from the seed, the pixel
+// index and the sample index. Samples are then reproducible regardless of
+// the order in which pixels and samples are traced.
+static sampler_state make_pixel_sampler(
+    const trace_state* state, const vec2i& ij, const trace_params& params) {
+  return make_sampler(get_sampler_sequence(params), params.seed, ij,
+      state->render.imsize(), state->samples[ij], max_samples(params));
+}
+
+// Sample a camera ray. Camera dimensions are drawn for the pixel, the lens
+// and the time, in this order.
+static ray3f sample_camera(const trace_camera* camera, const vec2i& ij,
+    const vec2i& image_size, sampler_state& rng, const trace_params& params) {
+  auto puv = rand2f(rng);
+  auto luv = rand2f(rng);
+  auto ray = sample_camera(camera, ij, image_size, puv, luv, params.tentfilter);
+  ray.time = sample_shutter(camera, rng);
+  return ray;
+}
+
+// Trace a block of samples
+void trace_sample(trace_state* state, const trace_scene* scene,
+    const trace_camera* camera, const trace_bvh* bvh,
+    const trace_lights* lights, const vec2i& ij, const trace_params& params) {
+  auto sampler = get_trace_sampler_func(params);
+  auto rng     = make_pixel_sampler(state, ij, params);
+  auto ray = sample_camera(camera, ij, state->render.imsize(), rng, params);
+  auto sample = sampler(scene, bvh, lights, ray, rng, params);
+  accumulate_sample(state, ij, sample, params);
+}
+
+// Trace samples for `num` pixels in a row, starting at `ij`. Camera rays are
+// intersected as a packet, for up to 8 pixels, or as a stream otherwise.
+// Algorithms that do not support this trace one sample at a time.
+static void trace_samples(trace_state* state, const trace_scene* scene,
+    const trace_camera* camera, const trace_bvh* bvh,
+    const trace_lights* lights, const vec2i& ij, int num,
+    const trace_params& params) {
+  auto sampler = get_trace_primary_sampler_func(params);
+  if (sampler == nullptr) {
+    for (auto i = ij.x; i < ij.x + num; i++) {
+      trace_sample(state, scene, camera, bvh, lights, {i, ij.y}, params);
+    }
+    return;
+  }
+
+  // camera rays, with the samplers of the samples
+  auto rngs       = vector<sampler_state>(num);
+  auto camera_ray = [&](int i) {
+    auto pixel = vec2i{ij.x + i, ij.y};
+    rngs[i]    = make_pixel_sampler(state, pixel, params);
+    return sample_camera(
+        camera, pixel, state->render.imsize(), rngs[i], params);
+  };
+
+  // trace samples given the camera rays and their intersections
+  auto trace_rays = [&](const auto& rays, const auto& intersections) {
+    for (auto i = 0; i < num; i++) {
+      auto pixel  = vec2i{ij.x + i, ij.y};
+      auto sample = sampler(
+          scene, bvh, lights, rays[i], intersections[i], rngs[i], params);
+      accumulate_sample(state, pixel, sample, params);
+    }
+  };
+
+  if (num <= 8) {
+    // pad the packet with rays that are skipped
+    auto rays = array<ray3f, 8>{};
+    for (auto& ray : rays) ray.tmax = -1;
+    for (auto i = 0; i < num; i++) rays[i] = camera_ray(i);
+    trace_rays(rays, intersect_bvh_packet(bvh, rays));
+  } else {
+    auto rays = vector<ray3f>(num);
+    for (auto i = 0; i < num; i++) rays[i] = camera_ray(i);
+    trace_rays(rays, intersect_bvh_stream(bvh, rays));
+  }
+}
+
+// Minimum number of samples before a pixel error is estimated.
+const auto adaptive_min_samples = 16;
+
+// Relative error of a pixel, as the standard error of the mean luminance of
+// its samples over the mean. The mean is offset, so that dark pixels, where
+// noise is less visible, do not need many samples.
+static float pixel_error(const trace_state* state, const vec2i& ij) {
+  auto num      = (float)state->samples[ij];
+  auto average  = luminance(xyz(state->accumulation[ij])) / num;
+  auto variance = max(state->squares[ij] / num - average * average, 0.0f);
+  return sqrt(variance / num) / (average + 0.1f);
+}
+
+// Check whether a pixel is below the adaptive sampling error.
+static bool is_converged(
+    const trace_state* state, const vec2i& ij, const trace_params& params) {
+  if (params.adaptive <= 0) return false;
+  if (state->samples[ij] < adaptive_min_samples) return false;
+  return pixel_error(state, ij) <= params.adaptive;
+}
+
+// Trace samples for the pixels of a row, starting at `ij`, that did not
+// converge. Pixels are traced in runs of up to `run` pixels, so that all
+// pixels are traced in the same runs if adaptive sampling is disabled.
+// Returns whether any sample was traced.
+static bool trace_row(trace_state* state, const trace_scene* scene,
+    const trace_camera* camera, const trace_bvh* bvh,
+    const trace_lights* lights, const vec2i& ij, int num, int run,
+    const trace_params& params) {
+  auto traced = false;
+  for (auto i = ij.x; i < ij.x + num;) {
+    if (is_converged(state, {i, ij.y}, params)) {
+      i++;
+      continue;
+    }
+    auto end = i + 1;
+    while (end < ij.x + num && end - i < run &&
+           !is_converged(state, {end, ij.y}, params))
+      end++;
+    trace_samples(
+        state, scene, camera, bvh, lights, {i, ij.y}, end - i, params);
+    traced = true;
+    i      = end;
+  }
+  return traced;
+}
+
+// Trace `batch` samples for the pixels of a tile in one task, so that the
+// tile state stays in cache across samples. Rows are traced in runs of up
+// to 8 pixels, as in trace_samples. Stops early if all pixels converged, and
+// returns whether any sample was traced.
+static bool trace_tile(trace_state* state, const trace_scene* scene,
+    const trace_camera* camera, const trace_bvh* bvh,
+    const trace_lights* lights, const parallel_tile& tile, int batch,
+    const trace_params& params) {
+  auto traced = false;
+  for (auto sample = 0; sample < batch; sample++) {
+    auto traced_sample = false;
+    for (auto j = tile.ymin; j < tile.ymax; j++) {
+      if (trace_row(state, scene, camera, bvh, lights, {tile.xmin, j},
+              tile.xmax - tile.xmin, 8, params))
+        traced_sample = true;
+    }
+    if (!traced_sample) break;
+    traced = true;
+  }
+  return traced;
+}
+
+// Next step of a wavefront path after shading. Paths are either done, skip
+// a transparent surface, or update their weight by a delta or a sampled
+// direction, that needs the lights pdf.
+enum struct trace_path_event : uint8_t { done, skip, delta, sampled };
+
+// Paths of wavefront path tracing, stored as a structure of arrays with one
+// slot per path in flight. Paths keep the weight factor and pdf of their next
+// direction, until the lights pdf is computed in its own stage.
+struct trace_paths {
+  vector<vec2i>            pixels        = {};
+  vector<sampler_state>    rngs          = {};
+  vector<ray3f>            rays          = {};
+  vector<bvh_intersection> intersections = {};
+  vector<vec3f>            radiance      = {};
+  vector<vec3f>            weights       = {};
+  vector<vec3f>            factors       = {};
+  vector<float>            pdfs          = {};
+  vector<float>            roughness     = {};
+  vector<trace_vsdf>       volumes       = {};
+  vector<uint8_t>          in_volumes    = {};
+  vector<uint8_t>          hits          = {};
+  vector<int>              bounces       = {};
+  vector<trace_path_event> events        = {};
+};
+
+// Number of rays intersected together as a stream in wavefront path tracing.
+const auto wavefront_stream_size = 1024;
+
+// Maximum number of paths in flight in wavefront path tracing, that bounds
+// the memory used by the paths regardless of the image size.
+const auto wavefront_max_paths = 65536;
+
+// Shade a wavefront path at its intersection, as in a bounce of trace_path.
+// Accumulates emission, samples the next direction and updates the volume.
+static void shade_path(trace_paths& paths, int idx, sampler_state& rng,
+    const trace_scene* scene, const trace_lights* lights,
+    const trace_params& params) {
+  auto& ray          = paths.rays[idx];
+  auto  intersection = paths.intersections[idx];
+  auto& radiance     = paths.radiance[idx];
+  auto& weight       = paths.weights[idx];
+  auto& event        = paths.events[idx];
+  next_dimensions(rng, trace_bounce_dimensions);
+  if (!intersection.hit) {
+    if (paths.bounces[idx] > 0 || !params.envhidden)
+      radiance += weight * eval_environment(scene, ray.d);
+    event = trace_path_event::done;
+    return;
+  }
+
+  // handle transmission if inside a volume
+  auto in_volume = false;
+  if (paths.in_volumes[idx]) {
+    auto& vsdf     = paths.volumes[idx];
+    auto  distance = sample_transmittance(
+        vsdf.density, intersection.distance, rand1f(rng), rand1f(rng));
+    weight *= eval_transmittance(vsdf.density, distance) /
+              sample_transmittance_pdf(
+                  vsdf.density, distance, intersection.distance);
+    in_volume             = distance < intersection.distance;
+    intersection.distance = distance;
+  }
+
+  // switch between surface and volume
+  if (!in_volume) {
+    // prepare shading point
+    auto outgoing = -ray.d;
+    auto posed    = trace_instance{};
+    auto instance = eval_instance(scene->instances[intersection.instance],
+        intersection.subinstance, ray.time, posed);
+    auto element  = intersection.element;
+    auto uv       = intersection.uv;
+    auto position = eval_position(instance, element, uv);
+    auto normal   = eval_shading_normal(instance, element, uv, outgoing);
+    auto emission = eval_emission(instance, element, uv, normal, outgoing);
+    auto opacity  = eval_opacity(instance, element, uv, normal, outgoing);
+    auto bsdf     = eval_bsdf(instance, element, uv, normal, outgoing);
+
+    // correct roughness
+    if (params.nocaustics) {
+      paths.roughness[idx] = max(bsdf.roughness, paths.roughness[idx]);
+      bsdf.roughness       = paths.roughness[idx];
+    }
+
+    // handle opacity
+    if (opacity < 1 && rand1f(rng) >= opacity) {
+      ray   = {position + ray.d * 1e-2f, ray.d, ray_eps, flt_max, ray.time};
+      event = trace_path_event::skip;
+      return;
+    }
+    paths.hits[idx] = true;
+
+    // accumulate emission
+    radiance += weight * eval_emission(emission, normal, outgoing);
+
+    // next direction
+    auto incoming = zero3f;
+    if (!is_delta(bsdf)) {
+      if (rand1f(rng) < 0.5f) {
+        incoming = sample_bsdfcos(
+            bsdf, normal, outgoing, rand1f(rng), rand2f(rng));
+      } else {
+        incoming = sample_lights(scene, lights, position, ray.time,
+            rand1f(rng), rand1f(rng), rand2f(rng));
+      }
+      paths.factors[idx] = eval_bsdfcos(bsdf, normal, outgoing, incoming);
+      paths.pdfs[idx]    = sample_bsdfcos_pdf(bsdf, normal, outgoing, incoming);
+      event              = trace_path_event::sampled;
+    } else {
+      incoming           = sample_delta(bsdf, normal, outgoing, rand1f(rng));
+      paths.factors[idx] = eval_delta(bsdf, normal, outgoing, incoming);
+      paths.pdfs[idx]    = sample_delta_pdf(bsdf, normal, outgoing, incoming);
+      event              = trace_path_event::delta;
+    }
+
+    // update volume
+    if (has_volume(instance) &&
+        dot(normal, outgoing) * dot(normal, incoming) < 0) {
+      if (!paths.in_volumes[idx]) {
+        paths.volumes[idx]    = eval_vsdf(instance, element, uv);
+        paths.in_volumes[idx] = true;
+      } else {
+        paths.in_volumes[idx] = false;
+      }
+    }
+
+    // setup next iteration
+    ray = {position, incoming, ray_eps, flt_max, ray.time};
+  } else {
+    // prepare shading point
+    auto  outgoing = -ray.d;
+    auto  position = ray.o + ray.d * intersection.distance;
+    auto& vsdf     = paths.volumes[idx];
+    paths.hits[idx] = true;
+
+    // next direction
+    auto incoming = zero3f;
+    if (rand1f(rng) < 0.5f) {
+      incoming = sample_scattering(vsdf, outgoing, rand1f(rng), rand2f(rng));
+    } else {
+      incoming = sample_lights(scene, lights, position, ray.time, rand1f(rng),
+          rand1f(rng), rand2f(rng));
+    }
+    paths.factors[idx] = eval_scattering(vsdf, outgoing, incoming);
+    paths.pdfs[idx]    = sample_scattering_pdf(vsdf, outgoing, incoming);
+    event              = trace_path_event::sampled;
+
+    // setup next iteration
+    ray = {position, incoming, ray_eps, flt_max, ray.time};
+  }
+}
+
+// Update the weight of a wavefront path, after its lights pdf is computed,
+// and end it by russian roulette or at the maximum number of bounces.
+static void update_path(trace_paths& paths, int idx, sampler_state& rng,
+    const trace_params& params) {
+  auto& weight = paths.weights[idx];
+  auto& event  = paths.events[idx];
+  if (event == trace_path_event::done || event == trace_path_event::skip)
+    return;
+  weight *= paths.factors[idx] / paths.pdfs[idx];
+
+  // check weight
+  if (weight == zero3f || !isfinite(weight)) {
+    event = trace_path_event::done;
+    return;
+  }
+
+  // russian roulette
+  if (paths.bounces[idx] > 3) {
+    auto rr_prob = min((float)0.99, max(weight));
+    if (rand1f(rng) >= rr_prob) {
+      event = trace_path_event::done;
+      return;
+    }
+    weight *= 1 / rr_prob;
+  }
+
+  // next bounce
+  if (++paths.bounces[idx] >= params.bounces) event = trace_path_event::done;
+}
+
+// Trace `batch` samples for the pixels that did not converge with wavefront
+// path tracing. Each sample traces one path per pixel in stages, that run
+// over ranges of the active paths: camera rays generation, intersection as
+// ray streams, shading sorted by material, lights pdfs, and weight updates.
+// At most `wavefront_max_paths` paths are in flight, and the slots of the
+// paths that are done are refilled with the next pixels.
+// Paths use the random numbers of their samples in the same order as
+// trace_path, that renders the same image. Returns whether any sample was
+// traced.
+static bool trace_wavefront(trace_state* state, const trace_scene* scene,
+    const trace_camera* camera, const trace_bvh* bvh,
+    const trace_lights* lights, int batch, const trace_params& params,
+    cancel_token* cancel) {
+  // pixels in tile order, so that nearby camera rays are intersected together
+  auto imsize = state->render.imsize();
+  auto tiles  = vector<vec2i>{};
+  for (auto tj = 0; tj < imsize.y; tj += parallel_default_tile) {
+    for (auto ti = 0; ti < imsize.x; ti += parallel_default_tile) {
+      for (auto j = tj; j < min(tj + parallel_default_tile, imsize.y); j++) {
+        for (auto i = ti; i < min(ti + parallel_default_tile, imsize.x); i++) {
+          tiles.push_back({i, j});
+        }
+      }
+    }
+  }
+
+  // material keys used to sort paths, with misses first
+  auto material_keys = unordered_map<const trace_material*, uint32_t>{};
+  for (auto idx = 0; idx < (int)scene->materials.size(); idx++) {
+    material_keys[scene->materials[idx]] = (uint32_t)idx + 1;
+  }
+
+  // run a stage over ranges of paths
+  auto run_stage = [&params](size_t num, size_t grain, auto&& func) {
+    if (params.noparallel) {
+      auto size = grain != 0 ? grain : num;
+      for (auto start = (size_t)0; start < num; start += size)
+        func(start, std::min(start + size, num));
+    } else {
+      parallel_for_range(num, grain, func);
+    }
+  };
+
+  auto paths  = trace_paths{};
+  auto pixels = vector<vec2i>{};
+  auto active = vector<int>{};
+  auto slots  = vector<int>{};
+  auto traced = false;
+  for (auto sample = 0; sample < batch; sample++) {
+    if (is_canceled(cancel)) break;
+
+    // pick the pixels that did not converge
+    pixels.clear();
+    for (auto& ij : tiles) {
+      if (!is_converged(state, ij, params)) pixels.push_back(ij);
+    }
+    if (pixels.empty()) break;
+    traced = true;
+
+    // path slots, all free
+    auto num = std::min(pixels.size(), (size_t)wavefront_max_paths);
+    paths.pixels.resize(num);
+    paths.rngs.resize(num);
+    paths.rays.resize(num);
+    paths.intersections.resize(num);
+    paths.radiance.resize(num);
+    paths.weights.resize(num);
+    paths.factors.resize(num);
+    paths.pdfs.resize(num);
+    paths.roughness.resize(num);
+    paths.volumes.resize(num);
+    paths.in_volumes.resize(num);
+    paths.hits.resize(num);
+    paths.bounces.resize(num);
+    paths.events.resize(num);
+    slots.resize(num);
+    for (auto idx = 0; idx < (int)num; idx++) slots[idx] = (int)num - 1 - idx;
+    active.clear();
+
+    // trace bounces of all active paths
+    auto next = (size_t)0;
+    while (true) {
+      // start paths in the free slots for the next pixels
+      auto first = active.size();
+      while (!slots.empty() && next < pixels.size()) {
+        auto path          = slots.back();
+        paths.pixels[path] = pixels[next++];
+        active.push_back(path);
+        slots.pop_back();
+      }
+      run_stage(active.size() - first, wavefront_stream_size,
+          [&](size_t start, size_t end) {
+            for (auto idx = start; idx < end; idx++) {
+              auto  path             = active[first + idx];
+              auto& ij               = paths.pixels[path];
+              paths.rngs[path]       = make_pixel_sampler(state, ij, params);
+              paths.rays[path]       = sample_camera(
+                  camera, ij, imsize, paths.rngs[path], params);
+              paths.radiance[path]   = zero3f;
+              paths.weights[path]    = {1, 1, 1};
+              paths.roughness[path]  = 0;
+              paths.in_volumes[path] = false;
+              paths.hits[path]       = !params.envhidden &&
+                                 !scene->environments.empty();
+              paths.bounces[path]    = 0;
+              paths.events[path]     = trace_path_event::done;
+            }
+          });
+      if (active.empty()) break;
+
+      // intersect rays as streams
+      run_stage(
+          active.size(), wavefront_stream_size, [&](size_t start, size_t end) {
+            auto rays = vector<ray3f>(end - start);
+            for (auto idx = start; idx < end; idx++)
+              rays[idx - start] = paths.rays[active[idx]];
+            auto intersections = intersect_bvh_stream(bvh, rays);
+            for (auto idx = start; idx < end; idx++)
+              paths.intersections[active[idx]] = intersections[idx - start];
+          });
+
+      // sort paths by material, so that shading is coherent
+      auto material_key = [&](int path) -> uint32_t {
+        auto& intersection = paths.intersections[path];
+        if (!intersection.hit) return 0;
+        return material_keys.at(
+            scene->instances[intersection.instance]->material);
+      };
+      if (params.noparallel) {
+        std::stable_sort(active.begin(), active.end(),
+            [&](int a, int b) { return material_key(a) < material_key(b); });
+      } else {
+        parallel_radix_sort(active, material_key);
+      }
+
+      // shade paths
+      run_stage(active.size(), (size_t)0, [&](size_t start, size_t end) {
+        for (auto idx = start; idx < end; idx++) {
+          auto path = active[idx];
+          shade_path(
+              paths, path, paths.rngs[path], scene, lights, params);
+        }
+      });
+
+      // compute the lights pdfs of sampled directions
+      run_stage(active.size(), (size_t)0, [&](size_t start, size_t end) {
+        for (auto idx = start; idx < end; idx++) {
+          auto path = active[idx];
+          if (paths.events[path] != trace_path_event::sampled) continue;
+          auto& ray        = paths.rays[path];
+          paths.pdfs[path] = 0.5f * paths.pdfs[path] +
+                             0.5f * sample_lights_pdf(scene, bvh, lights,
+                                        ray.o, ray.time, ray.d);
+        }
+      });
+
+      // update paths and accumulate the ones that are done
+      run_stage(active.size(), (size_t)0, [&](size_t start, size_t end) {
+        for (auto idx = start; idx < end; idx++) {
+          auto  path = active[idx];
+          auto& ij   = paths.pixels[path];
+          update_path(paths, path, paths.rngs[path], params);
+          if (paths.events[path] != trace_path_event::done) continue;
+          auto& radiance = paths.radiance[path];
+          accumulate_sample(state, ij,
+              {radiance.x, radiance.y, radiance.z,
+                  paths.hits[path] ? 1.0f : 0.0f},
+              params);
+        }
+      });
+
+      // compact active paths, freeing the slots of the ones that are done
+      for (auto path : active) {
+        if (paths.events[path] == trace_path_event::done) slots.push_back(path);
+      }
+      active.erase(std::remove_if(active.begin(), active.end(),
+                       [&paths](int path) {
+                         return paths.events[path] == trace_path_event::done;
+                       }),
+          active.end());
+    }
+  }
+  return traced;
+}
+
+// Init the state images.
 void init_state(trace_state* state, const trace_scene* scene,
     const trace_camera* camera, const trace_params& params) {
   auto image_size = (camera->aspect >= 1)
@@ -1762,11 +2461,7 @@ void init_state(trace_state* state, const trace_scene* scene,
   state->render.assign(image_size, zero4f);
   state->accumulation.assign(image_size, zero4f);
   state->samples.assign(image_size, 0);
-  state->rngs.assign(image_size, {});
-  auto rng_ = make_rng(1301081);
-  for (auto& rng : state->rngs) {
-    rng = make_rng(params.seed, rand1i(rng_, 1 << 31) / 2 + 1);
-  }
+  state->squares.assign(image_size, 0);
 }
 
 // Forward declaration
@@ -1788,28 +2483,35 @@ void init_lights(trace_lights* lights, const trace_scene* scene,
     if (instance->material->emission == zero3f) continue;
     auto shape = instance->shape;
     if (shape->triangles.empty() && shape->quads.empty()) continue;
+    if (instance->group != nullptr && instance->group->frames.empty()) continue;
     if (progress_cb) progress_cb("build light", progress.x++, ++progress.y);
     auto light         = add_light(lights);
     light->instance    = instance;
     light->environment = nullptr;
     if (!shape->triangles.empty()) {
       light->elements_cdf = vector<float>(shape->triangles.size());
-      for (auto idx = 0; idx < light->elements_cdf.size(); idx++) {
-        auto& t                  = shape->triangles[idx];
-        light->elements_cdf[idx] = triangle_area(shape->positions[t.x],
-            shape->positions[t.y], shape->positions[t.z]);
-        if (idx != 0) light->elements_cdf[idx] += light->elements_cdf[idx - 1];
-      }
+      parallel_for_range(light->elements_cdf.size(), (size_t)0,
+          [light, shape](size_t start, size_t end) {
+            for (auto idx = start; idx < end; idx++) {
+              auto& t                  = shape->triangles[idx];
+              light->elements_cdf[idx] = triangle_area(shape->positions[t.x],
+                  shape->positions[t.y], shape->positions[t.z]);
+            }
+          });
+      parallel_inclusive_scan(light->elements_cdf);
     }
     if (!shape->quads.empty()) {
       light->elements_cdf = vector<float>(shape->quads.size());
-      for (auto idx = 0; idx < light->elements_cdf.size(); idx++) {
-        auto& t                  = shape->quads[idx];
-        light->elements_cdf[idx] = quad_area(shape->positions[t.x],
-            shape->positions[t.y], shape->positions[t.z],
-            shape->positions[t.w]);
-        if (idx != 0) light->elements_cdf[idx] += light->elements_cdf[idx - 1];
-      }
+      parallel_for_range(light->elements_cdf.size(), (size_t)0,
+          [light, shape](size_t start, size_t end) {
+            for (auto idx = start; idx < end; idx++) {
+              auto& t                  = shape->quads[idx];
+              light->elements_cdf[idx] = quad_area(shape->positions[t.x],
+                  shape->positions[t.y], shape->positions[t.z],
+                  shape->positions[t.w]);
+            }
+          });
+      parallel_inclusive_scan(light->elements_cdf);
     }
   }
   for (auto environment : scene->environments) {
@@ -1823,13 +2525,16 @@ void init_lights(trace_lights* lights, const trace_scene* scene,
       auto size           = texture_size(texture);
       light->elements_cdf = vector<float>(size.x * size.y);
       if (size != zero2i) {
-        for (auto i = 0; i < light->elements_cdf.size(); i++) {
-          auto ij                = vec2i{i % size.x, i / size.x};
-          auto th                = (ij.y + 0.5f) * pif / size.y;
-          auto value             = lookup_texture(texture, ij);
-          light->elements_cdf[i] = max(value) * sin(th);
-          if (i != 0) light->elements_cdf[i] += light->elements_cdf[i - 1];
-        }
+        parallel_for_range(light->elements_cdf.size(), (size_t)0,
+            [light, texture, size](size_t start, size_t end) {
+              for (auto i = (int)start; i < (int)end; i++) {
+                auto ij                = vec2i{i % size.x, i / size.x};
+                auto th                = (ij.y + 0.5f) * pif / size.y;
+                auto value             = lookup_texture(texture, ij);
+                light->elements_cdf[i] = max(value) * sin(th);
+              }
+            });
+        parallel_inclusive_scan(light->elements_cdf);
       }
     }
   }
@@ -1841,45 +2546,80 @@ void init_lights(trace_lights* lights, const trace_scene* scene,
 // Progressively computes an image.
 image<vec4f> trace_image(const trace_scene* scene, const trace_camera* camera,
     const trace_params& params, const progress_callback& progress_cb,
-    const image_callback& image_cb) {
+    const image_callback& image_cb, cancel_token* cancel) {
   auto bvh_guard = std::make_unique<trace_bvh>();
   auto bvh       = bvh_guard.get();
-  init_bvh(bvh, scene, params, progress_cb);
+  init_bvh(bvh, scene, params, progress_cb, cancel);
+  if (is_canceled(cancel)) return {};
 
   auto lights_guard = std::make_unique<trace_lights>();
   auto lights       = lights_guard.get();
   init_lights(lights, scene, params, progress_cb);
 
-  return trace_image(scene, camera, bvh, lights, params, progress_cb, image_cb);
+  return trace_image(
+      scene, camera, bvh, lights, params, progress_cb, image_cb, cancel);
 }
 
 // Progressively compute an image by calling trace_samples multiple times.
 image<vec4f> trace_image(const trace_scene* scene, const trace_camera* camera,
     const trace_bvh* bvh, const trace_lights* lights,
     const trace_params& params, const progress_callback& progress_cb,
-    const image_callback& image_cb) {
+    const image_callback& image_cb, cancel_token* cancel) {
   auto state_guard = std::make_unique<trace_state>();
-  auto state       = state_guard.get();
-  init_state(state, scene, camera, params);
+  return trace_image(state_guard.get(), scene, camera, bvh, lights, params,
+      progress_cb, image_cb, cancel);
+}
 
-  for (auto sample = 0; sample < params.samples; sample++) {
-    if (progress_cb) progress_cb("trace image", sample, params.samples);
-    if (params.noparallel) {
+// Progressively compute an image by calling trace_samples multiple times.
+// Each pass traces a batch of samples per tile, or over all pixels for
+// wavefront path tracing, and reports the image. Passes stop once all pixels
+// converged.
+image<vec4f> trace_image(trace_state* state, const trace_scene* scene,
+    const trace_camera* camera, const trace_bvh* bvh,
+    const trace_lights* lights, const trace_params& params,
+    const progress_callback& progress_cb, const image_callback& image_cb,
+    cancel_token* cancel) {
+  init_state(state, scene, camera, params);
+  auto samples = max_samples(params);
+
+  for (auto sample = 0; sample < samples;) {
+    if (is_canceled(cancel)) return state->render;
+    set_progress(cancel, sample, samples);
+    if (progress_cb) progress_cb("trace image", sample, samples);
+    auto batch  = clamp(params.batch, 1, samples - sample);
+    auto traced = std::atomic<bool>{false};
+    if (params.sampler == trace_sampler_type::wavefront) {
+      traced = trace_wavefront(
+          state, scene, camera, bvh, lights, batch, params, cancel);
+    } else if (params.noparallel) {
       for (auto j = 0; j < state->render.height(); j++) {
-        for (auto i = 0; i < state->render.width(); i++) {
-          trace_sample(state, scene, camera, bvh, lights, {i, j}, params);
+        if (is_canceled(cancel)) break;
+        for (auto s = 0; s < batch; s++) {
+          auto width = state->render.width();
+          if (!trace_row(state, scene, camera, bvh, lights, {0, j}, width,
+                  width, params))
+            break;
+          traced = true;
         }
       }
     } else {
-      parallel_for(state->render.width(), state->render.height(),
-          [state, scene, camera, bvh, lights, &params](int i, int j) {
-            trace_sample(state, scene, camera, bvh, lights, {i, j}, params);
-          });
+      parallel_for_tiles(
+          state->render.width(), state->render.height(),
+          parallel_default_tile,
+          [state, scene, camera, bvh, lights, batch, &params, &traced](
+              const parallel_tile& tile) {
+            if (trace_tile(
+                    state, scene, camera, bvh, lights, tile, batch, params))
+              traced = true;
+          },
+          parallel_tile_order::morton, cancel);
     }
-    if (image_cb) image_cb(state->render, sample + 1, params.samples);
+    sample = traced ? sample + batch : samples;
+    if (image_cb) image_cb(state->render, sample, samples);
   }
+  set_progress(cancel, samples, samples);
 
-  if (progress_cb) progress_cb("trace image", params.samples, params.samples);
+  if (progress_cb) progress_cb("trace image", samples, samples);
   return state->render;
 }
 
@@ -1891,14 +2631,17 @@ void trace_start(trace_state* state, const trace_scene* scene,
     const async_callback& async_cb) {
   init_state(state, scene, camera, params);
   state->worker = {};
-  state->stop   = false;
+  reset_cancel(&state->cancel);
+  auto samples = max_samples(params);
 
   // render preview
-  if (progress_cb) progress_cb("trace preview", 0, params.samples);
+  if (progress_cb) progress_cb("trace preview", 0, samples);
   auto pprms = params;
   pprms.resolution /= params.pratio;
-  pprms.samples = 1;
-  auto preview  = trace_image(scene, camera, bvh, lights, pprms);
+  pprms.samples  = 1;
+  pprms.adaptive = 0;
+  auto preview   = trace_image(
+      scene, camera, bvh, lights, pprms, {}, {}, &state->cancel);
   for (auto j = 0; j < state->render.height(); j++) {
     for (auto i = 0; i < state->render.width(); i++) {
       auto pi               = clamp(i / params.pratio, 0, preview.width() - 1),
@@ -1906,29 +2649,70 @@ void trace_start(trace_state* state, const trace_scene* scene,
       state->render[{i, j}] = preview[{pi, pj}];
     }
   }
-  if (image_cb) image_cb(state->render, 0, params.samples);
+  if (image_cb) image_cb(state->render, 0, samples);
 
   // start renderer
-  state->worker = std::async(std::launch::async, [=]() {
-    for (auto sample = 0; sample < params.samples; sample++) {
-      if (state->stop) return;
-      if (progress_cb) progress_cb("trace image", sample, params.samples);
-      parallel_for(
-          state->render.width(), state->render.height(), [&](int i, int j) {
-            if (state->stop) return;
-            trace_sample(state, scene, camera, bvh, lights, {i, j}, params);
-            if (async_cb)
-              async_cb(state->render, sample, params.samples, {i, j});
-          });
-      if (image_cb) image_cb(state->render, sample + 1, params.samples);
+  state->worker = run_async([=]() {
+    for (auto sample = 0; sample < samples;) {
+      if (is_canceled(&state->cancel)) return;
+      set_progress(&state->cancel, sample, samples);
+      if (progress_cb) progress_cb("trace image", sample, samples);
+      auto batch  = clamp(params.batch, 1, samples - sample);
+      auto traced = std::atomic<bool>{false};
+      if (params.sampler == trace_sampler_type::wavefront) {
+        traced = trace_wavefront(
+            state, scene, camera, bvh, lights, batch, params, &state->cancel);
+        if (traced && async_cb) {
+          for (auto j = 0; j < state->render.height(); j++) {
+            for (auto i = 0; i < state->render.width(); i++) {
+              async_cb(state->render, sample, samples, {i, j});
+            }
+          }
+        }
+      } else {
+        parallel_for_tiles(
+            state->render.width(), state->render.height(),
+            parallel_default_tile,
+            [&](const parallel_tile& tile) {
+              if (!trace_tile(
+                      state, scene, camera, bvh, lights, tile, batch, params))
+                return;
+              traced = true;
+              if (!async_cb) return;
+              for (auto j = tile.ymin; j < tile.ymax; j++) {
+                for (auto i = tile.xmin; i < tile.xmax; i++) {
+                  async_cb(state->render, sample, samples, {i, j});
+                }
+              }
+            },
+            parallel_tile_order::morton, &state->cancel);
+      }
+      if (is_canceled(&state->cancel)) return;
+      sample = traced ? sample + batch : samples;
+      if (image_cb) image_cb(state->render, sample, samples);
     }
-    if (progress_cb) progress_cb("trace image", params.samples, params.samples);
-    if (image_cb) image_cb(state->render, params.samples, params.samples);
+    set_progress(&state->cancel, samples, samples);
+    if (progress_cb) progress_cb("trace image", samples, samples);
+    if (image_cb) image_cb(state->render, samples, samples);
   });
 }
+
+// Heatmap of the number of samples per pixel
+image<vec4f> get_samples_heatmap(const trace_state* state) {
+  auto heatmap     = image<vec4f>{state->samples.imsize()};
+  auto max_samples = 1;
+  for (auto samples : state->samples) max_samples = max(max_samples, samples);
+  for (auto idx = (size_t)0; idx < heatmap.count(); idx++) {
+    auto heat = srgb_to_rgb(colormap(
+        (float)state->samples[idx] / max_samples, colormap_type::inferno));
+    heatmap[idx] = {heat.x, heat.y, heat.z, 1};
+  }
+  return heatmap;
+}
+
 void trace_stop(trace_state* state) {
   if (state == nullptr) return;
-  state->stop = true;
+  cancel_work(&state->cancel);
   if (state->worker.valid()) state->worker.get();
 }
 
@@ -1947,7 +2731,11 @@ namespace yocto {
   serialize_property(mode, json, value.resolution, "resolution", "Image resolution.");
   serialize_property(mode, json, value.sampler, "sampler", "Sampler type.");
   serialize_property(mode, json, value.falsecolor, "falsecolor", "False color type.");
+  serialize_property(mode, json, value.sequence, "sequence", "Sampling sequence.");
   serialize_property(mode, json, value.samples, "samples", "Number of samples.");
+  serialize_property(mode, json, value.batch, "batch", "Samples per tile in each pass.");
+  serialize_property(mode, json, value.adaptive, "adaptive", "Adaptive sampling relative error.");
+  serialize_property(mode, json, value.adaptivemax, "adaptivemax", "Adaptive sampling maximum samples.");
   serialize_property(mode, json, value.bounces, "bounces", "Number of bounces.");
   serialize_property(mode, json, value.clamp, "clamp", "Clamp value.");
   serialize_property(mode, json, value.nocaustics, "nocaustics", "Disable caustics.");
@@ -1955,6 +2743,11 @@ namespace yocto {
   serialize_property(mode, json, value.tentfilter, "tentfilter", "Filter image.");
   serialize_property(mode, json, value.seed, "seed", "Random seed.");
   serialize_property(mode, json, value.bvh, "bvh", "Bvh type.");
+  serialize_property(mode, json, value.bvhwidth, "bvhwidth", "Bvh node width.");
+  serialize_property(mode, json, value.bvhquantize, "bvhquantize", "Bvh quantization bits.");
+  serialize_property(mode, json, value.bvhprecompute, "bvhprecompute", "Precompute bvh leaf triangles.");
+  serialize_property(mode, json, value.bvhcache, "bvhcache", "Bvh cache directory.");
+  serialize_property(mode, json, value.bvhbudget, "bvhbudget", "Bvh spatial split budget.");
   serialize_property(mode, json, value.noparallel, "noparallel", "Disable threading.");
   serialize_property(mode, json, value.pratio, "pratio", "Preview ratio.");
   serialize_property(mode, json, value.exposure, "exposure", "Image exposure.");
@@ -1968,6 +2761,9 @@ namespace yocto {
       {trace_bvh_type::highquality, "highquality"},
       {trace_bvh_type::middle, "middle"},
       {trace_bvh_type::balanced, "balanced"},
+      {trace_bvh_type::lbvh, "lbvh"},
+      {trace_bvh_type::hlbvh, "hlbvh"},
+      {trace_bvh_type::spatial, "spatial"},
 #ifdef YOCTO_EMBREE
       {trace_bvh_type::embree_default, "embree-default"},
       {trace_bvh_type::embree_highquality, "embree-highquality"},
@@ -2014,10 +2810,23 @@ const vector<pair<trace_sampler_type, string>>& json_enum_labels(
           {trace_sampler_type::eyelight, "eyelight"},
           {trace_sampler_type::falsecolor, "falsecolor"},
           {trace_sampler_type::albedo, "albedo"},
-          {trace_sampler_type::normal, "normal"}};
+          {trace_sampler_type::normal, "normal"},
+          {trace_sampler_type::heatmap, "heatmap"},
+          {trace_sampler_type::wavefront, "wavefront"}};
   return trace_sampler_labels;
 }
 
+const vector<pair<trace_sequence_type, string>>& json_enum_labels(
+    trace_sequence_type) {
+  static const auto trace_sequence_labels =
+      vector<pair<trace_sequence_type, string>>{
+          {trace_sequence_type::random, "random"},
+          {trace_sequence_type::sobol, "sobol"},
+          {trace_sequence_type::zsobol, "zsobol"},
+          {trace_sequence_type::bluenoise, "bluenoise"}};
+  return trace_sequence_labels;
+}
+
 // clang-format on
 
 }  // namespace yocto
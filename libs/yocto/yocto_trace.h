@@ -47,6 +47,7 @@
 #include "yocto_bvh.h"
 #include "yocto_image.h"
 #include "yocto_math.h"
+#include "yocto_parallel.h"
 #include "yocto_sampling.h"
 
 // -----------------------------------------------------------------------------
@@ -82,6 +83,8 @@ namespace yocto {
 // 2.4:1  on 35 mm:  0.036 x 0.015   or 0.05760 x 0.024 (approx. 2.39 : 1)
 // To compute good apertures, one can use the F-stop number from photography
 // and set the aperture to focal length over f-stop.
+// For motion blur, rays are sampled at times in the shutter interval, where
+// time 0 and 1 correspond to the instance frames and motion frames.
 struct trace_camera {
   frame3f frame        = identity3x4f;
   bool    orthographic = false;
@@ -90,6 +93,7 @@ struct trace_camera {
   float   aspect       = 1.500;
   float   focus        = 10000;
   float   aperture     = 0;
+  vec2f   shutter      = {0, 0};
 };
 
 // Texture containing either an LDR or HDR image. HdR images are encoded
@@ -173,11 +177,21 @@ struct trace_shape {
   int shape_id = -1;
 };
 
-// Object.
+// Instance group, that places an instance at many frames.
+struct trace_group {
+  vector<frame3f> frames = {};
+};
+
+// Object. Moving instances are interpolated linearly from `frame` at time 0
+// to `motion_frame` at time 1. Instances of a group are placed at each group
+// frame, with the instance frame placing the whole group.
 struct trace_instance {
-  frame3f         frame    = identity3x4f;
-  trace_shape*    shape    = nullptr;
-  trace_material* material = nullptr;
+  frame3f         frame        = identity3x4f;
+  trace_shape*    shape        = nullptr;
+  trace_material* material     = nullptr;
+  bool            moving       = false;
+  frame3f         motion_frame = identity3x4f;
+  trace_group*    group        = nullptr;
 
   // instance id assigned at creation
   int instance_id = -1;
@@ -205,6 +219,7 @@ struct trace_scene {
   vector<trace_shape*>       shapes       = {};
   vector<trace_texture*>     textures     = {};
   vector<trace_material*>    materials    = {};
+  vector<trace_group*>       groups       = {};
 
   // cleanup
   ~trace_scene();
@@ -224,6 +239,7 @@ trace_instance*    add_instance(trace_scene* scene);
 trace_material*    add_material(trace_scene* scene);
 trace_shape*       add_shape(trace_scene* scene);
 trace_texture*     add_texture(trace_scene* scene);
+trace_group*       add_group(trace_scene* scene);
 trace_instance*    add_complete_instance(trace_scene* scene);
 
 }  // namespace yocto
@@ -350,6 +366,9 @@ enum struct trace_bvh_type {
   highquality,
   middle,
   balanced,
+  lbvh,
+  hlbvh,
+  spatial,
 #ifdef YOCTO_EMBREE
   embree_default,
   embree_highquality,
@@ -365,7 +384,17 @@ enum struct trace_sampler_type {
   falsecolor,  // false color rendering
   albedo,      // renders the (approximate) albedo of objects for denoising
   normal,      // renders the normals of objects for denoising
+  heatmap,     // renders the bvh nodes visited by camera rays
+  wavefront,   // path tracing in stages over all pixels
 };
+// Sequence used to sample pixels, as in sampler_sequence
+enum struct trace_sequence_type {
+  random,     // independent random numbers
+  sobol,      // Owen-scrambled Sobol
+  zsobol,     // Sobol shuffled in Z-order over pixels
+  bluenoise,  // Sobol dithered by a blue-noise mask
+};
+
 // Type of false color visualization
 enum struct trace_falsecolor_type {
   // clang-format off
@@ -380,20 +409,29 @@ const auto trace_default_seed = 961748941ull;
 
 // Options for trace functions
 struct trace_params {
-  int                   resolution = 1280;
-  trace_sampler_type    sampler    = trace_sampler_type::path;
-  trace_falsecolor_type falsecolor = trace_falsecolor_type::diffuse;
-  int                   samples    = 512;
-  int                   bounces    = 8;
-  float                 clamp      = 100;
-  bool                  nocaustics = false;
-  bool                  envhidden  = false;
-  bool                  tentfilter = false;
-  uint64_t              seed       = trace_default_seed;
-  trace_bvh_type        bvh        = trace_bvh_type::default_;
-  bool                  noparallel = false;
-  int                   pratio     = 8;
-  float                 exposure   = 0;
+  int                   resolution    = 1280;
+  trace_sampler_type    sampler       = trace_sampler_type::path;
+  trace_falsecolor_type falsecolor    = trace_falsecolor_type::diffuse;
+  trace_sequence_type   sequence      = trace_sequence_type::random;
+  int                   samples       = 512;
+  int                   batch         = 1;
+  float                 adaptive      = 0;
+  int                   adaptivemax   = 0;
+  int                   bounces       = 8;
+  float                 clamp         = 100;
+  bool                  nocaustics    = false;
+  bool                  envhidden     = false;
+  bool                  tentfilter    = false;
+  uint64_t              seed          = trace_default_seed;
+  trace_bvh_type        bvh           = trace_bvh_type::default_;
+  int                   bvhwidth      = 2;
+  int                   bvhquantize   = 0;
+  bool                  bvhprecompute = false;
+  string                bvhcache      = "";
+  float                 bvhbudget     = 0.5f;
+  bool                  noparallel    = false;
+  int                   pratio        = 8;
+  float                 exposure      = 0;
 };
 
 const auto trace_sampler_labels = vector<pair<trace_sampler_type, string>>{
@@ -401,7 +439,9 @@ const auto trace_sampler_labels = vector<pair<trace_sampler_type, string>>{
     {trace_sampler_type::eyelight, "eyelight"},
     {trace_sampler_type::falsecolor, "falsecolor"},
     {trace_sampler_type::albedo, "albedo"},
-    {trace_sampler_type::normal, "normal"}};
+    {trace_sampler_type::normal, "normal"},
+    {trace_sampler_type::heatmap, "heatmap"},
+    {trace_sampler_type::wavefront, "wavefront"}};
 
 const auto trace_falsecolor_labels =
     vector<pair<trace_falsecolor_type, string>>{
@@ -427,11 +467,20 @@ const auto trace_falsecolor_labels =
         {trace_falsecolor_type::element, "element"},
         {trace_falsecolor_type::highlight, "highlight"}};
 
+const auto trace_sequence_labels = vector<pair<trace_sequence_type, string>>{
+    {trace_sequence_type::random, "random"},
+    {trace_sequence_type::sobol, "sobol"},
+    {trace_sequence_type::zsobol, "zsobol"},
+    {trace_sequence_type::bluenoise, "bluenoise"}};
+
 const auto trace_bvh_labels = vector<pair<trace_bvh_type, string>>{
     {trace_bvh_type::default_, "default"},
     {trace_bvh_type::highquality, "highquality"},
     {trace_bvh_type::middle, "middle"},
     {trace_bvh_type::balanced, "balanced"},
+    {trace_bvh_type::lbvh, "lbvh"},
+    {trace_bvh_type::hlbvh, "hlbvh"},
+    {trace_bvh_type::spatial, "spatial"},
 #ifdef YOCTO_EMBREE
     {trace_bvh_type::embree_default, "embree-default"},
     {trace_bvh_type::embree_highquality, "embree-highquality"},
@@ -440,15 +489,18 @@ const auto trace_bvh_labels = vector<pair<trace_bvh_type, string>>{
 };
 
 const auto trace_sampler_names = std::vector<std::string>{
-    "path", "naive", "eyelight", "falsecolor", "dalbedo", "dnormal"};
+    "path", "naive", "eyelight", "falsecolor", "dalbedo", "dnormal",
+    "heatmap", "wavefront"};
 
 const auto trace_falsecolor_names = vector<string>{"position", "normal",
     "frontfacing", "gnormal", "gfrontfacing", "texcoord", "color", "emission",
     "diffuse", "specular", "coat", "metal", "transmission", "translucency",
     "refraction", "roughness", "opacity", "ior", "instance", "element",
     "highlight"};
+const auto trace_sequence_names = vector<string>{
+    "random", "sobol", "zsobol", "bluenoise"};
 const auto trace_bvh_names        = vector<string>{
-    "default", "highquality", "middle", "balanced",
+    "default", "highquality", "middle", "balanced", "lbvh", "hlbvh", "spatial",
 #ifdef YOCTO_EMBREE
     "embree-default", "embree-highquality", "embree-compact"
 #endif
@@ -461,15 +513,18 @@ using progress_callback =
 using image_callback =
     function<void(const image<vec4f>& render, int current, int total)>;
 
-// Apply subdivision and displacement rules.
-void tesselate_shapes(
-    trace_scene* scene, const progress_callback& progress_cb = {});
+// Apply subdivision and displacement rules. Long-running functions take an
+// optional cancel token and stop early, leaving partial results, when the
+// token is canceled.
+void tesselate_shapes(trace_scene* scene,
+    const progress_callback& progress_cb = {}, cancel_token* cancel = nullptr);
 void tesselate_shape(trace_scene* shape);
 
-// Progressively computes an image.
+// Progressively computes an image. Each pass renders `batch` samples per
+// tile before moving to the next tile, and reports the image when done.
 image<vec4f> trace_image(const trace_scene* scene, const trace_camera* camera,
     const trace_params& params, const progress_callback& progress_cb = {},
-    const image_callback& image_cb = {});
+    const image_callback& image_cb = {}, cancel_token* cancel = nullptr);
 
 }  // namespace yocto
 
@@ -479,6 +534,7 @@ image<vec4f> trace_image(const trace_scene* scene, const trace_camera* camera,
 namespace yocto {
 
 // Scene lights used during rendering. These are created automatically.
+// Grouped instances are one light, that samples its group frames uniformly.
 struct trace_light {
   trace_instance*    instance     = nullptr;
   trace_environment* environment  = nullptr;
@@ -503,7 +559,8 @@ using trace_bvh = bvh_scene;
 
 // Build the bvh acceleration structure.
 void init_bvh(trace_bvh* bvh, const trace_scene* scene,
-    const trace_params& params, const progress_callback& progress_cb = {});
+    const trace_params& params, const progress_callback& progress_cb = {},
+    cancel_token* cancel = nullptr);
 
 // Refit bvh data
 void update_bvh(trace_bvh* bvh, const trace_scene* scene,
@@ -514,26 +571,44 @@ void update_bvh(trace_bvh* bvh, const trace_scene* scene,
 image<vec4f> trace_image(const trace_scene* scene, const trace_camera* camera,
     const trace_bvh* bvh, const trace_lights* lights,
     const trace_params& params, const progress_callback& progress_cb = {},
-    const image_callback& image_cb = {});
+    const image_callback& image_cb = {}, cancel_token* cancel = nullptr);
 
 // Check is a sampler requires lights
 bool is_sampler_lit(const trace_params& params);
 
-// [experimental] Asynchronous state
+// [experimental] Asynchronous state. Squares hold the sum of the squared
+// luminance of the samples, used to estimate the pixel error. Random numbers
+// are derived from the seed, the pixel and the sample index, and not stored.
 struct trace_state {
-  image<vec4f>     render       = {};
-  image<vec4f>     accumulation = {};
-  image<int>       samples      = {};
-  image<rng_state> rngs         = {};
-  future<void>     worker       = {};  // async
-  atomic<bool>     stop         = {};  // async
+  image<vec4f> render       = {};
+  image<vec4f> accumulation = {};
+  image<int>   samples      = {};
+  image<float> squares      = {};
+  future<void> worker       = {};  // async
+  cancel_token cancel       = {};  // async
 };
 
+// Progressively computes an image in a given state. If `adaptive` is set,
+// pixels stop sampling once the relative error of their luminance is below
+// it, so that samples are spent in noisy regions. Noisy pixels keep sampling
+// past `samples`, up to `adaptivemax` per pixel, or four times `samples` if
+// it is not set. Rendering stops once all pixels converged.
+image<vec4f> trace_image(trace_state* state, const trace_scene* scene,
+    const trace_camera* camera, const trace_bvh* bvh,
+    const trace_lights* lights, const trace_params& params,
+    const progress_callback& progress_cb = {},
+    const image_callback& image_cb = {}, cancel_token* cancel = nullptr);
+
+// Heatmap of the number of samples per pixel, relative to the most sampled
+// pixel, to inspect adaptive sampling.
+image<vec4f> get_samples_heatmap(const trace_state* state);
+
 // [experimental] Callback used to report partially computed image
 using async_callback = function<void(
     const image<vec4f>& render, int current, int total, const vec2i& ij)>;
 
-// [experimental] Asynchronous interface
+// [experimental] Asynchronous interface. Stopping cancels the render and
+// waits for it to finish.
 struct trace_state;
 void trace_start(trace_state* state, const trace_scene* scene,
     const trace_camera* camera, const trace_bvh* bvh,
@@ -561,6 +636,8 @@ const vector<pair<trace_falsecolor_type, string>>& json_enum_labels(
     trace_falsecolor_type);
 const vector<pair<trace_sampler_type, string>>& json_enum_labels(
     trace_sampler_type);
+const vector<pair<trace_sequence_type, string>>& json_enum_labels(
+    trace_sequence_type);
 
 }  // namespace yocto
 